@@ -0,0 +1,551 @@
+/* Command queue benchmark.
+ *
+ * Sends a stream of small commands to a CommandQueue from 1 to 8 producer
+ * threads, comparing the lock-free reservation path (send) with producers
+ * serialized by the queue's spinlock (lock/doSend/unlock). Then measures
+ * dispatch throughput on a synthetic state-change stream, mixing several
+ * command types and sizes like a device setting render states would, both
+ * through the command thread and executed directly on the sending thread.
+ *
+ * Each test also runs against BaselineQueue, a copy of the queue this one
+ * replaced: one fixed ring, producers serialized by a spinlock, virtual
+ * commands, and a condition variable broadcast after every command. Pass
+ * "baseline" or "current" to run only one of the two.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <atomic>
+#include <vector>
+
+#include "commandqueue.hpp"
+#include "trace.hpp"
+
+
+eLogLevel LogLevel = ERR_;
+FILE *LogFile = stderr;
+eLogLevel GLDebugLevel = NONE_;
+
+void log_printf(FILE *file, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(file, fmt, ap);
+    va_end(ap);
+}
+
+
+static const ULONG NumCommandsPerThread = 200000;
+
+static std::atomic<ULONG> ExecutedCount(0);
+
+// The benchmark's commands use opcodes past the library's own, and are
+// dispatched by this file's ExecuteCommand.
+enum BenchOp {
+    BenchOp_Count = CmdOp_Count,
+    BenchOp_Enable,
+    BenchOp_BlendFunc,
+    BenchOp_Viewport,
+    BenchOp_Matrix
+};
+
+class BenchCmd : public Command {
+    ULONG mValue;
+
+public:
+    BenchCmd(ULONG value) : mValue(value) { }
+
+    void execute()
+    { ExecutedCount.fetch_add(mValue, std::memory_order_relaxed); }
+};
+template<> struct CommandTraits<BenchCmd> { static const ULONG sOpcode = BenchOp_Count; };
+
+
+// Fake GL state for the state-change stream to modify.
+static struct {
+    bool enabled[16];
+    ULONG blend_src, blend_dst;
+    LONG viewport[4];
+    float viewport_z[2];
+    float matrix[16];
+    ULONG changes;
+} BenchState;
+
+class BenchEnableCmd : public Command {
+    ULONG mState;
+    bool mEnable;
+
+public:
+    BenchEnableCmd(ULONG state, bool enable) : mState(state), mEnable(enable) { }
+
+    void execute()
+    {
+        BenchState.enabled[mState&15] = mEnable;
+        ++BenchState.changes;
+    }
+};
+template<> struct CommandTraits<BenchEnableCmd> { static const ULONG sOpcode = BenchOp_Enable; };
+
+class BenchBlendFuncCmd : public Command {
+    ULONG mSrc, mDst;
+
+public:
+    BenchBlendFuncCmd(ULONG src, ULONG dst) : mSrc(src), mDst(dst) { }
+
+    void execute()
+    {
+        BenchState.blend_src = mSrc;
+        BenchState.blend_dst = mDst;
+        ++BenchState.changes;
+    }
+};
+template<> struct CommandTraits<BenchBlendFuncCmd> { static const ULONG sOpcode = BenchOp_BlendFunc; };
+
+class BenchViewportCmd : public Command {
+    LONG mX, mY, mWidth, mHeight;
+    float mMinZ, mMaxZ;
+
+public:
+    BenchViewportCmd(LONG x, LONG y, LONG width, LONG height, float minz, float maxz)
+      : mX(x), mY(y), mWidth(width), mHeight(height), mMinZ(minz), mMaxZ(maxz)
+    { }
+
+    void execute()
+    {
+        BenchState.viewport[0] = mX;
+        BenchState.viewport[1] = mY;
+        BenchState.viewport[2] = mWidth;
+        BenchState.viewport[3] = mHeight;
+        BenchState.viewport_z[0] = mMinZ;
+        BenchState.viewport_z[1] = mMaxZ;
+        ++BenchState.changes;
+    }
+};
+template<> struct CommandTraits<BenchViewportCmd> { static const ULONG sOpcode = BenchOp_Viewport; };
+
+class BenchMatrixCmd : public Command {
+    float mMatrix[16];
+
+public:
+    BenchMatrixCmd(float value)
+    {
+        for(float &val : mMatrix)
+            val = value;
+    }
+
+    void execute()
+    {
+        for(int i = 0;i < 16;++i)
+            BenchState.matrix[i] = mMatrix[i];
+        ++BenchState.changes;
+    }
+};
+template<> struct CommandTraits<BenchMatrixCmd> { static const ULONG sOpcode = BenchOp_Matrix; };
+
+template<typename T>
+static inline void execute_bench(Command *cmd)
+{
+    T *typed_cmd = static_cast<T*>(cmd);
+    typed_cmd->execute();
+    typed_cmd->~T();
+}
+
+void ExecuteCommand(Command *cmd)
+{
+    switch(cmd->mOpcode)
+    {
+        case BenchOp_Count: execute_bench<BenchCmd>(cmd); break;
+        case BenchOp_Enable: execute_bench<BenchEnableCmd>(cmd); break;
+        case BenchOp_BlendFunc: execute_bench<BenchBlendFuncCmd>(cmd); break;
+        case BenchOp_Viewport: execute_bench<BenchViewportCmd>(cmd); break;
+        case BenchOp_Matrix: execute_bench<BenchMatrixCmd>(cmd); break;
+        default:
+            fprintf(stderr, "Unexpected opcode %u\n", cmd->mOpcode);
+            abort();
+    }
+}
+
+// The bench commands can't be captured, so just run them.
+void CaptureCommand(Command *cmd, CommandCapture&)
+{
+    ExecuteCommand(cmd);
+}
+
+
+
+// The command queue as it was before the lock-free reservation and opcode
+// dispatch, kept to compare against.
+class BaselineCommand {
+public:
+    virtual ~BaselineCommand() { }
+    virtual ULONG execute() = 0;
+};
+
+class BaselineSkip : public BaselineCommand {
+    ULONG mSkipAmt;
+
+public:
+    BaselineSkip(ULONG amt) : mSkipAmt(amt) { }
+
+    virtual ULONG execute() { return mSkipAmt; }
+};
+
+class BaselineQuit : public BaselineCommand {
+public:
+    virtual ULONG execute() { ExitThread(0); return sizeof(*this); }
+};
+
+// Runs one of the benchmark's commands through a virtual call.
+template<typename T>
+class BaselineCmd : public BaselineCommand {
+    T mCommand;
+
+public:
+    template<typename ...Args>
+    BaselineCmd(Args...args) : mCommand(args...) { }
+
+    virtual ULONG execute() { mCommand.execute(); return sizeof(*this); }
+};
+
+class BaselineSyncCmd : public BaselineCommand {
+    CRITICAL_SECTION &mLock;
+    std::atomic<ULONG> &mFlag;
+
+public:
+    BaselineSyncCmd(CRITICAL_SECTION &lock, std::atomic<ULONG> &flag) : mLock(lock), mFlag(flag) { }
+
+    virtual ULONG execute()
+    {
+        EnterCriticalSection(&mLock);
+        mFlag = 1;
+        LeaveCriticalSection(&mLock);
+        return sizeof(*this);
+    }
+};
+
+class BaselineQueue {
+    static const size_t sQueueBits = 21;
+    static const size_t sQueueSize = 1<<sQueueBits;
+    static const size_t sQueueMask = sQueueSize-1;
+
+    std::atomic<ULONG> mHead, mTail;
+    char *mQueueData;
+    CRITICAL_SECTION mLock;
+    CONDITION_VARIABLE mCondVar;
+    std::atomic<ULONG> mSpinLock;
+    HANDLE mThreadHdl;
+
+    static DWORD CALLBACK thread_func(void *arg)
+    { return reinterpret_cast<BaselineQueue*>(arg)->run(); }
+
+    DWORD run()
+    {
+        while(1)
+        {
+            ULONG tail = mTail.load();
+            if(tail == mHead)
+            {
+                EnterCriticalSection(&mLock);
+                WakeAllConditionVariable(&mCondVar);
+                while(tail == mHead)
+                    SleepConditionVariableCS(&mCondVar, &mLock, INFINITE);
+                LeaveCriticalSection(&mLock);
+            }
+
+            BaselineCommand *cmd = reinterpret_cast<BaselineCommand*>(&mQueueData[tail]);
+            ULONG size = cmd->execute();
+            cmd->~BaselineCommand();
+
+            tail += size;
+            mTail.store(tail&sQueueMask);
+            WakeAllConditionVariable(&mCondVar);
+        }
+        return 0;
+    }
+
+    template<typename T, typename ...Args>
+    void doSizedSend(size_t size, Args...args)
+    {
+        ULONG head = mHead.load();
+        while(1)
+        {
+            ULONG rem_size = sQueueSize - head;
+            if(rem_size < size)
+            {
+                doSizedSend<BaselineSkip>(rem_size, rem_size);
+                head = mHead.load();
+            }
+            if(((mTail-head-1)&sQueueMask) >= size)
+                break;
+
+            EnterCriticalSection(&mLock);
+            WakeAllConditionVariable(&mCondVar);
+            SleepConditionVariableCS(&mCondVar, &mLock, INFINITE);
+            LeaveCriticalSection(&mLock);
+            head = mHead.load();
+        }
+
+        new(&mQueueData[head]) T(args...);
+        head += size;
+        mHead.store(head&sQueueMask);
+    }
+
+public:
+    BaselineQueue() : mHead(0), mTail(0), mQueueData(new char[sQueueSize]), mSpinLock(false)
+    {
+        InitializeCriticalSection(&mLock);
+        InitializeConditionVariable(&mCondVar);
+        mThreadHdl = CreateThread(nullptr, 1024*1024, thread_func, this, 0, nullptr);
+    }
+    ~BaselineQueue()
+    {
+        EnterCriticalSection(&mLock);
+        lock();
+        doSizedSend<BaselineQuit>(sizeof(BaselineQuit));
+        unlock();
+        LeaveCriticalSection(&mLock);
+        WakeAllConditionVariable(&mCondVar);
+        WaitForSingleObject(mThreadHdl, INFINITE);
+        CloseHandle(mThreadHdl);
+        DeleteCriticalSection(&mLock);
+        delete[] mQueueData;
+    }
+
+    void lock()
+    {
+        while(mSpinLock.exchange(true) == true)
+            SwitchToThread();
+    }
+    void unlock() { mSpinLock = false; }
+
+    // Every command is padded to a multiple of a pointer, like the baseline
+    // required of its command types.
+    template<typename T, typename ...Args>
+    void doSend(Args...args)
+    {
+        size_t size = (sizeof(BaselineCmd<T>)+sizeof(void*)-1) & ~(sizeof(void*)-1);
+        doSizedSend<BaselineCmd<T>,Args...>(size, args...);
+    }
+
+    template<typename T, typename ...Args>
+    void send(Args...args)
+    {
+        lock();
+        doSend<T,Args...>(args...);
+        unlock();
+    }
+
+    template<typename T, typename ...Args>
+    void sendSync(Args...args)
+    {
+        std::atomic<ULONG> flag(0);
+        lock();
+        doSend<T,Args...>(args...);
+        doSizedSend<BaselineSyncCmd>(sizeof(BaselineSyncCmd), make_ref(mLock), make_ref(flag));
+        unlock();
+
+        EnterCriticalSection(&mLock);
+        while(!flag)
+        {
+            WakeAllConditionVariable(&mCondVar);
+            SleepConditionVariableCS(&mCondVar, &mLock, INFINITE);
+        }
+        LeaveCriticalSection(&mLock);
+    }
+
+    void flush()
+    {
+        EnterCriticalSection(&mLock);
+        LeaveCriticalSection(&mLock);
+        WakeAllConditionVariable(&mCondVar);
+    }
+};
+
+
+template<typename Q>
+struct ProducerParams {
+    Q *mQueue;
+    std::atomic<bool> *mStart;
+    bool mUseSpinLock;
+};
+
+template<typename Q>
+static DWORD CALLBACK producer_func(void *arg)
+{
+    ProducerParams<Q> *params = reinterpret_cast<ProducerParams<Q>*>(arg);
+    Q &queue = *params->mQueue;
+
+    while(!params->mStart->load())
+        SwitchToThread();
+
+    for(ULONG i = 0;i < NumCommandsPerThread;++i)
+    {
+        if(params->mUseSpinLock)
+        {
+            queue.lock();
+            queue.template doSend<BenchCmd>(1);
+            queue.unlock();
+        }
+        else
+            queue.template send<BenchCmd>(1);
+    }
+    queue.flush();
+
+    return 0;
+}
+
+template<typename Q>
+static double run_bench(Q &queue, UINT numthreads, bool spinlock)
+{
+    std::atomic<bool> start(false);
+    ProducerParams<Q> params{&queue, &start, spinlock};
+    std::vector<HANDLE> threads;
+
+    ExecutedCount = 0;
+    for(UINT i = 0;i < numthreads;++i)
+    {
+        HANDLE thrd = CreateThread(nullptr, 0, producer_func<Q>, &params, 0, nullptr);
+        if(!thrd)
+        {
+            fprintf(stderr, "Failed to create producer thread, error %lu\n", GetLastError());
+            break;
+        }
+        threads.push_back(thrd);
+    }
+
+    LARGE_INTEGER freq, begin, end;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&begin);
+    start = true;
+
+    for(HANDLE thrd : threads)
+    {
+        WaitForSingleObject(thrd, INFINITE);
+        CloseHandle(thrd);
+    }
+    // Wait for the command thread to execute everything that was sent.
+    queue.template sendSync<BenchCmd>(0);
+    QueryPerformanceCounter(&end);
+
+    if(ExecutedCount != threads.size()*NumCommandsPerThread)
+        fprintf(stderr, "Executed %lu commands, expected %lu!\n", (unsigned long)ExecutedCount.load(),
+                (unsigned long)(threads.size()*NumCommandsPerThread));
+
+    double secs = (double)(end.QuadPart-begin.QuadPart) / (double)freq.QuadPart;
+    return (double)(threads.size()*NumCommandsPerThread) / secs;
+}
+
+static const ULONG NumStateChanges = 2000000;
+
+template<typename Q>
+static double run_state_bench(Q &queue)
+{
+    LARGE_INTEGER freq, begin, end;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&begin);
+
+    BenchState.changes = 0;
+    for(ULONG i = 0;i < NumStateChanges;i += 8)
+    {
+        queue.template send<BenchEnableCmd>(i&15, true);
+        queue.template send<BenchBlendFuncCmd>(i, i+1);
+        queue.template send<BenchEnableCmd>((i+1)&15, false);
+        queue.template send<BenchViewportCmd>(0, 0, 640, 480, 0.0f, 1.0f);
+        queue.template send<BenchEnableCmd>((i+2)&15, true);
+        queue.template send<BenchMatrixCmd>((float)i);
+        queue.template send<BenchBlendFuncCmd>(i+1, i);
+        queue.template send<BenchEnableCmd>((i+3)&15, false);
+        if((i&1023) == 0)
+            queue.flush();
+    }
+    queue.template sendSync<BenchCmd>(0);
+    QueryPerformanceCounter(&end);
+
+    if(BenchState.changes != NumStateChanges)
+        fprintf(stderr, "Executed %lu state changes, expected %lu!\n",
+                (unsigned long)BenchState.changes, (unsigned long)NumStateChanges);
+
+    double secs = (double)(end.QuadPart-begin.QuadPart) / (double)freq.QuadPart;
+    return (double)NumStateChanges / secs;
+}
+
+static void run_current()
+{
+    CommandQueue *queue = new CommandQueue();
+    if(!queue->init())
+    {
+        fprintf(stderr, "Failed to start command queue\n");
+        exit(1);
+    }
+
+    printf("current queue\n");
+    printf("threads      lock-free       spinlock  (commands/sec)\n");
+    for(UINT numthreads = 1;numthreads <= 8;++numthreads)
+    {
+        double lockfree = run_bench(*queue, numthreads, false);
+        double spinlock = run_bench(*queue, numthreads, true);
+        printf("%7u %14.0f %14.0f\n", numthreads, lockfree, spinlock);
+    }
+
+    printf("state-change stream: %.0f commands/sec\n", run_state_bench(*queue));
+
+    printf("command thread parked %lu times, producers parked %lu times, %lu segments allocated\n",
+           (unsigned long)queue->getConsumerParks(), (unsigned long)queue->getProducerParks(),
+           (unsigned long)queue->getSegmentCount());
+
+    queue->deinit();
+    delete queue;
+
+    // The same stream executed on this thread, without a command thread.
+    queue = new CommandQueue();
+    queue->init(true);
+    printf("state-change stream, direct: %.0f commands/sec\n", run_state_bench(*queue));
+    queue->deinit();
+    delete queue;
+}
+
+static void run_baseline()
+{
+    BaselineQueue *queue = new BaselineQueue();
+
+    // The baseline's send always takes the spinlock, so there's only the one
+    // column.
+    printf("baseline queue\n");
+    printf("threads       spinlock  (commands/sec)\n");
+    for(UINT numthreads = 1;numthreads <= 8;++numthreads)
+        printf("%7u %14.0f\n", numthreads, run_bench(*queue, numthreads, false));
+
+    printf("state-change stream: %.0f commands/sec\n", run_state_bench(*queue));
+
+    delete queue;
+}
+
+int main(int argc, char **argv)
+{
+    bool baseline = true, current = true;
+    if(argc > 1)
+    {
+        if(strcmp(argv[1], "baseline") == 0)
+            current = false;
+        else if(strcmp(argv[1], "current") == 0)
+            baseline = false;
+        else
+        {
+            fprintf(stderr, "Usage: %s [baseline|current]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if(current)
+        run_current();
+    if(baseline)
+    {
+        if(current) printf("\n");
+        run_baseline();
+    }
+
+    return 0;
+}
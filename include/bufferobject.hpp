@@ -37,7 +37,8 @@ class D3DGLBufferObject : public IDirect3DVertexBuffer9, public IDirect3DIndexBu
     UINT mLockedLength;
     UINT mLockedFlags;
 
-    std::atomic<ULONG> mUpdateInProgress;
+    // Sequence number of the last command loading the buffer data.
+    std::atomic<ULONG> mUpdateSeq;
 
     bool init_common(UINT length, DWORD usage, D3DPOOL pool);
 
@@ -51,6 +52,9 @@ public:
     GLuint getBufferId() const { return mBufferId; }
 
     void resetBufferData(const GLubyte *data, GLuint length);
+    // Loads a range of the buffer, growing it as needed. Used to replay
+    // captured loads.
+    void loadBufferData(UINT offset, UINT length, const GLubyte *data, GLbitfield flags);
 
     void initGL(const GLubyte *data);
     void loadBufferDataGL(UINT offset, UINT length, const GLubyte *data, GLbitfield flags);
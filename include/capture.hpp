@@ -0,0 +1,191 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+
+// File name prefix for command stream captures, from D3DGL_CAPTURE. Empty
+// when capturing is disabled.
+extern std::string QueueCapturePrefix;
+
+
+/* Capture file layout, all little-endian:
+ *
+ * CaptureHeader
+ * NumOpcodes opcode names, each NUL-terminated, padded to a multiple of 4
+ *   bytes
+ * CaptureRecords, each followed by Size bytes of the command's fields,
+ *   padded to a multiple of 4 bytes
+ *
+ * Opcode numbers change between builds, so readers look them up by name.
+ * Each command writes its own fields, so nothing depends on how the command
+ * classes are laid out. Objects are written as IDs given out as they're
+ * created, and GL names as the ID of the object owning them. The data a
+ * command points to, like texture levels, buffer ranges and shader bytecode,
+ * is written along with it. The commands in an ApplyStateCmd's packet follow
+ * it as records of their own, counted in its Size.
+ */
+struct CaptureHeader {
+    char Magic[4];
+    DWORD Version;
+    DWORD NumOpcodes;
+    DWORD Reserved;
+    LONGLONG TicksPerSec;
+};
+
+struct CaptureRecord {
+    DWORD Opcode;
+    // Texture levels can be large, so this has all 32 bits.
+    DWORD Size;
+    // Time spent executing the command, in performance counter ticks.
+    DWORD Ticks;
+};
+
+static const char CaptureMagic[4] = { 'D', 'G', 'L', 'C' };
+static const DWORD CaptureVersion = 2;
+
+// IDs of the device's own GL objects. Object IDs given out by the capture
+// start after them, and 0 is no object.
+enum CaptureId {
+    CaptureId_None = 0,
+    CaptureId_VSUniformF,
+    CaptureId_VSUniformI,
+    CaptureId_VSUniformB,
+    CaptureId_PSUniformF,
+    CaptureId_PSUniformI,
+    CaptureId_PSUniformB,
+    CaptureId_VtxStateUniform,
+    CaptureId_PosFixupUniform,
+    CaptureId_VertexRing,
+
+    CaptureId_First
+};
+
+// GL object namespaces. Names are only unique within their own.
+enum CaptureNameType {
+    CaptureName_Buffer,
+    CaptureName_Texture,
+    CaptureName_Renderbuffer,
+    CaptureName_Query,
+    CaptureName_Program,
+
+    CaptureName_Count
+};
+
+// Called by D3DGL_ReplayCapture after each frame of the capture has been
+// presented, with how long the frame's commands took to execute when they
+// were captured.
+typedef void (CALLBACK *D3DGLReplayFrameProc)(void *user, ULONG frame, ULONGLONG captured_us);
+
+
+// Writes executed commands to a capture file. Only used by the thread
+// executing commands.
+class CommandCapture {
+    FILE *mFile;
+    std::vector<char> mBuffer;
+    // Start of each record being written or executed. In direct mode a
+    // command may send more while executing.
+    std::vector<size_t> mRecords;
+
+    // The ID of each live object, and of the object owning each GL name.
+    std::unordered_map<const void*,ULONG> mObjects;
+    std::array<std::unordered_map<UINT,ULONG>,CaptureName_Count> mNames;
+    ULONG mNextId;
+
+    void flush();
+
+public:
+    CommandCapture();
+    ~CommandCapture();
+
+    bool open(const char *fname, LONGLONG ticks_per_sec, const char *const *names, DWORD num_names);
+    void close();
+
+    static LONGLONG getTicks()
+    {
+        LARGE_INTEGER ticks;
+        QueryPerformanceCounter(&ticks);
+        return ticks.QuadPart;
+    }
+
+    // Starts a record for a command, which then writes its fields. The
+    // fields are sealed before the command executes, and end sets the time
+    // it took.
+    void begin(ULONG opcode);
+    void seal();
+    void end(LONGLONG ticks);
+    bool isRecording() const { return !mRecords.empty(); }
+
+    template<typename T>
+    void write(const T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Type can't be written!");
+        static_assert(!std::is_pointer<T>::value, "Pointers can't be written!");
+        const char *data = reinterpret_cast<const char*>(&value);
+        mBuffer.insert(mBuffer.end(), data, data+sizeof(T));
+    }
+    // Writes a block of data the command points to, with its size.
+    void writeData(const void *data, size_t size);
+
+    // Gives an object a new ID and writes it. Called by the command creating
+    // it, and replaces any old object at the same address.
+    void writeNewObject(const void *obj);
+    void writeObject(const void *obj);
+
+    // Sets the object owning a GL name, once it's been created.
+    void addName(CaptureNameType type, UINT name, const void *obj);
+    void addName(CaptureNameType type, UINT name, ULONG id);
+    void writeName(CaptureNameType type, UINT name);
+};
+
+
+// Reads the fields of a captured command. Reading past the end gives zeros,
+// and marks the reader as overrun.
+class CaptureReader {
+    const char *mData;
+    const char *mEnd;
+    bool mOverrun;
+
+public:
+    CaptureReader() : mData(nullptr), mEnd(nullptr), mOverrun(false) { }
+    CaptureReader(const void *data, size_t size)
+      : mData(reinterpret_cast<const char*>(data)), mEnd(mData+size), mOverrun(false)
+    { }
+
+    bool empty() const { return mData == mEnd; }
+    bool overrun() const { return mOverrun; }
+
+    template<typename T>
+    T read()
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Type can't be read!");
+        T value;
+        if((size_t)(mEnd-mData) < sizeof(T))
+        {
+            memset(&value, 0, sizeof(T));
+            mData = mEnd;
+            mOverrun = true;
+            return value;
+        }
+        memcpy(&value, mData, sizeof(T));
+        mData += sizeof(T);
+        return value;
+    }
+    // Returns a block of data written with writeData. It stays valid as long
+    // as the capture data does.
+    const void *readData(size_t &size);
+
+    // Reads the next record, and sets fields to read through its fields.
+    bool readRecord(CaptureRecord &record, CaptureReader &fields);
+};
+
+#endif /* CAPTURE_HPP */
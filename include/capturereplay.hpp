@@ -0,0 +1,103 @@
+#ifndef CAPTUREREPLAY_HPP
+#define CAPTUREREPLAY_HPP
+
+#include <d3d9.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "glew.h"
+#include "capture.hpp"
+#include "commandqueue.hpp"
+
+
+class D3DGLDevice;
+class D3DGLSwapChain;
+class D3DGLRenderTarget;
+struct GLState;
+
+// Replays a capture through a new device. Objects are created again from
+// their captured descriptions, and each command is sent again to the new
+// device with the objects and GL names standing in for the captured ones.
+class CaptureReplay {
+    struct Object {
+        IUnknown *mIface;
+        void *mTarget;
+        GLuint mName;
+    };
+
+    IDirect3D9 *mD3D;
+    HWND mWindow;
+    D3DGLReplayFrameProc mFrameProc;
+    void *mFrameUser;
+
+    D3DGLDevice *mDevice;
+    D3DGLSwapChain *mSwapchain;
+    CommandQueue *mQueue;
+    GLState *mGLState;
+
+    std::unordered_map<ULONG,Object> mObjects;
+    // This build's opcode for each one in the capture, or CmdOp_Count if it
+    // doesn't have it.
+    std::vector<ULONG> mOpcodes;
+    // Collects the state commands of an ApplyStateCmd being replayed.
+    CommandPacket *mPacket;
+    ULONG mLastSeq;
+
+    LONGLONG mTicksPerSec;
+    LONGLONG mFrameTicks;
+    ULONG mFrame;
+
+    void *findObject(ULONG id) const;
+    void replayRecords(CaptureReader &reader);
+    void deinit();
+
+public:
+    CaptureReplay(IDirect3D9 *d3d, HWND window, D3DGLReplayFrameProc proc, void *user);
+    ~CaptureReplay();
+
+    HRESULT run(const void *data, SIZE_T size);
+
+    // Creates the device for InitGLDeviceCmd, presenting to the replay's
+    // window.
+    bool createDevice(D3DPRESENT_PARAMETERS params);
+    D3DGLDevice *getDevice() const { return mDevice; }
+    CommandQueue &getQueue() const { return *mQueue; }
+    GLState &getGLState() const { return *mGLState; }
+    GLuint getPipeline() const;
+
+    // Sets the object and GL name standing in for a captured ID. The replay
+    // holds the interface's reference.
+    void addObject(ULONG id, IUnknown *iface, void *target, GLuint name);
+    template<typename T>
+    T *getObject(ULONG id) const { return static_cast<T*>(findObject(id)); }
+    GLuint getName(ULONG id) const;
+    void releaseObject(ULONG id);
+
+    template<typename T, typename ...Args>
+    ULONG send(Args...args)
+    { return mLastSeq = mQueue->send<T,Args...>(args...); }
+    template<typename T, typename ...Args>
+    ULONG sendPayload(size_t payload_size, Args...args)
+    { return mLastSeq = mQueue->doSendPayload<T,Args...>(payload_size, args...); }
+    template<typename T, typename ...Args>
+    void sendSync(Args...args)
+    { mQueue->waitFor(send<T,Args...>(args...)); }
+    // State commands go in the packet being replayed, if there is one.
+    template<typename T, typename ...Args>
+    void sendState(Args...args)
+    {
+        if(mPacket)
+            mPacket->add<T,Args...>(args...);
+        else
+            send<T,Args...>(args...);
+    }
+
+    // Replays the records following an ApplyStateCmd into a packet.
+    void replayPacket(CaptureReader &reader, CommandPacket &packet);
+
+    // Presents a backbuffer, which ends a frame.
+    void present(D3DGLRenderTarget *backbuffer);
+};
+
+#endif /* CAPTUREREPLAY_HPP */
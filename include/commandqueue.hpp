@@ -5,12 +5,31 @@
 #include <windows.h>
 
 #include <atomic>
+#include <exception>
 #include <new>
+#include <type_traits>
+#include <vector>
 
 #include "trace.hpp"
 
 
 class CommandQueue;
+class CommandCapture;
+class CaptureReader;
+class CaptureReplay;
+
+// Number of times a thread waiting on the queue spins, then yields its time
+// slice, before going to sleep on the condition variable.
+extern DWORD QueueSpinCount;
+extern DWORD QueueYieldCount;
+// Upper bound on command queue memory, in MiB.
+extern DWORD QueueMaxMemory;
+// 0 = no statistics, 1 = collect statistics, 2 = also log them to LogFile
+// once per Present.
+extern DWORD QueueStats;
+// Non-zero to execute commands on the sending thread instead of a command
+// thread, for devices not created with D3DCREATE_MULTITHREADED.
+extern DWORD QueueDirect;
 
 
 template<typename T>
@@ -30,177 +49,675 @@ template<typename T>
 ref_holder<T> make_ref(T &value) { return ref_holder<T>(value); };
 
 
+// Commands handled by the queue itself, dispatched directly in
+// CommandQueue::run().
+#define D3DGL_QUEUE_COMMANDS(X) \
+    X(CommandQuitThrd)          \
+    X(CommandSkip)              \
+    X(FlushGLCmd)
+
+// Commands sent by the device and its resources, dispatched by
+// ExecuteCommand(). Each one needs a DEFINE_COMMAND after its class.
+#define D3DGL_COMMANDS(X)        \
+    X(InitBufferObjectCmd)       \
+    X(DestroyBufferCmd)          \
+    X(ResizeBufferCmd)           \
+    X(LoadBufferDataCmd)         \
+    X(TextureInitCmd)            \
+    X(TextureDeinitCmd)          \
+    X(TextureGenMipCmd)          \
+    X(TextureLoadLevelCmd)       \
+    X(Texture3DInitCmd)          \
+    X(Texture3DDeinitCmd)        \
+    X(Texture3DGenMipCmd)        \
+    X(Texture3DLoadLevelCmd)     \
+    X(CubeTextureInitCmd)        \
+    X(CubeTextureDeinitCmd)      \
+    X(CubeTextureGenMipCmd)      \
+    X(CubeTextureLoadLevelCmd)   \
+    X(QueryInitCmd)              \
+    X(QueryDeinitCmd)            \
+    X(BeginQueryCmd)             \
+    X(EndQueryCmd)               \
+    X(QueryDataCmd)              \
+    X(SwapchainSwapBuffers)      \
+    X(SetSwapIntervalCmd)        \
+    X(DeleteRenderbuffer)        \
+    X(InitRenderTargetCmd)       \
+    X(CompileAndSetVShaderCmd)   \
+    X(SetVShaderCmd)             \
+    X(DeinitVShaderCmd)          \
+    X(CompileAndSetPShaderCmd)   \
+    X(SetPShaderCmd)             \
+    X(DeinitPShaderCmd)          \
+    X(StateEnable)               \
+    X(MaterialSet)               \
+    X(ViewportSet)               \
+    X(ScissorRectSet)            \
+    X(ScissorTestSet)            \
+    X(PolygonModeSet)            \
+    X(CullFaceSet)               \
+    X(ColorMaskSet)              \
+    X(DepthMaskSet)              \
+    X(DepthFuncSet)              \
+    X(AlphaFuncSet)              \
+    X(BlendFuncSet)              \
+    X(StencilFuncSet)            \
+    X(BlendOpSet)                \
+    X(StencilOpSet)              \
+    X(StencilMaskSet)            \
+    X(DepthBiasSet)              \
+    X(FogValuefSet)              \
+    X(InitSamplerCmd)            \
+    X(BindSamplerCmd)            \
+    X(SetBufferValue4fv)         \
+    X(BindBufferRangeCmd)        \
+    X(ElementArraySet)           \
+    X(SetTextureCmd)             \
+    X(ClipPlaneEnableCmd)        \
+    X(ApplyStateCmd)             \
+    X(SetFBAttachmentCmd)        \
+    X(ReleaseFBAttachmentCmd)    \
+    X(ClearCmd)                  \
+    X(InitVertexArrayCmd)        \
+    X(BindVertexArrayCmd)        \
+    X(SetVertexBuffersCmd)       \
+    X(ReleaseBufferCmd)          \
+    X(DrawGLArraysCmd)           \
+    X(DrawGLElementsCmd)         \
+    X(MultiDrawGLElementsCmd)    \
+    X(ReadFramebufferCmd)        \
+    X(BlitFramebufferCmd)        \
+    X(InitGLDeviceCmd)           \
+    X(DeinitGLDeviceCmd)         \
+    X(FenceRingCmd)              \
+    X(WaitRingCmd)               \
+    X(StreamRingDataCmd)
+
+enum CommandOp {
+#define COMMAND_OP(T) CmdOp_##T,
+    D3DGL_QUEUE_COMMANDS(COMMAND_OP)
+    D3DGL_COMMANDS(COMMAND_OP)
+#undef COMMAND_OP
+    CmdOp_Count
+};
+
+extern const char *const CommandOpNames[CmdOp_Count];
+
+
+// Command queue statistics, returned by D3DGL_GetQueueStats. Everything is
+// counted from when the device was created, and times are in microseconds.
+// The per-opcode arrays have a fixed capacity so the layout doesn't change as
+// commands are added; NumOpcodes says how many entries are used.
+#define D3DGL_QUEUE_STATS_VERSION 1
+#define D3DGL_QUEUE_STATS_MAX_OPS 256
+struct D3DGLQueueStats {
+    // Set to sizeof(D3DGLQueueStats) by the caller.
+    DWORD Size;
+    // Set to D3DGL_QUEUE_STATS_VERSION when filled in.
+    DWORD Version;
+    DWORD NumOpcodes;
+    // Time producers spent waiting for queue space.
+    ULONGLONG ProducerStallTime;
+    // Time the command thread spent waiting for commands.
+    ULONGLONG ConsumerIdleTime;
+    // Most bytes of commands that were waiting to execute.
+    DWORD HighWaterBytes;
+    DWORD NumSegments;
+    DWORD OpCount[D3DGL_QUEUE_STATS_MAX_OPS];
+    ULONGLONG OpTime[D3DGL_QUEUE_STATS_MAX_OPS];
+};
+
+
+// Every command in the queue starts with this header, followed by the
+// command's own data. The size covers both, so the consumer can step over it
+// without knowing the type.
 class Command {
-protected:
-    virtual ~Command() { }
-    friend class CommandEvent;
+    ULONG mOpcode : 8;
+    ULONG mSize : 24;
+
     friend class CommandQueue;
+    friend class CommandPacket;
+    friend void ExecuteCommand(Command *cmd);
+    friend void CaptureCommand(Command *cmd, CommandCapture &capture);
+    friend void CapturePackedCommand(const Command *cmd, CommandCapture &capture);
 
 public:
-    virtual ULONG execute() = 0;
+    // Called after a captured command executes, for commands that need to
+    // record what it created.
+    void captured(CommandCapture&) const { }
 };
 
-class CommandNoOp : public Command {
-public:
-    virtual ULONG execute() { return sizeof(*this); }
+// Executes a command from D3DGL_COMMANDS and destroys it. Generated from the
+// command list in commands.cpp.
+void ExecuteCommand(Command *cmd);
+// Same, but also writes the command to a capture.
+void CaptureCommand(Command *cmd, CommandCapture &capture);
+// Writes a command from a CommandPacket to a capture, without executing it.
+void CapturePackedCommand(const Command *cmd, CommandCapture &capture);
+// Reads a captured command's fields and sends it to the replay's device.
+void ReplayCommand(ULONG opcode, CaptureReader &reader, CaptureReplay &replay);
+
+// Maps a command type to its opcode.
+template<typename T>
+struct CommandTraits;
+
+#define DECLARE_COMMAND(T)                                                    \
+template<> struct CommandTraits<T> {                                          \
+    static const ULONG sOpcode = CmdOp_##T;                                   \
 };
 
-class CommandSkip : public Command {
-    ULONG mSkipAmt;
+#define DEFINE_COMMAND_EXECUTOR(T)                                            \
+void execute_##T(Command *cmd)                                                \
+{                                                                             \
+    T *typed_cmd = static_cast<T*>(cmd);                                      \
+    typed_cmd->execute();                                                     \
+    typed_cmd->~T();                                                          \
+}
+
+// Commands write their own fields with capture(), and read them back to send
+// an equivalent command with the static replay().
+#define DEFINE_COMMAND_CAPTURE(T)                                             \
+void capture_##T(Command *cmd, CommandCapture &capture)                       \
+{                                                                             \
+    T *typed_cmd = static_cast<T*>(cmd);                                      \
+    capture.begin(CommandTraits<T>::sOpcode);                                 \
+    typed_cmd->capture(capture);                                              \
+    capture.seal();                                                           \
+    LONGLONG start = CommandCapture::getTicks();                              \
+    typed_cmd->execute();                                                     \
+    capture.end(CommandCapture::getTicks() - start);                          \
+    typed_cmd->captured(capture);                                             \
+    typed_cmd->~T();                                                          \
+}                                                                             \
+void capture_packed_##T(const Command *cmd, CommandCapture &capture)          \
+{                                                                             \
+    const T *typed_cmd = static_cast<const T*>(cmd);                          \
+    capture.begin(CommandTraits<T>::sOpcode);                                 \
+    typed_cmd->capture(capture);                                              \
+    capture.seal();                                                           \
+    capture.end(0);                                                           \
+}                                                                             \
+void replay_##T(CaptureReader &reader, CaptureReplay &replay)                 \
+{                                                                             \
+    T::replay(reader, replay);                                                \
+}
+
+#define DEFINE_COMMAND(T)                                                     \
+    DECLARE_COMMAND(T)                                                        \
+    DEFINE_COMMAND_EXECUTOR(T)                                                \
+    DEFINE_COMMAND_CAPTURE(T)
+
 
+class FlushGLCmd : public Command {
 public:
-    CommandSkip(ULONG amt) : mSkipAmt(amt) { }
+    FlushGLCmd() { }
 
-    virtual ULONG execute() { return mSkipAmt; }
+    void execute();
 };
+DECLARE_COMMAND(FlushGLCmd)
 
-template<typename T>
-class CommandSync : public Command {
-public:
-    typedef std::atomic<ULONG> FlagType;
 
-private:
-    CommandQueue &mQueue;
-    FlagType &mFlag;
-    T mCommand;
+// A group of commands from D3DGL_COMMANDS stored back to back, laid out the
+// same as in the queue. A packet is built ahead of time, then copied into a
+// single queued command that executes everything in it. The commands are
+// never destroyed in the packet itself, so they must not need destroying.
+class CommandPacket {
+    std::vector<char> mData;
 
 public:
-    template<typename ...Args>
-    CommandSync(CommandQueue &queue, FlagType &flag, Args...args)
-      : mQueue(queue), mFlag(flag), mCommand(args...)
-    { }
+    template<typename T, typename ...Args>
+    void add(Args...args)
+    {
+        static_assert(std::is_base_of<Command,T>::value, "Type is not a Command!");
+        static_assert(alignof(T) <= sizeof(void*), "Type is over-aligned!");
+        static_assert(std::is_trivially_destructible<T>::value, "Type needs destroying!");
+
+        size_t size = (sizeof(T)+sizeof(void*)-1) & ~(sizeof(void*)-1);
+        size_t pos = mData.size();
+        mData.resize(pos+size);
+        Command *cmd = new(&mData[pos]) T(args...);
+        cmd->mOpcode = CommandTraits<T>::sOpcode;
+        cmd->mSize = size;
+    }
 
-    virtual ULONG execute();
+    void clear() { mData.clear(); }
+    bool empty() const { return mData.empty(); }
+    const char *data() const { return mData.data(); }
+    size_t size() const { return mData.size(); }
+
+    // Executes the commands in a copy of a packet's data.
+    static void execute(char *data, size_t size)
+    {
+        size_t pos = 0;
+        while(pos < size)
+        {
+            Command *cmd = reinterpret_cast<Command*>(data+pos);
+            pos += cmd->mSize;
+            ExecuteCommand(cmd);
+        }
+    }
+    // Writes the commands in a packet's data to a capture.
+    static void capture(const char *data, size_t size, CommandCapture &capture)
+    {
+        size_t pos = 0;
+        while(pos < size)
+        {
+            const Command *cmd = reinterpret_cast<const Command*>(data+pos);
+            pos += cmd->mSize;
+            CapturePackedCommand(cmd, capture);
+        }
+    }
 };
 
-class FlushGLCmd : public Command {
+
+// Commands a producer holds back so later ones can be merged into them. The
+// queue has it send them before any other command is sent, so the order of
+// commands is the same as if they were sent right away.
+class DeferredCommands {
 public:
-    FlushGLCmd() { }
+    virtual void flush() = 0;
+};
 
-    virtual ULONG execute();
+
+// Refers to a command sent with doSendSkippable, so it can be skipped later.
+class CommandHandle {
+    std::atomic<unsigned short> *mSlot;
+    unsigned short mValue;
+
+    friend class CommandQueue;
+
+public:
+    CommandHandle() : mSlot(nullptr), mValue(0) { }
 };
 
 
 class CommandQueue {
-    static const size_t sQueueBits = 21;
-    static const size_t sQueueSize = 1<<sQueueBits;
-    static const size_t sQueueMask = sQueueSize-1;
+    static const size_t sSegmentBits = 18;
+    static const size_t sSegmentSize = 1<<sSegmentBits;
+    // Segments allocated up front, matching the size of the old fixed queue.
+    static const ULONG sInitialSegments = 8;
+    // Commands are placed at multiples of the slot size, keeping them
+    // pointer-aligned.
+    static const size_t sSlotSize = sizeof(void*);
+    static const size_t sSlotCount = sSegmentSize / sSlotSize;
+    static const size_t sCacheLineSize = 64;
+
+    // Commands are stored in a chain of segments. Positions in the queue are
+    // free-running byte counters, and each segment covers sSegmentSize bytes
+    // starting at mBase. When a command doesn't fit in the rest of the
+    // current segment, the producer seals it by recording where its commands
+    // end, and links in a fresh segment from the pool. Segments go back to
+    // the pool once the command thread is done with them.
+    struct Segment {
+        std::atomic<ULONG> mBase;
+        std::atomic<ULONG> mUsedEnd;
+        std::atomic<Segment*> mNext;
+        Segment *mNextFree;
+
+        char mData[sSegmentSize];
+        // Set by a producer once the command starting at the given slot is
+        // fully constructed, and cleared by the consumer after reading it.
+        // Slots are sSlotSize units of the segment data. Besides the slot
+        // state, a set value holds bits of the segment base, so a handle to a
+        // command from before the segment was recycled can't match.
+        std::atomic<unsigned short> mCommitted[sSlotCount];
+
+        Segment();
+        void reset(ULONG base);
+    };
+    enum {
+        SlotCommitted = 1,
+        SlotSkipped = 2,
+        SlotStateMask = 3
+    };
+    static unsigned short slotValue(ULONG base, unsigned short state)
+    { return (unsigned short)(((base>>sSegmentBits) << 2) | state); }
+
+    // Producers claim space by advancing mHead. Producer state and lock state
+    // are padded onto separate cache lines so they don't bounce between
+    // threads.
+    std::atomic<ULONG> mHead;
+    std::atomic<Segment*> mProducerSeg;
+    char mProducerPad[sCacheLineSize];
 
-    std::atomic<ULONG> mHead, mTail;
-    char mQueueData[sQueueSize];
+    std::atomic<ULONG> mSpinLock;
+    std::atomic<DWORD> mLockOwner; // Thread ID holding mSpinLock, or 0
     CRITICAL_SECTION mLock;
     CONDITION_VARIABLE mCondVar;
-    std::atomic<ULONG> mSpinLock;
+
+    // Threads sleeping on mCondVar. The command thread only signals the
+    // condition variable when someone is actually waiting on it, and others
+    // only signal it when the command thread is parked.
+    std::atomic<ULONG> mWaiters;
+    std::atomic<bool> mConsumerParked;
+    std::atomic<ULONG> mConsumerParks;
+    std::atomic<ULONG> mProducerParks;
+
+    // Segment pool, protected by mLock.
+    Segment *mFreeSegments;
+    ULONG mNumSegments;
+    ULONG mMaxSegments;
+    Segment *mConsumerSeg;
+    char mLockPad[sCacheLineSize];
+
+    // Queue position just past the last executed command. The command thread
+    // only publishes it when it runs out of commands, or when someone wants
+    // it: a thread blocked in waitFor, or one that found a command pending
+    // in isExecuted. Kept on its own cache line, away from the producers.
+    std::atomic<ULONG> mExecuted;
+    std::atomic<ULONG> mSeqWaiters;
+    mutable std::atomic<bool> mSeqPolled;
+    char mExecutedPad[sCacheLineSize];
+
+    // Statistics, only updated when enabled. Times are in performance
+    // counter ticks. Apart from the stall time, they're only written by the
+    // command thread.
+    bool mStatsEnabled;
+    bool mDumpStats;
+    LONGLONG mTicksPerSec;
+    std::atomic<ULONGLONG> mStallTicks;
+    std::atomic<ULONGLONG> mIdleTicks;
+    std::atomic<ULONG> mHighWater;
+    std::atomic<ULONG> mOpCounts[CmdOp_Count];
+    std::atomic<ULONGLONG> mOpTicks[CmdOp_Count];
+    D3DGLQueueStats mLastDump;
 
     HANDLE mThreadHdl;
     DWORD mThreadId;
 
+    // In direct mode, commands execute as they're sent. The first segment
+    // isn't otherwise used then, so it holds the commands being executed,
+    // with commands sent while executing another one placed after it.
+    bool mDirect;
+    ULONG mDirectTop;
+
+    // Records executed commands when D3DGL_CAPTURE is set.
+    CommandCapture *mCapture;
+
+    // Commands held back from the queue, flushed before the next send.
+    std::atomic<DeferredCommands*> mDeferred;
+
     DWORD CALLBACK run(void);
     static DWORD CALLBACK thread_func(void *arg)
     { return reinterpret_cast<CommandQueue*>(arg)->run(); }
+    void waitForCommands(ULONG tail);
+    void publishExecuted(ULONG tail)
+    {
+        mExecuted.store(tail, std::memory_order_release);
+        // Pairs with the fence in doWaitFor, so a waiter going to sleep
+        // either sees the new position or is seen by wakeWaiters.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    void wakeWaiters();
+    void recordCommand(ULONG opcode, LONGLONG start, ULONG tail);
+    void addStallTime(LONGLONG start);
+    LONGLONG dispatch(Command *cmd, ULONG opcode);
+    void executeDirect(Command *cmd);
+
+    // Claims size bytes of contiguous queue space and returns the segment
+    // and offset it starts at. Multiple threads may reserve space at the same
+    // time.
+    Segment *reserve(size_t size, ULONG &offset);
+    void linkSegment(Segment *seg, ULONG used_end);
+    void releaseSegment(Segment *seg);
 
     template<typename T, typename ...Args>
-    void doSizedSend(size_t size, Args...args)
+    void construct(Segment *seg, ULONG offset, ULONG size, unsigned short committed, Args...args)
     {
-        ULONG head = mHead.load();
-        while(1)
+        Command *cmd = new(&seg->mData[offset]) T(args...);
+        cmd->mOpcode = CommandTraits<T>::sOpcode;
+        cmd->mSize = size;
+        TRACE("Sending %p (opcode %u)\n", cmd, cmd->mOpcode);
+
+        seg->mCommitted[offset/sSlotSize].store(committed, std::memory_order_release);
+    }
+
+    template<typename T, typename ...Args>
+    ULONG sendDirect(size_t size, Args...args)
+    {
+        if(sSegmentSize-mDirectTop < size)
         {
-            ULONG rem_size = sQueueSize - head;
-            if(rem_size < size)
-            {
-                if(rem_size >= sizeof(CommandSkip))
-                {
-                    doSizedSend<CommandSkip>(rem_size, rem_size);
-                    head = mHead.load();
-                    rem_size = sQueueSize - head;
-                }
-                else do {
-                    doSizedSend<CommandNoOp>(sizeof(CommandNoOp));
-                    head = mHead.load();
-                    rem_size = sQueueSize - head;
-                } while(rem_size < size);
-            }
-            if(((mTail-head-1)&sQueueMask) >= size)
-                break;
-
-            EnterCriticalSection(&mLock);
-            WakeAllConditionVariable(&mCondVar);
-            SleepConditionVariableCS(&mCondVar, &mLock, INFINITE);
-            LeaveCriticalSection(&mLock);
-            head = mHead.load();
+            ERR("Out of space for direct commands (%lu bytes)\n", (unsigned long)size);
+            std::terminate();
         }
+        Command *cmd = new(&mConsumerSeg->mData[mDirectTop]) T(args...);
+        cmd->mOpcode = CommandTraits<T>::sOpcode;
+        cmd->mSize = size;
+        mDirectTop += size;
+        executeDirect(cmd);
+        return mExecuted.load(std::memory_order_relaxed);
+    }
 
-        Command *cmd = new(&mQueueData[head]) T(args...);
-        TRACE("Sending %p\n", cmd);
-
-        head += size;
-        mHead.store(head&sQueueMask);
+    template<typename T, typename ...Args>
+    ULONG doSizedSend(size_t size, CommandHandle *handle, Args...args)
+    {
+        if(mDeferred.load(std::memory_order_relaxed))
+            flushDeferred();
+        if(mDirect)
+            return sendDirect<T,Args...>(size, args...);
+
+        ULONG offset;
+        Segment *seg = reserve(size, offset);
+        ULONG base = seg->mBase.load(std::memory_order_relaxed);
+        unsigned short committed = slotValue(base, SlotCommitted);
+        if(handle)
+        {
+            handle->mSlot = &seg->mCommitted[offset/sSlotSize];
+            handle->mValue = committed;
+        }
+        construct<T,Args...>(seg, offset, size, committed, args...);
+        return base + offset + size;
     }
 
     CommandQueue(const CommandQueue&) = delete;
     CommandQueue& operator=(const CommandQueue&) = delete;
 
 public:
+    // The largest payload a sender should give a single command. Anything
+    // bigger is split across several, which leaves room for the command
+    // itself and for commands sent while executing directly.
+    static const size_t sMaxPayloadSize = sSegmentSize / 4;
+
     CommandQueue();
     ~CommandQueue();
 
-    bool init();
+    // Starts the command thread, or with direct set, prepares to execute
+    // commands on whichever thread sends them.
+    bool init(bool direct=false);
     void deinit();
-    bool isActive() const { return mThreadHdl != nullptr; }
+    bool isActive() const { return mThreadHdl != nullptr || mDirect; }
+    bool isDirect() const { return mDirect; }
+    bool isCapturing() const { return mCapture != nullptr; }
+
+    ULONG getSegmentCount()
+    {
+        EnterCriticalSection(&mLock);
+        ULONG count = mNumSegments;
+        LeaveCriticalSection(&mLock);
+        return count;
+    }
+    void getStats(D3DGLQueueStats &stats);
+    // Logs the statistics gathered since the last call, when enabled.
+    void dumpStats()
+    {
+        if(mDumpStats)
+            doDumpStats();
+    }
+    void doDumpStats();
+
+    ULONG getConsumerParks() const { return mConsumerParks.load(std::memory_order_relaxed); }
+    ULONG getProducerParks() const { return mProducerParks.load(std::memory_order_relaxed); }
 
 
     void beginWait() { EnterCriticalSection(&mLock); }
     void endWait() { LeaveCriticalSection(&mLock); }
     void wait(DWORD time_ms=INFINITE)
     {
+        ++mWaiters;
         wake();
         SleepConditionVariableCS(&mCondVar, &mLock, time_ms);
+        --mWaiters;
     }
 
 
+    // Serializes device state changes that send multiple dependent commands.
+    // It isn't needed to send commands, only to keep a group of them from
+    // being split up by other threads changing the same state.
     void lock()
     {
         while(mSpinLock.exchange(true) == true)
             SwitchToThread();
+        mLockOwner.store(GetCurrentThreadId(), std::memory_order_relaxed);
+    }
+    void unlock()
+    {
+        mLockOwner.store(0, std::memory_order_relaxed);
+        mSpinLock = false;
+    }
+    // Only the holder can see its own ID here, so this is reliable for the
+    // calling thread.
+    bool holdsLock() const
+    { return mLockOwner.load(std::memory_order_relaxed) == GetCurrentThreadId(); }
+    void wake()
+    {
+        if(mConsumerParked.load())
+            WakeAllConditionVariable(&mCondVar);
     }
-    void unlock() { mSpinLock = false; }
-    void wake() { WakeAllConditionVariable(&mCondVar); }
 
-    void wakeAndSleep()
+    // Holds back commands to be sent before the next command from any thread
+    // is. Only one set of deferred commands is held at a time.
+    // Whoever takes them back owns them, and either sends them or defers them
+    // again, so a producer adding to them takes them first. Deferred commands
+    // are only touched with the lock held, which orders the accesses from
+    // different threads. The caller is responsible for holding the lock, and
+    // for filling in the commands before deferring them.
+    void defer(DeferredCommands *deferred)
+    { mDeferred.store(deferred, std::memory_order_release); }
+    DeferredCommands *takeDeferred()
+    { return mDeferred.exchange(nullptr, std::memory_order_acq_rel); }
+    // Sends the deferred commands, taking the lock for it if the calling
+    // thread doesn't hold it. Any thread's send flushes them, since a
+    // command sent after a deferred one returned has to execute after it.
+    void flushDeferred()
     {
-        wake();
-        Sleep(1);
+        if(holdsLock())
+        {
+            if(DeferredCommands *deferred = takeDeferred())
+                deferred->flush();
+        }
+        else
+        {
+            lock();
+            if(DeferredCommands *deferred = takeDeferred())
+                deferred->flush();
+            unlock();
+        }
+    }
+
+    // Every send returns a sequence number for the command, which is its end
+    // position in the queue. A command has executed once the command thread
+    // has moved past it. Anything outside the range of commands still waiting
+    // to execute is done, so old sequence numbers never look pending again
+    // when the positions wrap around.
+    bool isExecuted(ULONG seq) const
+    {
+        if(checkExecuted(seq))
+            return true;
+        // Ask the command thread to publish its progress for the next check.
+        if(!mSeqPolled.load(std::memory_order_relaxed))
+            mSeqPolled.store(true, std::memory_order_relaxed);
+        return false;
+    }
+    bool checkExecuted(ULONG seq) const
+    {
+        ULONG executed = mExecuted.load(std::memory_order_acquire);
+        return seq-executed-1 >= mHead.load(std::memory_order_relaxed)-executed;
+    }
+    // Blocks until the command with the given sequence number has executed.
+    void waitFor(ULONG seq)
+    {
+        if(!checkExecuted(seq))
+            doWaitFor(seq);
+    }
+    void doWaitFor(ULONG seq);
+
+    // Raises a resource's sequence number to seq. Threads sending commands
+    // for the same resource can store their sequence numbers out of order,
+    // and this keeps the latest one.
+    static void raiseSeq(std::atomic<ULONG> &dst, ULONG seq)
+    {
+        ULONG old = dst.load(std::memory_order_relaxed);
+        while((LONG)(seq-old) > 0 &&
+              !dst.compare_exchange_weak(old, seq, std::memory_order_relaxed))
+        { }
     }
 
     template<typename T, typename ...Args>
-    void doSend(Args...args)
+    ULONG doSend(Args...args)
     {
-        static_assert(sizeof(T) >= sizeof(Command), "Type is too small!");
-        static_assert((sizeof(T)%sizeof(Command)) == 0, "Type is not a multiple of Command!");
-        static_assert(sizeof(T) < sQueueSize, "Type size is way too large!");
+        static_assert(std::is_base_of<Command,T>::value, "Type is not a Command!");
+        static_assert(alignof(T) <= sSlotSize, "Type is over-aligned!");
+        static_assert(sizeof(T) < sSegmentSize, "Type size is way too large!");
 
-        doSizedSend<T,Args...>(sizeof(T), args...);
+        return doSizedSend<T,Args...>((sizeof(T)+sSlotSize-1) & ~(sSlotSize-1), nullptr, args...);
     }
 
+    // Sends a command that can be skipped with the returned handle, as long
+    // as the command thread hasn't got to it yet. A skipped command is never
+    // executed or destroyed, so the type must not need destroying.
     template<typename T, typename ...Args>
-    void send(Args...args)
+    CommandHandle doSendSkippable(Args...args)
+    {
+        static_assert(std::is_base_of<Command,T>::value, "Type is not a Command!");
+        static_assert(alignof(T) <= sSlotSize, "Type is over-aligned!");
+        static_assert(sizeof(T) < sSegmentSize, "Type size is way too large!");
+        static_assert(std::is_trivially_destructible<T>::value, "Type needs destroying!");
+
+        CommandHandle handle;
+        doSizedSend<T,Args...>((sizeof(T)+sSlotSize-1) & ~(sSlotSize-1), &handle, args...);
+        return handle;
+    }
+
+    // Turns a command into a CommandSkip if it's still waiting to execute,
+    // returning true if it was marked, in which case it won't execute. It's
+    // only safe to skip commands whose effect is overwritten by a later one.
+    // Commands executed directly can't be skipped.
+    bool skip(const CommandHandle &handle)
     {
-        lock();
-        doSend<T,Args...>(args...);
-        unlock();
+        if(!handle.mSlot)
+            return false;
+        unsigned short committed = handle.mValue;
+        return handle.mSlot->compare_exchange_strong(committed,
+            (unsigned short)((committed&~SlotStateMask) | SlotSkipped)
+        );
     }
 
+    // Sends a command followed by payload_size bytes of trailing data, which
+    // the command's constructor fills in after itself.
     template<typename T, typename ...Args>
-    void sendSync(Args...args)
+    ULONG doSendPayload(size_t payload_size, Args...args)
     {
-        typename CommandSync<T>::FlagType flag(0);
-        send<CommandSync<T>>(make_ref(*this), make_ref(flag), args...);
+        static_assert(std::is_base_of<Command,T>::value, "Type is not a Command!");
+        static_assert(alignof(T) <= sSlotSize, "Type is over-aligned!");
 
-        beginWait();
-        while(!flag) wait();
-        endWait();
+        size_t size = (sizeof(T)+payload_size+sSlotSize-1) & ~(sSlotSize-1);
+        if(size >= sSegmentSize)
+        {
+            ERR("Command payload is too large (%lu bytes)\n", (unsigned long)payload_size);
+            std::terminate();
+        }
+        return doSizedSend<T,Args...>(size, nullptr, args...);
     }
 
+    template<typename T, typename ...Args>
+    ULONG send(Args...args)
+    { return doSend<T,Args...>(args...); }
+
+    template<typename T, typename ...Args>
+    void sendSync(Args...args)
+    { waitFor(send<T,Args...>(args...)); }
+
     template<typename T, typename ...Args>
     void sendFlush(Args...args)
     {
@@ -218,23 +735,11 @@ public:
         // don't want. However, it would be nice to ensure OpenGL is processing
         // all the commands that got sent to it up to this point.
         //sendFlush<FlushGLCmd>();
+        flushDeferred();
         EnterCriticalSection(&mLock);
         LeaveCriticalSection(&mLock);
         wake();
     }
 };
 
-
-template<typename T>
-inline ULONG CommandSync<T>::execute()
-{
-    mCommand.execute();
-
-    mQueue.beginWait();
-    mFlag = 1;
-    mQueue.endWait();
-
-    return sizeof(*this);
-}
-
 #endif /* COMMANDQUEUE_HPP */
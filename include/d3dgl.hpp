@@ -14,6 +14,17 @@
 #define MAX_VERTEX_SAMPLERS         4
 #define MAX_FRAGMENT_SAMPLERS       16
 #define MAX_COMBINED_SAMPLERS       (MAX_FRAGMENT_SAMPLERS + MAX_VERTEX_SAMPLERS)
+#define MAX_SAMPLER_OBJECTS         128
+#define MAX_VERTEX_ARRAYS           256
+#define MAX_BATCHED_DRAWS           256
+#define MAX_FRAMEBUFFERS            32
+#define MAX_CLEAR_RECTS             256
+
+// Sizes of the ring buffers shader constants and user-pointer vertex data
+// are streamed through, and how many fenced segments each is split into.
+#define CONSTANT_RING_SIZE          (4*1024*1024)
+#define VERTEX_RING_SIZE            (8*1024*1024)
+#define RING_SEGMENTS               8
 
 
 bool CreateFakeWindow(HINSTANCE hInstance, HWND &hWnd, HDC &dc);
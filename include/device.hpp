@@ -5,6 +5,8 @@
 
 #include <atomic>
 #include <array>
+#include <algorithm>
+#include <unordered_map>
 
 #include "d3dgl.hpp"
 #include "commandqueue.hpp"
@@ -16,6 +18,7 @@ class D3DGLBufferObject;
 class D3DGLVertexShader;
 class D3DGLPixelShader;
 class D3DGLVertexDeclaration;
+class D3DGLStateBlock;
 
 #define VSF_BINDING_IDX 0
 #define VSI_BINDING_IDX 1
@@ -35,15 +38,103 @@ union Vector4f {
 };
 static_assert(sizeof(Vector4f)==sizeof(float[4]), "Bad Vector4f size");
 
-struct GLStreamData {
-    GLuint mBufferId;
-    GLubyte *mPointer;
+// A vertex attribute's format, and the stream binding it reads from.
+struct GLVertexAttrib {
+    GLint mTarget;
+    GLuint mBinding;
     GLenum mGLType;
     GLint mGLCount;
     GLenum mNormalize;
+    GLuint mOffset;
+
+    bool operator==(const GLVertexAttrib &rhs) const
+    {
+        return mTarget == rhs.mTarget && mBinding == rhs.mBinding &&
+               mGLType == rhs.mGLType && mGLCount == rhs.mGLCount &&
+               mNormalize == rhs.mNormalize && mOffset == rhs.mOffset;
+    }
+};
+
+// A vertex buffer bound to a stream binding.
+struct GLVertexBuffer {
+    GLuint mBufferId;
+    GLuint mOffset;
     GLsizei mStride;
-    GLint mTarget;
     GLuint mDivisor;
+
+    bool operator==(const GLVertexBuffer &rhs) const
+    {
+        return mBufferId == rhs.mBufferId && mOffset == rhs.mOffset &&
+               mStride == rhs.mStride && mDivisor == rhs.mDivisor;
+    }
+    bool operator!=(const GLVertexBuffer &rhs) const { return !(*this == rhs); }
+};
+
+// The vertex attribute formats a cached VAO is built from. This depends only
+// on the vertex declaration and the shader's attribute locations, and not on
+// the buffers bound to the streams.
+struct VertexArrayKey {
+    std::array<GLVertexAttrib,16> mAttribs;
+    GLuint mNumAttribs;
+
+    bool operator==(const VertexArrayKey &rhs) const
+    {
+        return mNumAttribs == rhs.mNumAttribs &&
+               std::equal(mAttribs.begin(), mAttribs.begin()+mNumAttribs, rhs.mAttribs.begin());
+    }
+};
+struct VertexArrayKeyHash {
+    size_t operator()(const VertexArrayKey &key) const;
+};
+
+// A cached vertex array object, along with the buffers bound to it. The
+// buffer bindings are part of the VAO, so the ones that differ from the
+// current GLState are rebound when it's bound. Without
+// ARB_vertex_attrib_binding, rebinding a stream re-specifies the attributes
+// in the key that read it.
+struct GLVertexArray {
+    GLuint mId;
+    GLuint mElements;
+    UINT mStreams; // Bitmask of the stream bindings its attributes read
+    std::array<GLVertexBuffer,MAX_STREAMS> mBuffers;
+    VertexArrayKey mKey;
+};
+
+// An image attached to a framebuffer. Cube faces are told apart by target.
+struct GLFBAttachment {
+    GLenum mTarget;
+    GLuint mId;
+    GLint mLevel;
+
+    bool operator==(const GLFBAttachment &rhs) const
+    { return mTarget == rhs.mTarget && mId == rhs.mId && mLevel == rhs.mLevel; }
+    bool operator!=(const GLFBAttachment &rhs) const
+    { return !(*this == rhs); }
+};
+
+// Framebuffer attachment slots, after the color attachments.
+enum {
+    FBAttachment_Depth = 4,
+    FBAttachment_Stencil,
+    FBAttachment_Count
+};
+
+struct GLFramebuffer {
+    GLuint mId;
+    std::array<GLFBAttachment,FBAttachment_Count> mAttachments;
+    ULONG mLastUse;
+};
+
+// A buffer streamed through in segments, with a fence for each segment's
+// last use. Fences are made for segments before 'fenced', and the ones
+// before 'done' are known to have signaled.
+struct GLRing {
+    GLuint buffer;
+    std::array<GLsync,RING_SEGMENTS> fences;
+    ULONG fenced;
+    ULONG done;
+
+    GLRing() : buffer(0), fences{}, fenced(0), done(0) { }
 };
 
 struct GLState {
@@ -52,34 +143,70 @@ struct GLState {
     GLState& operator=(const GLState&) = delete;
 
     GLState()
-      : samplers{0}, pipeline(0)
+      : sampler_objects{0}, vertex_arrays{}, current_vertex_array(MAX_VERTEX_ARRAYS)
+      , vertex_buffers{}, element_array_buffer(0)
+      , pipeline(0)
       , main_framebuffer(0), copy_framebuffers{0,0} , current_framebuffer{0,0}
-      , vs_uniform_bufferf(0), ps_uniform_bufferf(0)
+      , fb_attachments{}, framebuffers{}, framebuffer_use_count(0), framebuffer_dirty(true)
+      , vs_uniform_bufferf(0), vs_uniform_bufferi(0), vs_uniform_bufferb(0)
+      , ps_uniform_bufferf(0), ps_uniform_bufferi(0), ps_uniform_bufferb(0)
       , vtx_state_uniform_buffer(0), pos_fixup_uniform_buffer(0)
       , active_texture_stage(0)
-      , attrib_array_enabled(0)
       , clip_plane_enabled(0)
+      , color_write_masks{{0xf,0xf,0xf,0xf}}, depth_write_mask(true), stencil_write_mask(~0u)
+      , scissor_test(false), scissor_rect{0, 0, -1, -1}
     { }
 
-    std::array<GLuint,MAX_COMBINED_SAMPLERS> samplers;
+    // Cached sampler objects, by slot. Created when the slot is first used.
+    std::array<GLuint,MAX_SAMPLER_OBJECTS> sampler_objects;
+    // Cached vertex array objects, by slot.
+    std::array<GLVertexArray,MAX_VERTEX_ARRAYS> vertex_arrays;
+    UINT current_vertex_array; // MAX_VERTEX_ARRAYS for none
+    // The buffers that should be bound to the current VAO.
+    std::array<GLVertexBuffer,MAX_STREAMS> vertex_buffers;
+    GLuint element_array_buffer;
     GLuint pipeline;
 
-    GLuint main_framebuffer;     // Used for offscreen rendering
+    GLuint main_framebuffer;     // Used for offscreen rendering, one of
+                                 // the cached framebuffers
     GLuint copy_framebuffers[2]; // Used for FBO blits (0=read, 1=draw)
     GLuint current_framebuffer[2]; // Current framebuffers (0=read, 1=draw;
                                    // if one is set to main_framebuffer,
                                    // both are)
+    // The images render targets are set to, and cached framebuffers for sets
+    // of them. The main framebuffer is looked up again when drawing after
+    // they change.
+    std::array<GLFBAttachment,FBAttachment_Count> fb_attachments;
+    std::array<GLFramebuffer,MAX_FRAMEBUFFERS> framebuffers;
+    ULONG framebuffer_use_count;
+    bool framebuffer_dirty;
 
     GLuint vs_uniform_bufferf;
+    GLuint vs_uniform_bufferi;
+    GLuint vs_uniform_bufferb;
     GLuint ps_uniform_bufferf;
+    GLuint ps_uniform_bufferi;
+    GLuint ps_uniform_bufferb;
+    // Persistently mapped ring the constants are written to, if
+    // ARB_buffer_storage is supported.
+    GLRing constant_ring;
+    // Ring the user-pointer vertex data is written to. Persistently mapped
+    // if ARB_buffer_storage is supported, otherwise orphaned as it wraps.
+    GLRing vertex_ring;
     GLuint vtx_state_uniform_buffer;
     GLuint pos_fixup_uniform_buffer;
 
     GLenum active_texture_stage;
 
-    UINT attrib_array_enabled; // Bitmask, 1<<attrib
-
     UINT clip_plane_enabled; // Bitmask, 1<<plane_index
+
+    // The current write masks and scissor, so clears only change them when
+    // they're in the way. The scissor rect starts unknown.
+    std::array<UINT,D3D_MAX_SIMULTANEOUS_RENDERTARGETS> color_write_masks; // D3DCOLORWRITEENABLE bits
+    bool depth_write_mask;
+    GLuint stencil_write_mask;
+    bool scissor_test;
+    RECT scissor_rect;
 };
 
 // NOTE: This MUST match the uniform block layout for vertex_state in mojoshader.c!
@@ -93,6 +220,34 @@ struct GLVertexState {
     }
 };
 
+// The sampler state a cached GL sampler object is built from.
+struct SamplerKey {
+    std::array<DWORD,14> mStates;
+    bool mShadow;
+
+    bool operator==(const SamplerKey &rhs) const
+    { return mShadow == rhs.mShadow && mStates == rhs.mStates; }
+};
+struct SamplerKeyHash {
+    size_t operator()(const SamplerKey &key) const;
+};
+
+// Groups of state that are applied together when drawing. Render states are
+// split into groups by RSGroupStates, and each sampler's binding is an entry
+// in StateGroup_Samplers.
+enum StateGroup {
+    StateGroup_Blend,
+    StateGroup_DepthStencil,
+    StateGroup_Raster,
+    StateGroup_Viewport,
+    StateGroup_Samplers,
+    StateGroup_Count
+};
+enum ViewportEntry {
+    ViewportEntry_Viewport = 1<<0,
+    ViewportEntry_Scissor = 1<<1
+};
+
 class D3DGLDevice : public IDirect3DDevice9 {
     std::atomic<ULONG> mRefCount;
 
@@ -131,6 +286,85 @@ class D3DGLDevice : public IDirect3DDevice9 {
 
     std::array<Vector4f,256> mVSConstantsF;
     std::array<Vector4f,224> mPSConstantsF;
+    std::array<std::array<int,4>,16> mVSConstantsI;
+    std::array<std::array<int,4>,16> mPSConstantsI;
+    // Bool constants are packed into the bits of the first value. The rest
+    // pads it to a vec4 for the uniform buffer.
+    std::array<GLuint,4> mVSConstantsB;
+    std::array<GLuint,4> mPSConstantsB;
+    // The range of vec4 registers set since they were last sent, which is
+    // uploaded in one go before the next draw. Protected by the mQueue lock.
+    struct ConstantRange {
+        UINT mBegin, mEnd;
+
+        ConstantRange() : mBegin(~0u), mEnd(0) { }
+        void add(UINT start, UINT count)
+        {
+            mBegin = std::min(mBegin, start);
+            mEnd = std::max(mEnd, start+count);
+        }
+        bool empty() const { return mBegin >= mEnd; }
+        void clear() { mBegin = ~0u; mEnd = 0; }
+    };
+    ConstantRange mVSDirtyConstantsF;
+    ConstantRange mVSDirtyConstantsI;
+    ConstantRange mVSDirtyConstantsB;
+    ConstantRange mPSDirtyConstantsF;
+    ConstantRange mPSDirtyConstantsI;
+    ConstantRange mPSDirtyConstantsB;
+
+    // The app side of a GLRing. Segments are fenced when the writer moves
+    // past them, and can be written again once the fence signals. When the
+    // ring isn't mapped, data is sent through the queue instead. Protected
+    // by the mQueue lock.
+    struct StreamRing {
+        GLRing &mGLRing;
+        const UINT mSize;
+        GLubyte *mData; // Null if not mapped
+        ULONG mSegment; // Counts up, not wrapped to the ring
+        UINT mPos;
+        // Segments before this are done being read. Updated by the GL thread.
+        std::atomic<ULONG> mDone;
+
+        StreamRing(GLRing &glring, UINT size)
+          : mGLRing(glring), mSize(size), mData(nullptr), mSegment(0), mPos(0), mDone(0)
+        { }
+        UINT segmentEnd() const { return (mSegment%RING_SEGMENTS + 1) * (mSize/RING_SEGMENTS); }
+    };
+
+    // Moves the ring writer to the next segment, first making sure it's no
+    // longer in use. Caller is responsible for holding the mQueue lock.
+    void nextRingSegment(StreamRing &ring);
+
+    // Each draw that changes a constant buffer writes a copy of it all to
+    // the constant ring and binds it.
+    StreamRing mConstantRing;
+    GLuint mConstantRingAlign;
+
+    // Moves the constant ring writer to the next segment, and marks all
+    // constants dirty so they're written there. Caller is responsible for
+    // holding the mQueue lock.
+    void nextConstantRingSegment();
+
+    // User-pointer vertex and index data is copied to the vertex ring.
+    // Vertices go at an offset that's a multiple of the vertex stride, so
+    // draws can reference them by the first or base vertex.
+    StreamRing mVertexRing;
+
+    // Makes room for size bytes in the current vertex ring segment, moving
+    // to the next segment if needed, so a draw's data is fenced together.
+    // The size must fit in a segment. Caller is responsible for holding the
+    // mQueue lock.
+    void reserveVertexRing(UINT size);
+    // Writes size bytes of reserved space at a multiple of align, returning
+    // the offset. Caller is responsible for holding the mQueue lock.
+    UINT writeVertexRing(const void *data, UINT size, UINT align);
+
+    // Uploads user-pointer data that's too large for the vertex ring to a
+    // device buffer object, creating it as a vertex buffer, or an index
+    // buffer if idxformat is given. Takes the mQueue lock, so it must not
+    // be held.
+    bool uploadUserData(D3DGLBufferObject *&buffer, D3DFORMAT idxformat, const void *data, UINT size);
 
     std::atomic<D3DGLVertexShader*> mVertexShader;
     std::atomic<D3DGLPixelShader*> mPixelShader;
@@ -142,7 +376,9 @@ class D3DGLDevice : public IDirect3DDevice9 {
         UINT mOffset;
         UINT mStride;
         UINT mFreq;
-        StreamSource() : mBuffer(0), mOffset(0), mStride(0), mFreq(1) { }
+        // Used when mBuffer is null, for the device's own buffers.
+        GLuint mBufferId;
+        StreamSource() : mBuffer(0), mOffset(0), mStride(0), mFreq(1), mBufferId(0) { }
     };
     std::array<StreamSource,MAX_STREAMS> mStreams;
     std::atomic<D3DGLBufferObject*> mIndexBuffer;
@@ -151,6 +387,7 @@ class D3DGLDevice : public IDirect3DDevice9 {
     std::map<DWORD,D3DGLVertexDeclaration*> mVtxDeclMap;
 
     D3DGLBufferObject *mPrimitiveUserData;
+    D3DGLBufferObject *mPrimitiveUserIndices;
 
     /* Bit-depth of the current depth-stencil buffer */
     UINT mDepthBits;
@@ -161,6 +398,92 @@ class D3DGLDevice : public IDirect3DDevice9 {
     /* Specifies if the pixel shader is newly set for this draw. */
     std::atomic<bool> mNewPixelShader;
 
+    // A run of indexed draws with nothing else sent between them, deferred
+    // on the queue so more can be added and sent as one multi-draw. Owned by
+    // whoever took it from the queue, which is only done with the mQueue
+    // lock held.
+    struct DrawBatch : public DeferredCommands {
+        D3DGLDevice *mDevice;
+        GLenum mMode;
+        GLenum mType;
+        UINT mNumDraws;
+        std::array<GLsizei,MAX_BATCHED_DRAWS> mCounts;
+        std::array<GLubyte*,MAX_BATCHED_DRAWS> mPointers;
+        std::array<GLint,MAX_BATCHED_DRAWS> mBaseVertices;
+
+        DrawBatch(D3DGLDevice *device) : mDevice(device), mMode(GL_NONE), mType(GL_NONE), mNumDraws(0) { }
+        virtual void flush() final;
+    };
+    DrawBatch mDrawBatch;
+
+    // Adds an indexed draw to the batch, if it's still deferred and the
+    // draw is compatible, or else sends the batch and starts a new one.
+    // Caller is responsible for holding the mQueue lock.
+    void batchDraw(GLenum mode, GLsizei count, GLenum type, GLubyte *pointer, GLint basevtx);
+
+    // Render, sampler, viewport and scissor state is applied when drawing,
+    // by a single ApplyStateCmd holding just what changed. Each group has a
+    // mask of dirty entries, where an entry is one GL state command.
+    // Protected by the mQueue lock.
+    UINT mDirtyGroups;
+    std::array<DWORD,StateGroup_Samplers> mDirtyEntries;
+    DWORD mDirtySamplers;
+    CommandPacket mStatePacket;
+
+    // GL sampler objects built for each combination of sampler state, which
+    // are bound to the stages when drawing. When all slots are used, the
+    // least recently used sampler that isn't bound is replaced. Protected by
+    // the mQueue lock.
+    struct SamplerSlot {
+        SamplerKey mKey;
+        ULONG mLastUse;
+        DWORD mStages; // Bitmask of stages it's bound to
+    };
+    std::unordered_map<SamplerKey,UINT,SamplerKeyHash> mSamplerCache;
+    std::array<SamplerSlot,MAX_SAMPLER_OBJECTS> mSamplerSlots;
+    // The slot bound to each stage, or MAX_SAMPLER_OBJECTS for none.
+    std::array<UINT,MAX_COMBINED_SAMPLERS> mStageSamplers;
+    ULONG mSamplerUseCount;
+
+    // GL vertex array objects built for each vertex declaration and shader
+    // attribute layout. A draw only binds the one it needs, unless it's
+    // already bound. When all slots are used, the least recently used one is
+    // replaced. Protected by the mQueue lock.
+    struct VertexArraySlot {
+        VertexArrayKey mKey;
+        ULONG mLastUse;
+        bool mInUse;
+    };
+    std::unordered_map<VertexArrayKey,UINT,VertexArrayKeyHash> mVertexArrayCache;
+    std::array<VertexArraySlot,MAX_VERTEX_ARRAYS> mVertexArraySlots;
+    // The slot last bound, or MAX_VERTEX_ARRAYS for none.
+    UINT mCurVertexArray;
+    ULONG mVertexArrayUseCount;
+    // The buffers last sent for each stream binding. Only the streams read
+    // by a draw are updated, when they change. Protected by the mQueue lock.
+    std::array<GLVertexBuffer,MAX_STREAMS> mVertexBuffers;
+
+    // Each piece of GL state still set by its own command has a slot.
+    enum {
+        StateSlot_Material,
+        // Followed by one per texture stage.
+        StateSlot_Textures,
+        StateSlot_Count = StateSlot_Textures + MAX_COMBINED_SAMPLERS
+    };
+    // The last command sent for each state slot, and the state epoch it was
+    // sent in. The epoch moves on whenever a command that reads the state,
+    // like a draw or clear, is sent. Until then, a command that's still
+    // waiting to execute is skipped when another one for its slot comes
+    // along. Protected by the mQueue lock.
+    struct PendingState {
+        CommandHandle mHandle;
+        ULONG mEpoch;
+        PendingState() : mEpoch(0) { }
+    };
+    std::array<PendingState,StateSlot_Count> mPendingStates;
+    std::atomic<ULONG> mStateEpoch;
+    ULONG mSkippedStates;
+
     // Sends buffer values to update proj_fixup_uniform_buffer. Caller is
     // responsible for holding the mQueue lock.
     void resetProjectionFixup(UINT width, UINT height);
@@ -175,7 +498,69 @@ class D3DGLDevice : public IDirect3DDevice9 {
     void GLAPIENTRY debugProcGL(GLenum source, GLenum type, GLuint id, GLenum severity,
                                 GLsizei length, const GLchar *message) const;
 
-    HRESULT sendVtxData(INT startvtx, const StreamSource *srcstreams, UINT num_sources);
+    // Binds the VAO for the current vertex declaration and shader, creating
+    // it if needed, and sends the given streams' buffers if they changed.
+    // Caller is responsible for holding the mQueue lock.
+    HRESULT sendVtxData(const StreamSource *srcstreams, UINT num_sources);
+
+    // Sends a state command for the given state slot, skipping the last one
+    // if nothing has read the state since. Caller is responsible for holding
+    // the mQueue lock.
+    template<typename T, typename ...Args>
+    void sendState(UINT slot, Args...args);
+    // Called after sending a command that reads the current state.
+    void endStateEpoch() { ++mStateEpoch; }
+
+    // Marks state as needing to be sent with the next draw. Caller is
+    // responsible for holding the mQueue lock. Returns false for states
+    // that aren't handled.
+    bool markRenderState(D3DRENDERSTATETYPE state);
+    bool markSamplerState(DWORD sampler, D3DSAMPLERSTATETYPE type);
+    void markSampler(DWORD sampler)
+    {
+        mDirtySamplers |= 1<<sampler;
+        mDirtyGroups |= 1<<StateGroup_Samplers;
+    }
+    void markViewportState(DWORD entries)
+    {
+        mDirtyEntries[StateGroup_Viewport] |= entries;
+        mDirtyGroups |= 1<<StateGroup_Viewport;
+    }
+    // Add the GL state commands for the current value of an entry to a
+    // packet.
+    void addRenderState(CommandPacket &packet, D3DRENDERSTATETYPE state);
+    void addSampler(CommandPacket &packet, DWORD sampler);
+    void addStates(CommandPacket &packet, const DWORD *entries, DWORD samplers);
+    // Finds the cached sampler for the given state, adding a command to
+    // create it if needed.
+    UINT getSamplerSlot(CommandPacket &packet, const SamplerKey &key);
+    // Sends the state that changed since the last call, before a command
+    // that reads it. Caller is responsible for holding the mQueue lock.
+    void sendDirtyStates()
+    {
+        if(mDirtyGroups)
+            doSendDirtyStates();
+    }
+    void doSendDirtyStates();
+    // Sends the shader constants set since the last call, before a draw.
+    // Caller is responsible for holding the mQueue lock.
+    void sendDirtyConstants()
+    {
+        if(!mVSDirtyConstantsF.empty() || !mVSDirtyConstantsI.empty() ||
+           !mVSDirtyConstantsB.empty() || !mPSDirtyConstantsF.empty() ||
+           !mPSDirtyConstantsI.empty() || !mPSDirtyConstantsB.empty())
+            doSendDirtyConstants();
+    }
+    void doSendDirtyConstants();
+    // Resets render, sampler and texture stage states to their defaults,
+    // marking all of it dirty.
+    void resetStates(bool zenable);
+
+    // The state block being recorded, between BeginStateBlock and
+    // EndStateBlock. Set calls store state in it instead of the device.
+    D3DGLStateBlock *mRecording;
+
+    void buildStateBlockPacket(D3DGLStateBlock *block);
 
 public:
     D3DGLDevice(Direct3DGL *parent, const D3DAdapter &adapter, HWND window, DWORD flags);
@@ -185,14 +570,29 @@ public:
 
     const D3DAdapter &getAdapter() const { return mAdapter; }
     CommandQueue &getQueue() { return mQueue; }
+    GLState &getGLState() { return mGLState; }
 
     GLuint getShaderPipeline() const { return mGLState.pipeline; }
 
+    // Called by swapchains after sending a swap.
+    void endFrame();
+
+    // Called by buffer objects before deleting their GL buffer, so VAOs that
+    // still have it bound get rebound if a new buffer reuses the ID.
+    void releaseBuffer(GLuint bufferid);
+    // Called by textures and renderbuffers that may be render targets before
+    // deleting them, so cached framebuffers using them are deleted too.
+    void releaseFBAttachment(bool renderbuffer, GLuint id);
+
+    // Copies the shadow state held by a state block from or to the device.
+    // Applying sends the block's GL state packet.
+    void captureStateBlock(D3DGLStateBlock *block);
+    void applyStateBlock(D3DGLStateBlock *block);
+
     void initGL(HDC dc, HGLRC glcontext);
     void deinitGL();
     void readFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect,
-                           GLenum format, GLenum type, GLubyte *data,
-                           std::atomic<ULONG> &pendingupdates);
+                           GLenum format, GLenum type, GLubyte *data);
     void blitFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect,
                            GLenum dst_target, GLuint dst_binding, GLint dst_level, const RECT &dst_rect,
                            GLenum filter);
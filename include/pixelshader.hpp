@@ -17,7 +17,8 @@ class D3DGLPixelShader : public IDirect3DPixelShader9 {
 
     D3DGLDevice *mParent;
 
-    std::atomic<ULONG> mPendingUpdates;
+    // Sequence number of the last command compiling the shader.
+    std::atomic<ULONG> mCompileSeq;
     std::map<UINT,GLuint> mPrograms;
     UINT mSamplerMask; // Bitmask of used samplers
     UINT mShadowSamplers; // Bitmask of samplers that have a shadow texture format
@@ -32,9 +33,16 @@ public:
 
     GLuint compileShaderGL(UINT shadowsamplers);
 
-    ULONG getPendingUpdates() const { return mPendingUpdates; }
+    ULONG getCompileSeq() const { return mCompileSeq; }
 
     void setProgram(GLuint pipeline, UINT shadowmask, bool force);
+    GLuint getProgram(UINT shadowmask) const
+    {
+        auto iter = mPrograms.find(shadowmask);
+        if(iter == mPrograms.end()) return 0;
+        return iter->second;
+    }
+    const std::vector<DWORD> &getCode() const { return mCode; }
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -55,14 +63,18 @@ public:
     CompileAndSetPShaderCmd(D3DGLPixelShader *target, GLuint pipeline, UINT shadowsamplers=0)
       : mTarget(target), mPipeline(pipeline), mShadowSamplers(shadowsamplers) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         GLuint program = mTarget->compileShaderGL(mShadowSamplers);
         glUseProgramStages(mPipeline, GL_FRAGMENT_SHADER_BIT, program);
         checkGLError();
-        return sizeof(*this);
     }
+
+    void capture(CommandCapture &capture) const;
+    void captured(CommandCapture &capture) const;
+    static void replay(CaptureReader &reader, CaptureReplay &replay);
 };
+DECLARE_COMMAND(CompileAndSetPShaderCmd)
 
 class SetPShaderCmd : public Command {
     GLuint mPipeline;
@@ -72,12 +84,15 @@ public:
     SetPShaderCmd(GLuint pipeline, GLuint program)
       : mPipeline(pipeline), mProgram(program) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glUseProgramStages(mPipeline, GL_FRAGMENT_SHADER_BIT, mProgram);
         checkGLError();
-        return sizeof(*this);
     }
+
+    void capture(CommandCapture &capture) const;
+    static void replay(CaptureReader &reader, CaptureReplay &replay);
 };
+DECLARE_COMMAND(SetPShaderCmd)
 
 #endif /* PIXELSHADER_HPP */
@@ -6,6 +6,7 @@
 #include <d3d9.h>
 
 #include "glew.h"
+#include "commandqueue.hpp"
 
 
 struct GLFormatInfo;
@@ -21,7 +22,8 @@ class D3DGLPlainSurface : public IDirect3DSurface9 {
     bool mIsCompressed;
 
     std::shared_ptr<GLubyte> mBufData;
-    std::atomic<ULONG> mPendingUpdates;
+    // Sequence number of the last command writing to the surface data.
+    std::atomic<ULONG> mUpdateSeq;
 
     enum LockType {
         LT_Unlocked,
@@ -40,7 +42,7 @@ public:
     const D3DSURFACE_DESC &getDesc() const { return mDesc; }
     const GLFormatInfo &getFormat() const { return *mGLFormat; }
 
-    std::atomic<ULONG> &getPendingUpdates() { return mPendingUpdates; };
+    void setUpdateSeq(ULONG seq) { CommandQueue::raiseSeq(mUpdateSeq, seq); }
     std::shared_ptr<GLubyte> getBufData() const { return mBufData; }
 
     /*** IUnknown methods ***/
@@ -23,6 +23,7 @@ DEFINE_GUID(IID_D3DGLVertexShader,      0xaeb2cdd4, 0x6e41, 0x43ea, 0x94,0x1c, 0
 DEFINE_GUID(IID_D3DGLPixelShader,       0xaeb2cdd4, 0x6e41, 0x43ea, 0x94,0x1c, 0x83,0x61,0xcc,0x76,0x07,0x8e);
 DEFINE_GUID(IID_D3DGLVertexDeclaration, 0xaeb2cdd4, 0x6e41, 0x43ea, 0x94,0x1c, 0x83,0x61,0xcc,0x76,0x07,0x8f);
 DEFINE_GUID(IID_D3DGLQuery,             0xaeb2cdd4, 0x6e41, 0x43ea, 0x94,0x1c, 0x83,0x61,0xcc,0x76,0x07,0x90);
+DEFINE_GUID(IID_D3DGLStateBlock,        0xaeb2cdd4, 0x6e41, 0x43ea, 0x94,0x1c, 0x83,0x61,0xcc,0x76,0x07,0x91);
 
 
 #define RETURN_IF_IID_TYPE(obj, riid, TYPE) do { \
@@ -19,7 +19,8 @@ class D3DGLQuery : public IDirect3DQuery9 {
     GLenum mQueryType;
     GLuint mQueryId;
     GLuint mQueryResult;
-    std::atomic<ULONG> mPendingQueries;
+    // Sequence number of the last command checking for the result.
+    std::atomic<ULONG> mDataSeq;
 
     enum State {
         Signaled,
@@ -0,0 +1,104 @@
+#ifndef STATEBLOCK_HPP
+#define STATEBLOCK_HPP
+
+#include <atomic>
+#include <array>
+#include <bitset>
+#include <d3d9.h>
+
+#include "d3dgl.hpp"
+#include "device.hpp"
+#include "commandqueue.hpp"
+
+
+class D3DGLStateBlock : public IDirect3DStateBlock9 {
+    std::atomic<ULONG> mRefCount;
+
+    D3DGLDevice *mParent;
+
+    // The states held by the block and their values, laid out like the
+    // device's shadow state. Protected by the device's mQueue lock.
+    std::bitset<210> mRenderStateMask;
+    std::array<DWORD,210> mRenderState;
+    std::array<DWORD,MAX_COMBINED_SAMPLERS> mSamplerStateMask;
+    std::array<std::array<DWORD,14>,MAX_COMBINED_SAMPLERS> mSamplerState;
+    std::array<DWORD,MAX_TEXTURES> mTexStageStateMask;
+    std::array<std::array<DWORD,33>,MAX_TEXTURES> mTexStageState;
+    bool mHasViewport;
+    D3DVIEWPORT9 mViewport;
+    bool mHasScissorRect;
+    RECT mScissorRect;
+    bool mHasMaterial;
+    D3DMATERIAL9 mMaterial;
+    // Shader constants, with masks of the registers held. Bool constants are
+    // packed into bits like on the device.
+    std::bitset<256> mVSConstantFMask;
+    std::array<Vector4f,256> mVSConstantsF;
+    std::bitset<224> mPSConstantFMask;
+    std::array<Vector4f,224> mPSConstantsF;
+    DWORD mVSConstantIMask;
+    std::array<std::array<int,4>,16> mVSConstantsI;
+    DWORD mPSConstantIMask;
+    std::array<std::array<int,4>,16> mPSConstantsI;
+    DWORD mVSConstantBMask;
+    DWORD mVSConstantsB;
+    DWORD mPSConstantBMask;
+    DWORD mPSConstantsB;
+    DWORD mStreamFreqMask;
+    std::array<UINT,MAX_STREAMS> mStreamFreqs;
+
+    // Bound objects, which are captured and applied through the device's
+    // Get and Set calls.
+    DWORD mTextureMask;
+    std::array<IDirect3DBaseTexture9*,MAX_COMBINED_SAMPLERS> mTextures;
+    bool mHasVertexShader;
+    IDirect3DVertexShader9 *mVertexShader;
+    bool mHasPixelShader;
+    IDirect3DPixelShader9 *mPixelShader;
+    bool mHasVertexDecl;
+    IDirect3DVertexDeclaration9 *mVertexDecl;
+    DWORD mStreamMask;
+    std::array<IDirect3DVertexBuffer9*,MAX_STREAMS> mStreams;
+    std::array<UINT,MAX_STREAMS> mStreamOffsets;
+    std::array<UINT,MAX_STREAMS> mStreamStrides;
+    bool mHasIndices;
+    IDirect3DIndexBuffer9 *mIndices;
+
+    // The GL state commands for the held values, built by the first Apply
+    // after they change. Entries that also depend on state outside the block
+    // aren't in the packet, and are marked dirty on the device instead. This
+    // includes the sampler bindings, which depend on the bound textures.
+    CommandPacket mPacket;
+    bool mPacketValid;
+    std::array<DWORD,StateGroup_Samplers> mPacketEntries;
+    std::array<DWORD,StateGroup_Samplers> mMarkEntries;
+    DWORD mMarkSamplers;
+
+    template<typename T>
+    static void setObject(T *&dst, T *src)
+    {
+        if(src) src->AddRef();
+        if(dst) dst->Release();
+        dst = src;
+    }
+
+    friend class D3DGLDevice;
+
+public:
+    D3DGLStateBlock(D3DGLDevice *parent);
+    virtual ~D3DGLStateBlock();
+
+    // Sets which states the block holds. Recorded blocks start empty.
+    void init(D3DSTATEBLOCKTYPE type);
+
+    /*** IUnknown methods ***/
+    virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
+    virtual ULONG WINAPI AddRef() final;
+    virtual ULONG WINAPI Release() final;
+    /*** IDirect3DStateBlock9 methods ***/
+    virtual HRESULT WINAPI GetDevice(IDirect3DDevice9 **device) final;
+    virtual HRESULT WINAPI Capture() final;
+    virtual HRESULT WINAPI Apply() final;
+};
+
+#endif /* STATEBLOCK_HPP */
@@ -30,9 +30,12 @@ public:
     D3DGLSwapChain(D3DGLDevice *parent);
     virtual ~D3DGLSwapChain();
 
-    void swapBuffersGL(size_t backbuffer);
+    void swapBuffersGL(D3DGLRenderTarget *backbuffer);
 
     bool init(const D3DPRESENT_PARAMETERS *params, HWND window, bool isauto=false);
+    // Swaps the given backbuffer to the window, returning the sequence
+    // number of the swap.
+    ULONG present(D3DGLRenderTarget *backbuffer);
 
     D3DGLRenderTarget *getBackbuffer() { return mBackbuffers[0]; }
     bool getIsWindowed() const { return mParams.Windowed; }
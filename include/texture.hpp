@@ -25,7 +25,8 @@ class D3DGLTexture : public IDirect3DTexture9 {
     std::vector<GLubyte,AlignedAllocator<GLubyte>> mSysMem;
 
     RECT mDirtyRect;
-    std::atomic<ULONG> mUpdateInProgress;
+    // Sequence number of the last command updating the texture data.
+    std::atomic<ULONG> mUpdateSeq;
 
     D3DSURFACE_DESC mDesc;
     std::vector<D3DGLTextureSurface*> mSurfaces;
@@ -45,6 +46,7 @@ public:
 
     const D3DSURFACE_DESC &getDesc() const { return mDesc; }
     GLuint getTextureId() const { return mTexId; }
+    D3DGLTextureSurface *getSurface(UINT level) const { return mSurfaces[level]; }
     const GLFormatInfo &getFormat() const { return *mGLFormat; }
 
     void initGL();
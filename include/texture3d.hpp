@@ -25,7 +25,8 @@ class D3DGLTexture3D : public IDirect3DVolumeTexture9 {
     std::vector<GLubyte,AlignedAllocator<GLubyte>> mSysMem;
 
     D3DBOX mDirtyBox;
-    std::atomic<ULONG> mUpdateInProgress;
+    // Sequence number of the last command updating the texture data.
+    std::atomic<ULONG> mUpdateSeq;
 
     D3DVOLUME_DESC mDesc;
     std::vector<D3DGLTextureVolume*> mVolumes;
@@ -45,6 +46,7 @@ public:
 
     const D3DVOLUME_DESC &getDesc() const { return mDesc; }
     GLuint getTextureId() const { return mTexId; }
+    D3DGLTextureVolume *getVolume(UINT level) const { return mVolumes[level]; }
     const GLFormatInfo &getFormat() const { return *mGLFormat; }
 
     void initGL();
@@ -26,7 +26,8 @@ class D3DGLCubeTexture : public IDirect3DCubeTexture9 {
     std::vector<GLubyte,AlignedAllocator<GLubyte>> mSysMem;
 
     std::array<RECT,6> mDirtyRect;
-    std::atomic<ULONG> mUpdateInProgress;
+    // Sequence number of the last command updating the texture data.
+    std::atomic<ULONG> mUpdateSeq;
 
     D3DSURFACE_DESC mDesc;
     std::vector<std::array<D3DGLCubeSurface*,6>> mSurfaces;
@@ -46,6 +47,7 @@ public:
 
     const D3DSURFACE_DESC &getDesc() const { return mDesc; }
     GLuint getTextureId() const { return mTexId; }
+    D3DGLCubeSurface *getSurface(UINT level, GLint face) const { return mSurfaces[level][face]; }
     const GLFormatInfo &getFormat() const { return *mGLFormat; }
 
     void initGL();
@@ -17,7 +17,8 @@ class D3DGLVertexShader : public IDirect3DVertexShader9 {
 
     D3DGLDevice *mParent;
 
-    std::atomic<ULONG> mPendingUpdates;
+    // Sequence number of the last command compiling the shader.
+    std::atomic<ULONG> mCompileSeq;
     std::atomic<GLuint> mProgram;
     UINT mSamplerMask; // Bitmask of used samplers
     UINT mShadowSamplers; // Bitmask of samplers that have a shadow texture format
@@ -34,10 +35,11 @@ public:
 
     GLuint compileShaderGL(UINT shadowsamplers);
 
-    void addPendingUpdate() { ++mPendingUpdates; }
-    ULONG getPendingUpdates() { return mPendingUpdates; }
+    void setCompileSeq(ULONG seq) { CommandQueue::raiseSeq(mCompileSeq, seq); }
+    ULONG getCompileSeq() const { return mCompileSeq; }
 
     GLuint getProgram() const { return mProgram; }
+    const std::vector<DWORD> &getCode() const { return mCode; }
     GLint getLocation(BYTE usage, BYTE index) const
     {
         auto idx = mUsageMap.find((usage<<8) | index);
@@ -66,14 +68,18 @@ public:
     CompileAndSetVShaderCmd(D3DGLVertexShader *target, GLuint pipeline, UINT shadowsamplers=0)
       : mTarget(target), mPipeline(pipeline), mShadowSamplers(shadowsamplers) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         GLuint program = mTarget->compileShaderGL(mShadowSamplers);
         glUseProgramStages(mPipeline, GL_VERTEX_SHADER_BIT, program);
         checkGLError();
-        return sizeof(*this);
     }
+
+    void capture(CommandCapture &capture) const;
+    void captured(CommandCapture &capture) const;
+    static void replay(CaptureReader &reader, CaptureReplay &replay);
 };
+DECLARE_COMMAND(CompileAndSetVShaderCmd)
 
 class SetVShaderCmd : public Command {
     GLuint mPipeline;
@@ -83,12 +89,15 @@ public:
     SetVShaderCmd(GLuint pipeline, GLuint program)
       : mPipeline(pipeline), mProgram(program) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glUseProgramStages(mPipeline, GL_VERTEX_SHADER_BIT, mProgram);
         checkGLError();
-        return sizeof(*this);
     }
+
+    void capture(CommandCapture &capture) const;
+    static void replay(CaptureReader &reader, CaptureReplay &replay);
 };
+DECLARE_COMMAND(SetVShaderCmd)
 
 #endif /* VERTEXSHADER_HPP */
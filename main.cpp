@@ -12,7 +12,11 @@
 #include "glew.h"
 #include "wglew.h"
 #include "trace.hpp"
+#include "commandqueue.hpp"
+#include "capture.hpp"
+#include "capturereplay.hpp"
 #include "d3dgl.hpp"
+#include "device.hpp"
 #include "private_iids.hpp"
 
 
@@ -127,6 +131,65 @@ BOOL WINAPI DllMain(HINSTANCE hModule, DWORD reason, void */*lpReserved*/)
                     ERR("Invalid log level: %s\n", str);
             }
 
+            str = getenv("D3DGL_QUEUE_SPIN");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    QueueSpinCount = val;
+                else
+                    ERR("Invalid queue spin count: %s\n", str);
+            }
+
+            str = getenv("D3DGL_QUEUE_YIELD");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    QueueYieldCount = val;
+                else
+                    ERR("Invalid queue yield count: %s\n", str);
+            }
+
+            str = getenv("D3DGL_QUEUE_MAXMEM");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    QueueMaxMemory = val;
+                else
+                    ERR("Invalid queue memory limit: %s\n", str);
+            }
+
+            str = getenv("D3DGL_QUEUE_STATS");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    QueueStats = val;
+                else
+                    ERR("Invalid queue stats level: %s\n", str);
+            }
+
+            str = getenv("D3DGL_QUEUE_DIRECT");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    QueueDirect = val;
+                else
+                    ERR("Invalid direct queue setting: %s\n", str);
+            }
+
+            str = getenv("D3DGL_CAPTURE");
+            if(str && str[0] != '\0')
+                QueueCapturePrefix = str;
+
             TRACE("DLL_PROCESS_ATTACH\n");
             break;
 
@@ -250,6 +313,62 @@ DECLSPEC_EXPORT HRESULT WINAPI DECLSPEC_HOTPATCH Direct3DCreate9Ex(UINT sdk_vers
     return D3DERR_NOTAVAILABLE;
 }
 
+/***********************************************************************
+ *              D3DGL_GetQueueStats (D3D9.@)
+ *
+ * Retrieves the command queue statistics of a device. Collection must be
+ * enabled by setting D3DGL_QUEUE_STATS.
+ */
+DECLSPEC_EXPORT HRESULT WINAPI D3DGL_GetQueueStats(IDirect3DDevice9 *iface, D3DGLQueueStats *stats)
+{
+    TRACE("iface %p, stats %p\n", iface, stats);
+
+    if(!iface || !stats || stats->Size < sizeof(*stats))
+        return D3DERR_INVALIDCALL;
+
+    D3DGLDevice *device;
+    if(FAILED(iface->QueryInterface(IID_D3DGLDevice, (void**)&device)))
+    {
+        WARN("Device %p is not a D3DGLDevice\n", iface);
+        return D3DERR_INVALIDCALL;
+    }
+    device->getQueue().getStats(*stats);
+    device->Release();
+
+    return D3D_OK;
+}
+
+/***********************************************************************
+ *              D3DGL_ReplayCapture (D3D9.@)
+ *
+ * Replays a command capture written with D3DGL_CAPTURE on a new device,
+ * presenting to the given window as fast as possible. The optional callback
+ * is called after each frame is presented.
+ */
+DECLSPEC_EXPORT HRESULT WINAPI D3DGL_ReplayCapture(HWND window, const void *data, SIZE_T size, D3DGLReplayFrameProc proc, void *user)
+{
+    TRACE("window %p, data %p, size %lu, proc %p, user %p\n", window, data, (unsigned long)size, proc, user);
+
+    if(!window || !data)
+        return D3DERR_INVALIDCALL;
+
+    if(!init_d3dgl())
+        return D3DERR_NOTAVAILABLE;
+
+    Direct3DGL *d3d = new Direct3DGL();
+    if(!d3d->init())
+    {
+        delete d3d;
+        return D3DERR_NOTAVAILABLE;
+    }
+    d3d->AddRef();
+
+    HRESULT hr = CaptureReplay(d3d, window, proc, user).run(data, size);
+    d3d->Release();
+
+    return hr;
+}
+
 /*******************************************************************
  *       Direct3DShaderValidatorCreate9 (D3D9.@)
  *
@@ -672,7 +672,7 @@ static const char *get_GLSL_uniform_type(Context *ctx, const RegisterType rtype)
     {
         case REG_TYPE_CONST: return "vec4";
         case REG_TYPE_CONSTINT: return "ivec4";
-        case REG_TYPE_CONSTBOOL: return "bool";
+        case REG_TYPE_CONSTBOOL: return "uint";
         default: break;
     }
 
@@ -1181,7 +1181,11 @@ static void output_GLSL_uniform_array(Context *ctx, const RegisterType regtype,
             }
         }
         const char *type = get_GLSL_uniform_type(ctx, regtype);
-        output_line(ctx, "%s%s %s[%d];%s", pre, type, buf, size, post);
+        // Bools are packed as bits of a single uint.
+        if(regtype == REG_TYPE_CONSTBOOL)
+            output_line(ctx, "%s%s %s;%s", pre, type, buf, post);
+        else
+            output_line(ctx, "%s%s %s[%d];%s", pre, type, buf, size, post);
     }
 }
 
@@ -1253,7 +1257,10 @@ static void emit_GLSL_uniform(Context *ctx, RegisterType regtype, int regnum)
 
     push_output(ctx, &ctx->globals);
     get_GLSL_uniform_array_varname(ctx, regtype, name, sizeof(name));
-    output_line(ctx, "#define %s %s[%d]", varname, name, regnum);
+    if(regtype == REG_TYPE_CONSTBOOL)
+        output_line(ctx, "#define %s ((%s & %uu) != 0u)", varname, name, 1u<<regnum);
+    else
+        output_line(ctx, "#define %s %s[%d]", varname, name, regnum);
     pop_output(ctx);
 }
 
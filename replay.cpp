@@ -0,0 +1,210 @@
+/* Command stream replay.
+ *
+ * Replays a capture written with D3DGL_CAPTURE as fast as possible, and
+ * reports frame times. The replay itself is done by d3d9.dll's
+ * D3DGL_ReplayCapture, which creates a device on a hidden window, creates
+ * the captured objects again from their captured descriptions and data, and
+ * sends each captured command to the new device. So the queue and the GL
+ * side both do the same work they did when captured. Each
+ * SwapchainSwapBuffers presents a frame, waiting on the previous one like
+ * Present does.
+ *
+ * A GL driver is needed, but not a display, so it runs headless under Wine
+ * with llvmpipe. The execution times recorded in the capture are reported
+ * alongside for comparison.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "capture.hpp"
+
+
+typedef HRESULT (WINAPI *LPD3DGLREPLAYCAPTURE)(HWND window, const void *data, SIZE_T size,
+                                               D3DGLReplayFrameProc proc, void *user);
+
+static const char ReplayClassName[] = "D3DGLReplayClass";
+
+
+static LONGLONG getTicks()
+{
+    LARGE_INTEGER ticks;
+    QueryPerformanceCounter(&ticks);
+    return ticks.QuadPart;
+}
+
+
+// The time each frame was presented, and how long its commands took to
+// execute when captured.
+struct FrameTimes {
+    std::vector<LONGLONG> mEnds;
+    std::vector<ULONGLONG> mCapturedUs;
+    // The first frame of each pass.
+    std::vector<size_t> mPassStarts;
+};
+
+static void CALLBACK frame_proc(void *user, ULONG /*frame*/, ULONGLONG captured_us)
+{
+    FrameTimes *times = static_cast<FrameTimes*>(user);
+    times->mEnds.push_back(getTicks());
+    times->mCapturedUs.push_back(captured_us);
+}
+
+
+// A read-only view of a whole file.
+class MappedFile {
+    HANDLE mFile;
+    HANDLE mMapping;
+    const char *mData;
+    size_t mSize;
+
+public:
+    MappedFile() : mFile(INVALID_HANDLE_VALUE), mMapping(nullptr), mData(nullptr), mSize(0) { }
+    ~MappedFile()
+    {
+        if(mData) UnmapViewOfFile(mData);
+        if(mMapping) CloseHandle(mMapping);
+        if(mFile != INVALID_HANDLE_VALUE) CloseHandle(mFile);
+    }
+
+    bool open(const char *fname)
+    {
+        mFile = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if(mFile == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "Failed to open %s, error %lu\n", fname, GetLastError());
+            return false;
+        }
+
+        LARGE_INTEGER size;
+        if(!GetFileSizeEx(mFile, &size) || size.QuadPart == 0 || (ULONGLONG)size.QuadPart > (size_t)-1)
+        {
+            fprintf(stderr, "Bad size for %s\n", fname);
+            return false;
+        }
+        mSize = (size_t)size.QuadPart;
+
+        mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if(mMapping)
+            mData = reinterpret_cast<const char*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+        if(!mData)
+        {
+            fprintf(stderr, "Failed to map %s, error %lu\n", fname, GetLastError());
+            return false;
+        }
+        return true;
+    }
+
+    const char *data() const { return mData; }
+    size_t size() const { return mSize; }
+};
+
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "Usage: %s <capture file> [loops]\n", argv[0]);
+        return 1;
+    }
+    ULONG loops = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 1;
+    if(loops < 1) loops = 1;
+
+    MappedFile file;
+    if(!file.open(argv[1]))
+        return 1;
+
+    HMODULE d3d9 = LoadLibraryA("d3d9.dll");
+    if(!d3d9)
+    {
+        fprintf(stderr, "Failed to load d3d9.dll, error %lu\n", GetLastError());
+        return 1;
+    }
+    LPD3DGLREPLAYCAPTURE replay_capture = reinterpret_cast<LPD3DGLREPLAYCAPTURE>(
+        GetProcAddress(d3d9, "D3DGL_ReplayCapture")
+    );
+    if(!replay_capture)
+    {
+        fprintf(stderr, "d3d9.dll is not D3DGL, or is too old to replay captures\n");
+        return 1;
+    }
+
+    // The window is never shown. The device still presents to it, so the
+    // swaps cost what they did when captured.
+    HINSTANCE instance = GetModuleHandleA(nullptr);
+    WNDCLASSA wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.lpfnWndProc   = DefWindowProcA;
+    wc.hInstance     = instance;
+    wc.lpszClassName = ReplayClassName;
+    wc.style         = CS_OWNDC;
+    if(!RegisterClassA(&wc))
+    {
+        fprintf(stderr, "Failed to register window class, error %lu\n", GetLastError());
+        return 1;
+    }
+    HWND window = CreateWindowExA(0, ReplayClassName, "d3dgl-replay", WS_OVERLAPPEDWINDOW,
+                                  0, 0, 640, 480, nullptr, nullptr, instance, nullptr);
+    if(!window)
+    {
+        fprintf(stderr, "Failed to create window, error %lu\n", GetLastError());
+        return 1;
+    }
+
+    FrameTimes times;
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    LONGLONG begin = getTicks();
+    for(ULONG loop = 0;loop < loops;++loop)
+    {
+        times.mPassStarts.push_back(times.mEnds.size());
+        HRESULT hr = replay_capture(window, file.data(), file.size(), frame_proc, &times);
+        if(FAILED(hr))
+        {
+            fprintf(stderr, "Failed to replay %s: 0x%lx\n", argv[1], hr);
+            return 1;
+        }
+    }
+    LONGLONG finish = getTicks();
+
+    DestroyWindow(window);
+    FreeLibrary(d3d9);
+
+    double secs = (double)(finish-begin) / (double)freq.QuadPart;
+    printf("%lu frames in %.3f s, %.1f frames/sec\n", (unsigned long)times.mEnds.size(), secs,
+           (double)times.mEnds.size() / secs);
+
+    // The first frame of each pass also creates the device and loads the
+    // resources, so it isn't counted.
+    std::vector<double> frame_ms;
+    for(size_t i = 1;i < times.mEnds.size();++i)
+    {
+        if(std::find(times.mPassStarts.begin(), times.mPassStarts.end(), i) != times.mPassStarts.end())
+            continue;
+        frame_ms.push_back((double)(times.mEnds[i]-times.mEnds[i-1]) * 1000.0 / (double)freq.QuadPart);
+    }
+    if(!frame_ms.empty())
+    {
+        std::sort(frame_ms.begin(), frame_ms.end());
+        double total = 0.0;
+        for(double ms : frame_ms)
+            total += ms;
+        printf("frame times: avg %.3f ms, min %.3f ms, median %.3f ms, max %.3f ms\n",
+               total / frame_ms.size(), frame_ms.front(), frame_ms[frame_ms.size()/2],
+               frame_ms.back());
+    }
+
+    if(!times.mCapturedUs.empty())
+    {
+        double total = 0.0;
+        for(ULONGLONG us : times.mCapturedUs)
+            total += (double)us / 1000.0;
+        printf("captured execution time: avg %.3f ms per frame\n", total / times.mCapturedUs.size());
+    }
+
+    return 0;
+}
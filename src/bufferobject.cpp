@@ -2,6 +2,8 @@
 #include "bufferobject.hpp"
 
 #include "device.hpp"
+#include "capture.hpp"
+#include "capturereplay.hpp"
 #include "private_iids.hpp"
 
 
@@ -14,8 +16,6 @@ void D3DGLBufferObject::initGL(const GLubyte *data)
     glGenBuffers(1, &mBufferId);
     glNamedBufferDataEXT(mBufferId, data_len, data, usage);
     checkGLError();
-
-    mUpdateInProgress = 0;
 }
 class InitBufferObjectCmd : public Command {
     D3DGLBufferObject *mTarget;
@@ -26,12 +26,56 @@ public:
       : mTarget(target), mData(data)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->initGL(mData.get());
-        return sizeof(*this);
+    }
+
+    // The initial data is always cleared, so only the description is needed.
+    void capture(CommandCapture &capture) const
+    {
+        D3DVERTEXBUFFER_DESC desc;
+        mTarget->GetDesc(&desc);
+        capture.writeNewObject(mTarget);
+        capture.write(desc);
+    }
+    void captured(CommandCapture &capture) const
+    {
+        capture.addName(CaptureName_Buffer, mTarget->getBufferId(), mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        ULONG id = reader.read<ULONG>();
+        D3DVERTEXBUFFER_DESC desc = reader.read<D3DVERTEXBUFFER_DESC>();
+        if(desc.Format == D3DFMT_VERTEXDATA)
+        {
+            IDirect3DVertexBuffer9 *vbuf;
+            HRESULT hr = replay.getDevice()->CreateVertexBuffer(desc.Size, desc.Usage, desc.FVF,
+                                                                desc.Pool, &vbuf, nullptr);
+            if(FAILED(hr))
+            {
+                ERR("Failed to create vertex buffer %lu: 0x%lx\n", id, hr);
+                return;
+            }
+            D3DGLBufferObject *buffer = static_cast<D3DGLBufferObject*>(vbuf);
+            replay.addObject(id, vbuf, buffer, buffer->getBufferId());
+        }
+        else
+        {
+            IDirect3DIndexBuffer9 *ibuf;
+            HRESULT hr = replay.getDevice()->CreateIndexBuffer(desc.Size, desc.Usage, desc.Format,
+                                                               desc.Pool, &ibuf, nullptr);
+            if(FAILED(hr))
+            {
+                ERR("Failed to create index buffer %lu: 0x%lx\n", id, hr);
+                return;
+            }
+            D3DGLBufferObject *buffer = static_cast<D3DGLBufferObject*>(ibuf);
+            replay.addObject(id, ibuf, buffer, buffer->getBufferId());
+        }
     }
 };
+DEFINE_COMMAND(InitBufferObjectCmd)
 
 class DestroyBufferCmd : public Command {
     GLuint mBufferId;
@@ -39,13 +83,23 @@ class DestroyBufferCmd : public Command {
 public:
     DestroyBufferCmd(GLuint buffer) : mBufferId(buffer) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glDeleteBuffers(1, &mBufferId);
         checkGLError();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Buffer, mBufferId);
+    }
+    // Releasing the replayed buffer deletes it the same way.
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.releaseObject(reader.read<ULONG>());
     }
 };
+DEFINE_COMMAND(DestroyBufferCmd)
 
 void D3DGLBufferObject::resizeBufferGL(UINT length)
 {
@@ -60,12 +114,22 @@ class ResizeBufferCmd : public Command {
 public:
     ResizeBufferCmd(D3DGLBufferObject *target, UINT length) : mTarget(target), mLength(length) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->resizeBufferGL(mLength);
-        return sizeof(*this);
     }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mTarget);
+        capture.write(mLength);
+    }
+    // A resize is always followed by a load of the whole buffer, which grows
+    // the replayed one.
+    static void replay(CaptureReader&, CaptureReplay&)
+    { }
 };
+DEFINE_COMMAND(ResizeBufferCmd)
 
 void D3DGLBufferObject::loadBufferDataGL(UINT offset, UINT length, const GLubyte *data, GLbitfield flags)
 {
@@ -78,8 +142,6 @@ void D3DGLBufferObject::loadBufferDataGL(UINT offset, UINT length, const GLubyte
         glUnmapNamedBufferEXT(mBufferId);
     }
     checkGLError();
-
-    --mUpdateInProgress;
 }
 class LoadBufferDataCmd : public Command {
     D3DGLBufferObject *mTarget;
@@ -93,12 +155,30 @@ public:
       : mTarget(target), mOffset(offset), mLength(length), mData(data), mFlags(flags)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->loadBufferDataGL(mOffset, mLength, mData.get(), mFlags);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mTarget);
+        capture.write(mOffset);
+        capture.write(mFlags);
+        capture.writeData(&mData.get()[mOffset], mLength);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        D3DGLBufferObject *target = replay.getObject<D3DGLBufferObject>(reader.read<ULONG>());
+        UINT offset = reader.read<UINT>();
+        GLbitfield flags = reader.read<GLbitfield>();
+        size_t length;
+        const GLubyte *data = reinterpret_cast<const GLubyte*>(reader.readData(length));
+        if(target && data)
+            target->loadBufferData(offset, length, data, flags);
     }
 };
+DEFINE_COMMAND(LoadBufferDataCmd)
 
 
 D3DGLBufferObject::D3DGLBufferObject(D3DGLDevice *parent)
@@ -114,7 +194,7 @@ D3DGLBufferObject::D3DGLBufferObject(D3DGLDevice *parent)
   , mLock(LT_Unlocked)
   , mLockedOffset(0)
   , mLockedLength(0)
-  , mUpdateInProgress(0)
+  , mUpdateSeq(0)
 {
 }
 
@@ -122,9 +202,9 @@ D3DGLBufferObject::~D3DGLBufferObject()
 {
     if(mBufferId)
     {
+        mParent->releaseBuffer(mBufferId);
         mParent->getQueue().send<DestroyBufferCmd>(mBufferId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
+        mParent->getQueue().waitFor(mUpdateSeq);
         mBufferId = 0;
     }
 }
@@ -150,7 +230,6 @@ bool D3DGLBufferObject::init_common(UINT length, DWORD usage, D3DPOOL pool)
     mBufData.reset(DataAllocator<GLubyte>()(data_len), DataDeallocator<GLubyte>());
     memset(mBufData.get(), 0, data_len);
 
-    mUpdateInProgress = 1;
     mParent->getQueue().sendSync<InitBufferObjectCmd>(this, mBufData);
 
     return true;
@@ -217,21 +296,46 @@ bool D3DGLBufferObject::init_ibo(UINT length, DWORD usage, D3DFORMAT format, D3D
 
 void D3DGLBufferObject::resetBufferData(const GLubyte *data, GLuint length)
 {
-    ++mUpdateInProgress;
     mParent->getQueue().lock();
-    if(length > mLength)
+    bool grow = (length > mLength);
+    if(grow)
     {
         mLength = length;
         mParent->getQueue().doSend<ResizeBufferCmd>(this, length);
     }
-    if(mUpdateInProgress > 1)
+    if(grow || !mParent->getQueue().isExecuted(mUpdateSeq))
     {
         UINT data_len = (mLength+15) & ~15;
         mBufData.reset(DataAllocator<GLubyte>()(data_len), DataDeallocator<GLubyte>());
     }
     memcpy(mBufData.get(), data, length);
 
-    mParent->getQueue().doSend<LoadBufferDataCmd>(this, 0, mLength, mBufData, 0);
+    CommandQueue::raiseSeq(mUpdateSeq,
+        mParent->getQueue().doSend<LoadBufferDataCmd>(this, 0, mLength, mBufData, 0)
+    );
+    mParent->getQueue().unlock();
+}
+
+void D3DGLBufferObject::loadBufferData(UINT offset, UINT length, const GLubyte *data, GLbitfield flags)
+{
+    mParent->getQueue().lock();
+    bool grow = (length > mLength || offset > mLength-length);
+    if(grow)
+    {
+        mLength = offset + length;
+        mParent->getQueue().doSend<ResizeBufferCmd>(this, mLength);
+    }
+    // Only the loaded range is read, so the rest doesn't need keeping.
+    if(grow || !mParent->getQueue().isExecuted(mUpdateSeq))
+    {
+        UINT data_len = (mLength+15) & ~15;
+        mBufData.reset(DataAllocator<GLubyte>()(data_len), DataDeallocator<GLubyte>());
+    }
+    memcpy(mBufData.get()+offset, data, length);
+
+    CommandQueue::raiseSeq(mUpdateSeq,
+        mParent->getQueue().doSend<LoadBufferDataCmd>(this, offset, length, mBufData, flags)
+    );
     mParent->getQueue().unlock();
 }
 
@@ -402,7 +506,7 @@ HRESULT D3DGLBufferObject::Lock(UINT offset, UINT length, void **data, DWORD fla
     // No need to wait if we're not writing over previous data.
     if((flags&D3DLOCK_DISCARD))
     {
-        if(mUpdateInProgress > 0)
+        if(!mParent->getQueue().isExecuted(mUpdateSeq))
         {
             UINT data_len = (mLength+15) & ~15;
             mBufData.reset(DataAllocator<GLubyte>()(data_len), DataDeallocator<GLubyte>());
@@ -410,8 +514,7 @@ HRESULT D3DGLBufferObject::Lock(UINT offset, UINT length, void **data, DWORD fla
     }
     else if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
     {
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
+        mParent->getQueue().waitFor(mUpdateSeq);
     }
 
     mLockedOffset = offset;
@@ -434,15 +537,14 @@ HRESULT D3DGLBufferObject::Unlock()
 
     if(mLock != LT_ReadOnly)
     {
-        ++mUpdateInProgress;
         GLbitfield flags = 0;
         if((mLockedFlags&D3DLOCK_DISCARD))
             flags |= GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_WRITE_BIT;
         else if((mLockedFlags&D3DLOCK_NOOVERWRITE))
             flags |= GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_WRITE_BIT;
-        mParent->getQueue().send<LoadBufferDataCmd>(this,
+        CommandQueue::raiseSeq(mUpdateSeq, mParent->getQueue().send<LoadBufferDataCmd>(this,
             mLockedOffset, mLockedLength, mBufData, flags
-        );
+        ));
     }
 
     mLockedOffset = 0;
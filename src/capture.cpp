@@ -0,0 +1,203 @@
+#include "capture.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "trace.hpp"
+
+
+std::string QueueCapturePrefix;
+
+// Records are buffered and written out in chunks of about this size.
+static const size_t CaptureChunkSize = 1024*1024;
+
+
+CommandCapture::CommandCapture()
+  : mFile(nullptr)
+  , mNextId(CaptureId_First)
+{
+}
+
+CommandCapture::~CommandCapture()
+{
+    close();
+}
+
+bool CommandCapture::open(const char *fname, LONGLONG ticks_per_sec, const char *const *names, DWORD num_names)
+{
+    close();
+
+    mFile = fopen(fname, "wb");
+    if(!mFile)
+    {
+        ERR("Failed to open %s for writing\n", fname);
+        return false;
+    }
+
+    CaptureHeader header;
+    memcpy(header.Magic, CaptureMagic, sizeof(header.Magic));
+    header.Version = CaptureVersion;
+    header.NumOpcodes = num_names;
+    header.Reserved = 0;
+    header.TicksPerSec = ticks_per_sec;
+    fwrite(&header, sizeof(header), 1, mFile);
+    size_t names_len = 0;
+    for(DWORD i = 0;i < num_names;++i)
+    {
+        size_t len = strlen(names[i])+1;
+        fwrite(names[i], 1, len, mFile);
+        names_len += len;
+    }
+    static const char padding[4] = { 0, 0, 0, 0 };
+    fwrite(padding, 1, ((names_len+3)&~size_t(3)) - names_len, mFile);
+
+    mBuffer.reserve(CaptureChunkSize*2);
+    TRACE("Capturing commands to %s\n", fname);
+    return true;
+}
+
+void CommandCapture::close()
+{
+    if(mFile)
+    {
+        flush();
+        fclose(mFile);
+        mFile = nullptr;
+    }
+}
+
+void CommandCapture::flush()
+{
+    if(!mBuffer.empty())
+    {
+        if(fwrite(mBuffer.data(), 1, mBuffer.size(), mFile) != mBuffer.size())
+            ERR("Failed to write %lu bytes of capture data\n", (unsigned long)mBuffer.size());
+        mBuffer.clear();
+    }
+}
+
+
+void CommandCapture::begin(ULONG opcode)
+{
+    CaptureRecord record;
+    record.Opcode = opcode;
+    record.Size = 0;
+    record.Ticks = 0;
+
+    mRecords.push_back(mBuffer.size());
+    write(record);
+}
+
+void CommandCapture::seal()
+{
+    mBuffer.resize((mBuffer.size()+3) & ~size_t(3), 0);
+
+    size_t pos = mRecords.back();
+    CaptureRecord *record = reinterpret_cast<CaptureRecord*>(&mBuffer[pos]);
+    record->Size = mBuffer.size() - pos - sizeof(CaptureRecord);
+}
+
+void CommandCapture::end(LONGLONG ticks)
+{
+    CaptureRecord *record = reinterpret_cast<CaptureRecord*>(&mBuffer[mRecords.back()]);
+    record->Ticks = (DWORD)std::min<LONGLONG>(ticks, 0xffffffff);
+    mRecords.pop_back();
+
+    // Only write out finished records.
+    if(mRecords.empty() && mBuffer.size() >= CaptureChunkSize)
+        flush();
+}
+
+
+void CommandCapture::writeData(const void *data, size_t size)
+{
+    write<DWORD>(size);
+    const char *bytes = reinterpret_cast<const char*>(data);
+    mBuffer.insert(mBuffer.end(), bytes, bytes+size);
+}
+
+void CommandCapture::writeNewObject(const void *obj)
+{
+    ULONG id = mNextId++;
+    mObjects[obj] = id;
+    write(id);
+}
+
+void CommandCapture::writeObject(const void *obj)
+{
+    ULONG id = CaptureId_None;
+    if(obj)
+    {
+        auto iter = mObjects.find(obj);
+        if(iter != mObjects.end())
+            id = iter->second;
+        else
+            ERR("Capturing unknown object %p\n", obj);
+    }
+    write(id);
+}
+
+void CommandCapture::addName(CaptureNameType type, UINT name, const void *obj)
+{
+    auto iter = mObjects.find(obj);
+    if(iter == mObjects.end())
+    {
+        ERR("Capturing name %u of unknown object %p\n", name, obj);
+        return;
+    }
+    addName(type, name, iter->second);
+}
+
+void CommandCapture::addName(CaptureNameType type, UINT name, ULONG id)
+{
+    // GL names are reused once deleted, so a new one replaces the old.
+    if(name != 0)
+        mNames[type][name] = id;
+}
+
+void CommandCapture::writeName(CaptureNameType type, UINT name)
+{
+    ULONG id = CaptureId_None;
+    if(name != 0)
+    {
+        auto iter = mNames[type].find(name);
+        if(iter != mNames[type].end())
+            id = iter->second;
+        else
+            ERR("Capturing unknown GL name %u (type %d)\n", name, type);
+    }
+    write(id);
+}
+
+
+const void *CaptureReader::readData(size_t &size)
+{
+    size = read<DWORD>();
+    if((size_t)(mEnd-mData) < size)
+    {
+        size = 0;
+        mData = mEnd;
+        mOverrun = true;
+        return nullptr;
+    }
+    const void *data = mData;
+    mData += size;
+    return data;
+}
+
+bool CaptureReader::readRecord(CaptureRecord &record, CaptureReader &fields)
+{
+    if((size_t)(mEnd-mData) < sizeof(CaptureRecord))
+        return false;
+    memcpy(&record, mData, sizeof(record));
+    mData += sizeof(record);
+    if((size_t)(mEnd-mData) < record.Size)
+    {
+        mData = mEnd;
+        mOverrun = true;
+        return false;
+    }
+    fields = CaptureReader(mData, record.Size);
+    mData += record.Size;
+    return true;
+}
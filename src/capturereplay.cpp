@@ -0,0 +1,276 @@
+
+#include "capturereplay.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "trace.hpp"
+#include "d3dgl.hpp"
+#include "device.hpp"
+#include "swapchain.hpp"
+#include "bufferobject.hpp"
+
+
+CaptureReplay::CaptureReplay(IDirect3D9 *d3d, HWND window, D3DGLReplayFrameProc proc, void *user)
+  : mD3D(d3d), mWindow(window), mFrameProc(proc), mFrameUser(user)
+  , mDevice(nullptr), mSwapchain(nullptr), mQueue(nullptr), mGLState(nullptr)
+  , mPacket(nullptr), mLastSeq(0)
+  , mTicksPerSec(1), mFrameTicks(0), mFrame(0)
+{
+}
+
+CaptureReplay::~CaptureReplay()
+{
+    deinit();
+}
+
+void CaptureReplay::deinit()
+{
+    if(mQueue)
+        mQueue->waitFor(mLastSeq);
+    for(auto &object : mObjects)
+    {
+        if(object.second.mIface)
+            object.second.mIface->Release();
+    }
+    mObjects.clear();
+
+    if(mSwapchain)
+        mSwapchain->Release();
+    mSwapchain = nullptr;
+    if(mDevice)
+        mDevice->Release();
+    mDevice = nullptr;
+    mQueue = nullptr;
+    mGLState = nullptr;
+}
+
+
+HRESULT CaptureReplay::run(const void *data, SIZE_T size)
+{
+    const char *start = reinterpret_cast<const char*>(data);
+    const char *end = start + size;
+
+    CaptureHeader header;
+    if(size < sizeof(header))
+    {
+        ERR("Capture is too small (%lu bytes)\n", (unsigned long)size);
+        return E_FAIL;
+    }
+    memcpy(&header, start, sizeof(header));
+    if(memcmp(header.Magic, CaptureMagic, sizeof(header.Magic)) != 0 ||
+       header.Version != CaptureVersion)
+    {
+        ERR("Not a version %lu capture\n", (unsigned long)CaptureVersion);
+        return E_FAIL;
+    }
+    if(header.TicksPerSec > 0)
+        mTicksPerSec = header.TicksPerSec;
+
+    // Opcodes are looked up by name, since they change between builds.
+    const char *ptr = start + sizeof(header);
+    mOpcodes.clear();
+    mOpcodes.reserve(header.NumOpcodes);
+    for(DWORD i = 0;i < header.NumOpcodes;++i)
+    {
+        const char *name_end = reinterpret_cast<const char*>(memchr(ptr, '\0', end-ptr));
+        if(!name_end)
+        {
+            ERR("Truncated opcode names\n");
+            return E_FAIL;
+        }
+
+        ULONG opcode = CmdOp_Count;
+        for(ULONG j = 0;j < CmdOp_Count;++j)
+        {
+            if(strcmp(CommandOpNames[j], ptr) == 0)
+            {
+                opcode = j;
+                break;
+            }
+        }
+        if(opcode == CmdOp_Count)
+            WARN("Skipping unknown command %s\n", ptr);
+        mOpcodes.push_back(opcode);
+
+        ptr = name_end+1;
+    }
+    size_t names_end = std::min<size_t>((ptr-start+3) & ~size_t(3), size);
+
+    CaptureReader reader(start+names_end, size-names_end);
+    replayRecords(reader);
+    if(reader.overrun())
+        WARN("Capture ends in a partial record\n");
+    if(!mDevice)
+        WARN("Capture has no device\n");
+
+    deinit();
+    return D3D_OK;
+}
+
+void CaptureReplay::replayRecords(CaptureReader &reader)
+{
+    CaptureRecord record;
+    CaptureReader fields;
+    while(reader.readRecord(record, fields))
+    {
+        mFrameTicks += record.Ticks;
+
+        if(record.Opcode >= mOpcodes.size() || mOpcodes[record.Opcode] >= CmdOp_Count)
+            continue;
+        ULONG opcode = mOpcodes[record.Opcode];
+        if(!mDevice && opcode != CmdOp_InitGLDeviceCmd)
+        {
+            WARN("Skipping %s sent before the device\n", CommandOpNames[opcode]);
+            continue;
+        }
+
+        ReplayCommand(opcode, fields, *this);
+        if(fields.overrun())
+            WARN("Truncated %s record\n", CommandOpNames[opcode]);
+    }
+}
+
+void CaptureReplay::replayPacket(CaptureReader &reader, CommandPacket &packet)
+{
+    CommandPacket *old_packet = mPacket;
+    mPacket = &packet;
+    replayRecords(reader);
+    mPacket = old_packet;
+}
+
+
+bool CaptureReplay::createDevice(D3DPRESENT_PARAMETERS params)
+{
+    if(mDevice)
+    {
+        ERR("Capture creates more than one device\n");
+        return false;
+    }
+
+    // Always present to the replay's window, as fast as possible.
+    params.Windowed = TRUE;
+    params.hDeviceWindow = mWindow;
+    params.FullScreen_RefreshRateInHz = 0;
+    params.PresentationInterval = D3DPRESENT_INTERVAL_IMMEDIATE;
+    if(params.BackBufferWidth && params.BackBufferHeight)
+        SetWindowPos(mWindow, nullptr, 0, 0, params.BackBufferWidth, params.BackBufferHeight,
+                     SWP_NOMOVE | SWP_NOZORDER | SWP_NOACTIVATE);
+
+    IDirect3DDevice9 *device;
+    HRESULT hr = mD3D->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, mWindow,
+        D3DCREATE_HARDWARE_VERTEXPROCESSING | D3DCREATE_MULTITHREADED, &params, &device
+    );
+    if(FAILED(hr))
+    {
+        ERR("Failed to create device: 0x%lx\n", hr);
+        return false;
+    }
+    mDevice = static_cast<D3DGLDevice*>(device);
+
+    IDirect3DSwapChain9 *swapchain;
+    hr = mDevice->GetSwapChain(0, &swapchain);
+    if(FAILED(hr))
+    {
+        ERR("Failed to get swapchain: 0x%lx\n", hr);
+        mDevice->Release();
+        mDevice = nullptr;
+        return false;
+    }
+    mSwapchain = static_cast<D3DGLSwapChain*>(swapchain);
+    mQueue = &mDevice->getQueue();
+    mGLState = &mDevice->getGLState();
+
+    // The device's own buffers stand in for the captured device's.
+    addObject(CaptureId_VSUniformF, nullptr, nullptr, mGLState->vs_uniform_bufferf);
+    addObject(CaptureId_VSUniformI, nullptr, nullptr, mGLState->vs_uniform_bufferi);
+    addObject(CaptureId_VSUniformB, nullptr, nullptr, mGLState->vs_uniform_bufferb);
+    addObject(CaptureId_PSUniformF, nullptr, nullptr, mGLState->ps_uniform_bufferf);
+    addObject(CaptureId_PSUniformI, nullptr, nullptr, mGLState->ps_uniform_bufferi);
+    addObject(CaptureId_PSUniformB, nullptr, nullptr, mGLState->ps_uniform_bufferb);
+    addObject(CaptureId_VtxStateUniform, nullptr, nullptr, mGLState->vtx_state_uniform_buffer);
+    addObject(CaptureId_PosFixupUniform, nullptr, nullptr, mGLState->pos_fixup_uniform_buffer);
+
+    // The device's vertex ring may be mapped, which can't be streamed to, so
+    // the captured ring gets a buffer of its own.
+    IDirect3DVertexBuffer9 *vbuf;
+    hr = mDevice->CreateVertexBuffer(VERTEX_RING_SIZE, D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY, 0,
+                                     D3DPOOL_DEFAULT, &vbuf, nullptr);
+    if(FAILED(hr))
+        ERR("Failed to create vertex ring: 0x%lx\n", hr);
+    else
+    {
+        D3DGLBufferObject *ring = static_cast<D3DGLBufferObject*>(vbuf);
+        addObject(CaptureId_VertexRing, vbuf, ring, ring->getBufferId());
+    }
+
+    return true;
+}
+
+GLuint CaptureReplay::getPipeline() const
+{
+    return mDevice->getShaderPipeline();
+}
+
+
+void CaptureReplay::addObject(ULONG id, IUnknown *iface, void *target, GLuint name)
+{
+    auto iter = mObjects.find(id);
+    if(iter != mObjects.end())
+    {
+        WARN("Replacing object %lu\n", id);
+        if(iter->second.mIface)
+            iter->second.mIface->Release();
+    }
+    mObjects[id] = Object{iface, target, name};
+}
+
+void *CaptureReplay::findObject(ULONG id) const
+{
+    if(id == CaptureId_None)
+        return nullptr;
+    auto iter = mObjects.find(id);
+    if(iter == mObjects.end())
+    {
+        WARN("Unknown object %lu\n", id);
+        return nullptr;
+    }
+    return iter->second.mTarget;
+}
+
+GLuint CaptureReplay::getName(ULONG id) const
+{
+    if(id == CaptureId_None)
+        return 0;
+    auto iter = mObjects.find(id);
+    if(iter == mObjects.end())
+    {
+        WARN("Unknown object %lu\n", id);
+        return 0;
+    }
+    return iter->second.mName;
+}
+
+void CaptureReplay::releaseObject(ULONG id)
+{
+    auto iter = mObjects.find(id);
+    if(id == CaptureId_None || iter == mObjects.end())
+        return;
+
+    // Commands already sent may still refer to it.
+    mQueue->waitFor(mLastSeq);
+    if(iter->second.mIface)
+        iter->second.mIface->Release();
+    mObjects.erase(iter);
+}
+
+
+void CaptureReplay::present(D3DGLRenderTarget *backbuffer)
+{
+    mLastSeq = mSwapchain->present(backbuffer);
+
+    if(mFrameProc)
+        mFrameProc(mFrameUser, mFrame, (ULONGLONG)mFrameTicks * 1000000 / mTicksPerSec);
+    mFrameTicks = 0;
+    ++mFrame;
+}
@@ -1,54 +1,188 @@
 
 #include "commandqueue.hpp"
 
+#include <algorithm>
 #include <exception>
+#include <cstring>
 
 #include "glew.h"
 #include "trace.hpp"
+#include "capture.hpp"
 
 
-static_assert(sizeof(Command) == sizeof(void*), "Command is larger than a pointer!");
+static_assert(sizeof(Command) == sizeof(ULONG), "Command header is too large!");
+static_assert(CmdOp_Count <= D3DGL_QUEUE_STATS_MAX_OPS, "Too many command opcodes!");
 
-static_assert(sizeof(Command) == sizeof(CommandNoOp), "CommandNoOp is too large!");
+
+DWORD QueueSpinCount = 1000;
+DWORD QueueYieldCount = 50;
+DWORD QueueMaxMemory = 64;
+DWORD QueueStats = 0;
+DWORD QueueDirect = 0;
+
+const char *const CommandOpNames[CmdOp_Count] = {
+#define COMMAND_NAME(T) #T,
+    D3DGL_QUEUE_COMMANDS(COMMAND_NAME)
+    D3DGL_COMMANDS(COMMAND_NAME)
+#undef COMMAND_NAME
+};
+
+
+static inline LONGLONG getTicks()
+{
+    LARGE_INTEGER ticks;
+    QueryPerformanceCounter(&ticks);
+    return ticks.QuadPart;
+}
 
 
 class CommandQuitThrd : public Command {
 public:
-    virtual ULONG execute()
+    void execute()
     {
         TRACE("Command thread shutting down\n");
         ExitThread(0);
-        return sizeof(*this);
     }
 };
+DECLARE_COMMAND(CommandQuitThrd)
+DEFINE_COMMAND_EXECUTOR(CommandQuitThrd)
 
+// Stands in for a command that was skipped after being sent. The original
+// command's data is left as it was.
+class CommandSkip : public Command {
+public:
+    void execute() { }
+};
+DECLARE_COMMAND(CommandSkip)
+DEFINE_COMMAND_EXECUTOR(CommandSkip)
 
-ULONG FlushGLCmd::execute()
+
+void FlushGLCmd::execute()
 {
     glFlush();
-    return sizeof(*this);
+}
+DEFINE_COMMAND_EXECUTOR(FlushGLCmd)
+
+
+CommandQueue::Segment::Segment()
+  : mBase(0)
+  , mUsedEnd(~0u)
+  , mNext(nullptr)
+  , mNextFree(nullptr)
+{
+    for(auto &committed : mCommitted)
+        committed.store(0, std::memory_order_relaxed);
+}
+
+// The committed flags are already clear, since the command thread clears each
+// one as it reads the command.
+void CommandQueue::Segment::reset(ULONG base)
+{
+    mUsedEnd.store(~0u, std::memory_order_relaxed);
+    mNext.store(nullptr, std::memory_order_relaxed);
+    mNextFree = nullptr;
+    mBase.store(base, std::memory_order_release);
 }
 
 
 CommandQueue::CommandQueue()
   : mHead(0)
-  , mTail(0)
+  , mProducerSeg(nullptr)
   , mSpinLock(false)
+  , mLockOwner(0)
+  , mWaiters(0)
+  , mConsumerParked(false)
+  , mConsumerParks(0)
+  , mProducerParks(0)
+  , mFreeSegments(nullptr)
+  , mNumSegments(0)
+  , mMaxSegments(std::max<ULONG>(2, QueueMaxMemory << (20-sSegmentBits)))
+  , mConsumerSeg(nullptr)
+  , mExecuted(0)
+  , mSeqWaiters(0)
+  , mSeqPolled(false)
+  , mStatsEnabled(QueueStats >= 1)
+  , mDumpStats(QueueStats >= 2)
+  , mTicksPerSec(1)
+  , mStallTicks(0)
+  , mIdleTicks(0)
+  , mHighWater(0)
   , mThreadHdl(nullptr)
   , mThreadId(0)
+  , mDirect(false)
+  , mDirectTop(0)
+  , mCapture(nullptr)
+  , mDeferred(nullptr)
 {
     InitializeCriticalSection(&mLock);
     InitializeConditionVariable(&mCondVar);
+
+    LARGE_INTEGER freq;
+    if(QueryPerformanceFrequency(&freq))
+        mTicksPerSec = freq.QuadPart;
+    for(auto &count : mOpCounts)
+        count.store(0, std::memory_order_relaxed);
+    for(auto &ticks : mOpTicks)
+        ticks.store(0, std::memory_order_relaxed);
+    memset(&mLastDump, 0, sizeof(mLastDump));
+
+    for(ULONG i = 0;i < sInitialSegments && i < mMaxSegments;++i)
+    {
+        Segment *seg = new Segment();
+        seg->mNextFree = mFreeSegments;
+        mFreeSegments = seg;
+        ++mNumSegments;
+    }
+
+    Segment *seg = mFreeSegments;
+    mFreeSegments = seg->mNextFree;
+    seg->reset(0);
+    mProducerSeg = seg;
+    mConsumerSeg = seg;
 }
 
 CommandQueue::~CommandQueue()
 {
     deinit();
+
+    Segment *seg = mConsumerSeg;
+    while(seg)
+    {
+        Segment *next = seg->mNext.load();
+        delete seg;
+        seg = next;
+    }
+    while((seg=mFreeSegments) != nullptr)
+    {
+        mFreeSegments = seg->mNextFree;
+        delete seg;
+    }
     DeleteCriticalSection(&mLock);
 }
 
-bool CommandQueue::init()
+bool CommandQueue::init(bool direct)
 {
+    if(!QueueCapturePrefix.empty())
+    {
+        static std::atomic<ULONG> capture_count(0);
+        char fname[MAX_PATH];
+        snprintf(fname, sizeof(fname), "%s-%lu-%lu.d3dglcap", QueueCapturePrefix.c_str(),
+                 (unsigned long)GetCurrentProcessId(), (unsigned long)capture_count++);
+        mCapture = new CommandCapture();
+        if(!mCapture->open(fname, mTicksPerSec, CommandOpNames, CmdOp_Count))
+        {
+            delete mCapture;
+            mCapture = nullptr;
+        }
+    }
+
+    if(direct)
+    {
+        TRACE("Executing commands on the calling thread\n");
+        mDirect = true;
+        return true;
+    }
+
     mThreadHdl = CreateThread(nullptr, 1024*1024, thread_func, this, 0, &mThreadId);
     if(!mThreadHdl)
     {
@@ -60,6 +194,7 @@ bool CommandQueue::init()
 
 void CommandQueue::deinit()
 {
+    mDirect = false;
     if(mThreadHdl)
     {
         sendFlush<CommandQuitThrd>();
@@ -71,9 +206,318 @@ void CommandQueue::deinit()
         CloseHandle(mThreadHdl);
         mThreadHdl = nullptr;
         mThreadId = 0;
+
+        TRACE("Command thread parked %lu times, producers parked %lu times, %lu segments allocated\n",
+              mConsumerParks.load(), mProducerParks.load(), mNumSegments);
+    }
+
+    delete mCapture;
+    mCapture = nullptr;
+}
+
+
+
+CommandQueue::Segment *CommandQueue::reserve(size_t size, ULONG &offset)
+{
+    LONGLONG stall_start = 0;
+    DWORD spins = 0;
+    while(1)
+    {
+        Segment *seg = mProducerSeg.load(std::memory_order_acquire);
+        ULONG head = mHead.load(std::memory_order_relaxed);
+
+        // The segment may be a stale one that's since been replaced, or even
+        // recycled. Only a segment whose range covers the current head can be
+        // written to, and the head can't move back into an old range, so a
+        // successful update of the head confirms the segment.
+        // Commands never fill the segment right to the end, so the head only
+        // reaches the end when a producer seals it.
+        offset = head - seg->mBase.load(std::memory_order_acquire);
+        if(offset < sSegmentSize)
+        {
+            if(sSegmentSize-offset > size)
+            {
+                if(mHead.compare_exchange_weak(head, head+size, std::memory_order_relaxed))
+                {
+                    if(stall_start)
+                        addStallTime(stall_start);
+                    return seg;
+                }
+                continue;
+            }
+
+            // Not enough room left. Move the head to the end of the segment
+            // so no one else can use it, and link in a new one.
+            ULONG end = seg->mBase.load(std::memory_order_relaxed) + sSegmentSize;
+            if(mHead.compare_exchange_weak(head, end, std::memory_order_relaxed))
+                linkSegment(seg, head);
+            spins = 0;
+            continue;
+        }
+        if(mProducerSeg.load(std::memory_order_acquire) != seg)
+            continue;
+
+        // Another producer is linking a new segment. Spin for a bit before
+        // going to sleep until it's done.
+        if(mStatsEnabled && !stall_start)
+            stall_start = getTicks();
+        if(spins < QueueSpinCount)
+            YieldProcessor();
+        else if(spins < QueueSpinCount+QueueYieldCount)
+            SwitchToThread();
+        else
+        {
+            EnterCriticalSection(&mLock);
+            ++mWaiters;
+            if(mProducerSeg.load() == seg)
+            {
+                ++mProducerParks;
+                SleepConditionVariableCS(&mCondVar, &mLock, INFINITE);
+            }
+            --mWaiters;
+            LeaveCriticalSection(&mLock);
+            spins = 0;
+        }
+        ++spins;
     }
 }
 
+void CommandQueue::linkSegment(Segment *seg, ULONG used_end)
+{
+    ULONG base = seg->mBase.load(std::memory_order_relaxed) + sSegmentSize;
+
+    EnterCriticalSection(&mLock);
+    LONGLONG stall_start = 0;
+    Segment *next;
+    while(1)
+    {
+        if((next=mFreeSegments) != nullptr)
+        {
+            mFreeSegments = next->mNextFree;
+            break;
+        }
+        if(mNumSegments < mMaxSegments)
+        {
+            next = new Segment();
+            ++mNumSegments;
+            TRACE("Allocated command queue segment %lu\n", mNumSegments);
+            break;
+        }
+
+        // Out of memory for the queue, so wait for the command thread to
+        // finish with a segment. It may be parked waiting for a flush.
+        if(mStatsEnabled && !stall_start)
+            stall_start = getTicks();
+        if(mConsumerParked.load())
+            WakeAllConditionVariable(&mCondVar);
+        ++mWaiters;
+        ++mProducerParks;
+        SleepConditionVariableCS(&mCondVar, &mLock, INFINITE);
+        --mWaiters;
+    }
+    if(stall_start)
+        addStallTime(stall_start);
+    next->reset(base);
+
+    seg->mUsedEnd.store(used_end, std::memory_order_relaxed);
+    seg->mNext.store(next, std::memory_order_release);
+    mProducerSeg.store(next, std::memory_order_release);
+    if(mWaiters.load() > 0)
+        WakeAllConditionVariable(&mCondVar);
+    LeaveCriticalSection(&mLock);
+}
+
+void CommandQueue::releaseSegment(Segment *seg)
+{
+    EnterCriticalSection(&mLock);
+    seg->mNextFree = mFreeSegments;
+    mFreeSegments = seg;
+    if(mWaiters.load() > 0)
+        WakeAllConditionVariable(&mCondVar);
+    LeaveCriticalSection(&mLock);
+}
+
+
+void CommandQueue::waitForCommands(ULONG tail)
+{
+    for(DWORD i = 0;i < QueueSpinCount;++i)
+    {
+        if(tail != mHead.load(std::memory_order_relaxed))
+            return;
+        YieldProcessor();
+    }
+    for(DWORD i = 0;i < QueueYieldCount;++i)
+    {
+        SwitchToThread();
+        if(tail != mHead.load(std::memory_order_relaxed))
+            return;
+    }
+
+    EnterCriticalSection(&mLock);
+    mConsumerParked = true;
+    if(tail == mHead.load())
+    {
+        ++mConsumerParks;
+        do {
+            if(!SleepConditionVariableCS(&mCondVar, &mLock, INFINITE))
+            {
+                ERR("SleepConditionVariableCS failed! Error: %lu\n", GetLastError());
+                break;
+            }
+        } while(tail == mHead.load());
+    }
+    mConsumerParked = false;
+    LeaveCriticalSection(&mLock);
+}
+
+
+void CommandQueue::addStallTime(LONGLONG start)
+{
+    mStallTicks.fetch_add(getTicks() - start, std::memory_order_relaxed);
+}
+
+void CommandQueue::recordCommand(ULONG opcode, LONGLONG start, ULONG tail)
+{
+    if(opcode < CmdOp_Count)
+    {
+        std::atomic<ULONG> &count = mOpCounts[opcode];
+        std::atomic<ULONGLONG> &ticks = mOpTicks[opcode];
+        count.store(count.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+        ticks.store(ticks.load(std::memory_order_relaxed) + (getTicks()-start),
+                    std::memory_order_relaxed);
+    }
+
+    ULONG pending = mHead.load(std::memory_order_relaxed) - tail;
+    if(pending > mHighWater.load(std::memory_order_relaxed))
+        mHighWater.store(pending, std::memory_order_relaxed);
+}
+
+void CommandQueue::getStats(D3DGLQueueStats &stats)
+{
+    auto to_us = [this](ULONGLONG ticks) -> ULONGLONG
+    { return ticks * 1000000 / mTicksPerSec; };
+
+    stats.Size = sizeof(stats);
+    stats.Version = D3DGL_QUEUE_STATS_VERSION;
+    stats.NumOpcodes = CmdOp_Count;
+    stats.ProducerStallTime = to_us(mStallTicks.load(std::memory_order_relaxed));
+    stats.ConsumerIdleTime = to_us(mIdleTicks.load(std::memory_order_relaxed));
+    stats.HighWaterBytes = mHighWater.load(std::memory_order_relaxed);
+    stats.NumSegments = getSegmentCount();
+    for(ULONG i = 0;i < CmdOp_Count;++i)
+    {
+        stats.OpCount[i] = mOpCounts[i].load(std::memory_order_relaxed);
+        stats.OpTime[i] = to_us(mOpTicks[i].load(std::memory_order_relaxed));
+    }
+    for(ULONG i = CmdOp_Count;i < D3DGL_QUEUE_STATS_MAX_OPS;++i)
+    {
+        stats.OpCount[i] = 0;
+        stats.OpTime[i] = 0;
+    }
+}
+
+void CommandQueue::doDumpStats()
+{
+    D3DGLQueueStats stats;
+    getStats(stats);
+
+    log_printf(LogFile, "Command queue: stalled %lu us, idle %lu us, high-water %lu bytes, %lu segments\n",
+        (unsigned long)(stats.ProducerStallTime - mLastDump.ProducerStallTime),
+        (unsigned long)(stats.ConsumerIdleTime - mLastDump.ConsumerIdleTime),
+        (unsigned long)stats.HighWaterBytes, (unsigned long)stats.NumSegments);
+    for(ULONG i = 0;i < CmdOp_Count;++i)
+    {
+        DWORD count = stats.OpCount[i] - mLastDump.OpCount[i];
+        if(count > 0)
+            log_printf(LogFile, "  %s: %lu, %lu us\n", CommandOpNames[i], (unsigned long)count,
+                       (unsigned long)(stats.OpTime[i] - mLastDump.OpTime[i]));
+    }
+
+    mLastDump = stats;
+}
+
+
+void CommandQueue::doWaitFor(ULONG seq)
+{
+    // Have the command thread publish its progress after every command
+    // while we wait, and make sure it isn't parked before the command it
+    // needs to run.
+    ++mSeqWaiters;
+    wake();
+    for(DWORD i = 0;i < QueueSpinCount;++i)
+    {
+        if(checkExecuted(seq))
+            goto done;
+        YieldProcessor();
+    }
+    for(DWORD i = 0;i < QueueYieldCount;++i)
+    {
+        SwitchToThread();
+        if(checkExecuted(seq))
+            goto done;
+    }
+
+    // The command thread wakes everyone sleeping on the condition variable
+    // after each command while there are waiters.
+    EnterCriticalSection(&mLock);
+    ++mWaiters;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while(!checkExecuted(seq))
+    {
+        if(mConsumerParked.load())
+            WakeAllConditionVariable(&mCondVar);
+        SleepConditionVariableCS(&mCondVar, &mLock, INFINITE);
+    }
+    --mWaiters;
+    LeaveCriticalSection(&mLock);
+
+done:
+    --mSeqWaiters;
+}
+
+// Executes a command, timing it when statistics need it. Returns the time it
+// started.
+inline LONGLONG CommandQueue::dispatch(Command *cmd, ULONG opcode)
+{
+    LONGLONG start = mStatsEnabled ? getTicks() : 0;
+    switch(opcode)
+    {
+#define QUEUE_COMMAND_CASE(T) case CmdOp_##T: execute_##T(cmd); break;
+        D3DGL_QUEUE_COMMANDS(QUEUE_COMMAND_CASE)
+#undef QUEUE_COMMAND_CASE
+        default:
+            // Commands sent while another one executes in direct mode come
+            // from replaying that one, so only the outer one is captured.
+            if(mCapture && !mCapture->isRecording())
+                CaptureCommand(cmd, *mCapture);
+            else
+                ExecuteCommand(cmd);
+            break;
+    }
+    return start;
+}
+
+void CommandQueue::executeDirect(Command *cmd)
+{
+    TRACE("Executing %p (opcode %u)\n", cmd, cmd->mOpcode);
+
+    ULONG size = cmd->mSize;
+    ULONG opcode = cmd->mOpcode;
+    LONGLONG start = dispatch(cmd, opcode);
+    mDirectTop -= size;
+    if(mStatsEnabled)
+        recordCommand(opcode, start, mHead.load(std::memory_order_relaxed));
+}
+
+void CommandQueue::wakeWaiters()
+{
+    if(mWaiters.load() > 0)
+    {
+        EnterCriticalSection(&mLock);
+        WakeAllConditionVariable(&mCondVar);
+        LeaveCriticalSection(&mLock);
+    }
+}
 
 
 DWORD CommandQueue::run(void)
@@ -81,40 +525,86 @@ DWORD CommandQueue::run(void)
     SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
 
     TRACE("Starting command thread\n");
-restart_loop:
+    Segment *seg = mConsumerSeg;
+    ULONG tail = seg->mBase.load(std::memory_order_relaxed);
+    ULONG published = tail;
     while(1)
     {
-        ULONG tail = mTail.load();
-        if(tail == mHead)
+        if(tail == mHead.load())
         {
-            EnterCriticalSection(&mLock);
-            WakeAllConditionVariable(&mCondVar);
-            while(tail == mHead)
+            // Out of commands, so publish how far we got before waiting.
+            if(published != tail)
             {
-                if(!SleepConditionVariableCS(&mCondVar, &mLock, INFINITE))
-                {
-                    ERR("SleepConditionVariableCS failed! Error: %lu\n", GetLastError());
-                    LeaveCriticalSection(&mLock);
-                    goto restart_loop;
-                }
+                publishExecuted(tail);
+                published = tail;
+                wakeWaiters();
             }
-            LeaveCriticalSection(&mLock);
+            if(mStatsEnabled)
+            {
+                LONGLONG start = getTicks();
+                waitForCommands(tail);
+                mIdleTicks.store(mIdleTicks.load(std::memory_order_relaxed) + (getTicks()-start),
+                                 std::memory_order_relaxed);
+            }
+            else
+                waitForCommands(tail);
+            continue;
         }
 
-        Command *cmd = reinterpret_cast<Command*>(&mQueueData[tail]);
-        TRACE("Executing %p\n", cmd);
+        // Move to the next segment once this one is sealed and everything
+        // in it has been executed.
+        if(Segment *next = seg->mNext.load(std::memory_order_acquire))
+        {
+            if(tail == seg->mUsedEnd.load(std::memory_order_relaxed))
+            {
+                mConsumerSeg = next;
+                releaseSegment(seg);
+                seg = next;
+                tail = seg->mBase.load(std::memory_order_relaxed);
+                continue;
+            }
+        }
 
-        ULONG size = cmd->execute();
-        if(size < sizeof(Command))
+        // The space may be reserved by a producer that hasn't finished
+        // writing the command yet, or the rest of the segment may be unused
+        // and waiting for the next segment to be linked.
+        ULONG offset = tail - seg->mBase.load(std::memory_order_relaxed);
+        if(offset >= sSegmentSize)
         {
-            ERR("Command returned too small size (%lu < %u)\n", size, sizeof(Command));
-            std::terminate();
+            SwitchToThread();
+            continue;
+        }
+        std::atomic<unsigned short> &committed = seg->mCommitted[offset/sSlotSize];
+        if(!(committed.load(std::memory_order_relaxed)&SlotStateMask))
+        {
+            SwitchToThread();
+            continue;
         }
-        cmd->~Command();
+        // Clearing the slot is what decides a skip race, so a producer's
+        // skip only succeeds if the command hasn't been taken yet.
+        unsigned short state = committed.exchange(0, std::memory_order_acquire);
 
+        Command *cmd = reinterpret_cast<Command*>(&seg->mData[offset]);
+        if((state&SlotStateMask) == SlotSkipped)
+            cmd->mOpcode = CmdOp_CommandSkip;
+        TRACE("Executing %p (opcode %u)\n", cmd, cmd->mOpcode);
+
+        // The command is destroyed after executing, so get its size first.
+        ULONG size = cmd->mSize;
+        ULONG opcode = cmd->mOpcode;
+        LONGLONG start = dispatch(cmd, opcode);
         tail += size;
-        mTail.store(tail&sQueueMask);
-        WakeAllConditionVariable(&mCondVar);
+        if(mSeqWaiters.load(std::memory_order_relaxed) > 0 ||
+           mSeqPolled.load(std::memory_order_relaxed))
+        {
+            mSeqPolled.store(false, std::memory_order_relaxed);
+            publishExecuted(tail);
+            published = tail;
+        }
+        if(mStatsEnabled)
+            recordCommand(opcode, start, tail);
+
+        wakeWaiters();
     }
     ERR("Command thread loop broken\n");
 
@@ -0,0 +1,69 @@
+#include "commandqueue.hpp"
+
+#include <exception>
+
+#include "trace.hpp"
+
+
+// Executors are defined alongside each command with DEFINE_COMMAND, along
+// with the functions to capture and replay it.
+#define DECLARE_EXECUTOR(T)                                                   \
+void execute_##T(Command *cmd);                                               \
+void capture_##T(Command *cmd, CommandCapture &capture);                      \
+void capture_packed_##T(const Command *cmd, CommandCapture &capture);         \
+void replay_##T(CaptureReader &reader, CaptureReplay &replay);
+D3DGL_COMMANDS(DECLARE_EXECUTOR)
+#undef DECLARE_EXECUTOR
+
+
+void ExecuteCommand(Command *cmd)
+{
+    switch(cmd->mOpcode)
+    {
+#define COMMAND_CASE(T) case CmdOp_##T: execute_##T(cmd); break;
+        D3DGL_COMMANDS(COMMAND_CASE)
+#undef COMMAND_CASE
+        default:
+            ERR("Unhandled command opcode: %u\n", cmd->mOpcode);
+            std::terminate();
+    }
+}
+
+void CaptureCommand(Command *cmd, CommandCapture &capture)
+{
+    switch(cmd->mOpcode)
+    {
+#define COMMAND_CASE(T) case CmdOp_##T: capture_##T(cmd, capture); break;
+        D3DGL_COMMANDS(COMMAND_CASE)
+#undef COMMAND_CASE
+        default:
+            ERR("Unhandled command opcode: %u\n", cmd->mOpcode);
+            std::terminate();
+    }
+}
+
+void CapturePackedCommand(const Command *cmd, CommandCapture &capture)
+{
+    switch(cmd->mOpcode)
+    {
+#define COMMAND_CASE(T) case CmdOp_##T: capture_packed_##T(cmd, capture); break;
+        D3DGL_COMMANDS(COMMAND_CASE)
+#undef COMMAND_CASE
+        default:
+            ERR("Unhandled command opcode: %u\n", cmd->mOpcode);
+            std::terminate();
+    }
+}
+
+void ReplayCommand(ULONG opcode, CaptureReader &reader, CaptureReplay &replay)
+{
+    switch(opcode)
+    {
+#define COMMAND_CASE(T) case CmdOp_##T: replay_##T(reader, replay); break;
+        D3DGL_COMMANDS(COMMAND_CASE)
+#undef COMMAND_CASE
+        default:
+            ERR("Unhandled captured opcode: %lu\n", opcode);
+            break;
+    }
+}
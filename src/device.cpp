@@ -3,6 +3,7 @@
 
 #include <array>
 #include <sstream>
+#include <cstring>
 #include <d3d9.h>
 
 #include "glew.h"
@@ -22,6 +23,9 @@
 #include "pixelshader.hpp"
 #include "vertexdeclaration.hpp"
 #include "query.hpp"
+#include "stateblock.hpp"
+#include "capture.hpp"
+#include "capturereplay.hpp"
 #include "private_iids.hpp"
 
 
@@ -239,7 +243,6 @@ static const std::map<D3DRENDERSTATETYPE,GLenum> RSStateEnableMap{
     {D3DRS_FOGENABLE,            GL_FOG},
     {D3DRS_COLORVERTEX,          GL_COLOR_MATERIAL},
     {D3DRS_NORMALIZENORMALS,     GL_NORMALIZE},
-    {D3DRS_SCISSORTESTENABLE,    GL_SCISSOR_TEST},
     {D3DRS_STENCILENABLE,        GL_STENCIL_TEST},
     {D3DRS_ALPHATESTENABLE,      GL_ALPHA_TEST},
     {D3DRS_ALPHABLENDENABLE,     GL_BLEND},
@@ -252,6 +255,71 @@ static const std::map<D3DRENDERSTATETYPE,GLenum> RSStateEnableMap{
     {D3DRS_ZENABLE,              GL_DEPTH_TEST}
 };
 
+// The render states with an entry in each state group, in the order they're
+// applied. Other render states that feed into an entry's GL state are
+// aliased to it in RSGroupEntries.
+static const std::array<std::vector<D3DRENDERSTATETYPE>,StateGroup_Viewport> RSGroupStates{{
+    { // StateGroup_Blend
+        D3DRS_ALPHABLENDENABLE, D3DRS_SRCBLEND, D3DRS_BLENDOP,
+        D3DRS_COLORWRITEENABLE, D3DRS_COLORWRITEENABLE1, D3DRS_COLORWRITEENABLE2,
+        D3DRS_COLORWRITEENABLE3, D3DRS_ALPHATESTENABLE, D3DRS_ALPHAFUNC,
+        D3DRS_SRGBWRITEENABLE, D3DRS_DITHERENABLE
+    },
+    { // StateGroup_DepthStencil
+        D3DRS_ZENABLE, D3DRS_ZWRITEENABLE, D3DRS_ZFUNC, D3DRS_DEPTHBIAS,
+        D3DRS_STENCILENABLE, D3DRS_STENCILFUNC, D3DRS_STENCILFAIL,
+        D3DRS_STENCILWRITEMASK, D3DRS_CCW_STENCILFUNC, D3DRS_CCW_STENCILFAIL
+    },
+    { // StateGroup_Raster
+        D3DRS_FILLMODE, D3DRS_CULLMODE, D3DRS_SCISSORTESTENABLE,
+        D3DRS_MULTISAMPLEANTIALIAS, D3DRS_POINTSPRITEENABLE, D3DRS_CLIPPLANEENABLE,
+        D3DRS_FOGENABLE, D3DRS_FOGCOLOR, D3DRS_LIGHTING, D3DRS_COLORVERTEX,
+        D3DRS_NORMALIZENORMALS
+    }
+}};
+
+// The state group and entries each render state dirties. The mask is 0 for
+// render states without any GL state.
+struct RSGroupEntry {
+    UINT mGroup;
+    DWORD mMask;
+};
+std::array<RSGroupEntry,210> GenerateRSGroupEntries()
+{
+    std::array<RSGroupEntry,210> ret;
+    for(auto &entry : ret)
+        entry = RSGroupEntry{StateGroup_Count, 0};
+    for(UINT group = 0;group < RSGroupStates.size();++group)
+    {
+        for(size_t i = 0;i < RSGroupStates[group].size();++i)
+            ret[RSGroupStates[group][i]] = RSGroupEntry{group, 1u<<i};
+    }
+
+    auto alias = [&ret](D3DRENDERSTATETYPE state, D3DRENDERSTATETYPE target)
+    {
+        ret[state].mGroup = ret[target].mGroup;
+        ret[state].mMask |= ret[target].mMask;
+    };
+    alias(D3DRS_DESTBLEND, D3DRS_SRCBLEND);
+    alias(D3DRS_ALPHAREF, D3DRS_ALPHAFUNC);
+    alias(D3DRS_SLOPESCALEDEPTHBIAS, D3DRS_DEPTHBIAS);
+    alias(D3DRS_STENCILREF, D3DRS_STENCILFUNC);
+    alias(D3DRS_STENCILREF, D3DRS_CCW_STENCILFUNC);
+    alias(D3DRS_STENCILMASK, D3DRS_STENCILFUNC);
+    alias(D3DRS_STENCILMASK, D3DRS_CCW_STENCILFUNC);
+    alias(D3DRS_STENCILZFAIL, D3DRS_STENCILFAIL);
+    alias(D3DRS_STENCILPASS, D3DRS_STENCILFAIL);
+    alias(D3DRS_CCW_STENCILZFAIL, D3DRS_CCW_STENCILFAIL);
+    alias(D3DRS_CCW_STENCILPASS, D3DRS_CCW_STENCILFAIL);
+    // Two-sided stencil changes which faces the stencil state applies to.
+    alias(D3DRS_TWOSIDEDSTENCILMODE, D3DRS_STENCILFUNC);
+    alias(D3DRS_TWOSIDEDSTENCILMODE, D3DRS_STENCILFAIL);
+    alias(D3DRS_TWOSIDEDSTENCILMODE, D3DRS_CCW_STENCILFUNC);
+    alias(D3DRS_TWOSIDEDSTENCILMODE, D3DRS_CCW_STENCILFAIL);
+    return ret;
+}
+static const std::array<RSGroupEntry,210> RSGroupEntries = GenerateRSGroupEntries();
+
 
 GLenum GetGLBlendFunc(DWORD mode)
 {
@@ -421,13 +489,24 @@ class StateEnable : public Command {
 public:
     StateEnable(GLenum state, bool enable) : mState(state), mEnable(enable) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         if(mEnable)
             glEnable(mState);
         else
             glDisable(mState);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mState);
+        capture.write(mEnable);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum state = reader.read<GLenum>();
+        bool enable = reader.read<bool>();
+        replay.sendState<StateEnable>(state, enable);
     }
 };
 
@@ -447,14 +526,32 @@ public:
       , mEmission{material.Emissive.r, material.Emissive.g, material.Emissive.b, material.Emissive.a}
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, mShininess);
         glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mDiffuse);
         glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, mAmbient);
         glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mSpecular);
         glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, mEmission);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mShininess);
+        capture.write(mDiffuse);
+        capture.write(mAmbient);
+        capture.write(mSpecular);
+        capture.write(mEmission);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        D3DMATERIAL9 material;
+        material.Power = reader.read<float>();
+        material.Diffuse = reader.read<D3DCOLORVALUE>();
+        material.Ambient = reader.read<D3DCOLORVALUE>();
+        material.Specular = reader.read<D3DCOLORVALUE>();
+        material.Emissive = reader.read<D3DCOLORVALUE>();
+        replay.sendState<MaterialSet>(make_ref(material));
     }
 };
 
@@ -468,24 +565,88 @@ public:
       : mX(x), mY(y), mWidth(width), mHeight(height), mMinZ(minz), mMaxZ(maxz)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glViewport(mX, mY, mWidth, mHeight);
         glDepthRange(mMinZ, mMaxZ);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mX);
+        capture.write(mY);
+        capture.write(mWidth);
+        capture.write(mHeight);
+        capture.write(mMinZ);
+        capture.write(mMaxZ);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLint x = reader.read<GLint>();
+        GLint y = reader.read<GLint>();
+        GLsizei width = reader.read<GLsizei>();
+        GLsizei height = reader.read<GLsizei>();
+        GLfloat minz = reader.read<GLfloat>();
+        GLfloat maxz = reader.read<GLfloat>();
+        replay.sendState<ViewportSet>(x, y, width, height, minz, maxz);
     }
 };
 
+// Sets the scissor rect, if it isn't already.
+void ScissorRectGL(GLState &glstate, const RECT &rect)
+{
+    if(memcmp(&glstate.scissor_rect, &rect, sizeof(rect)) == 0)
+        return;
+    glstate.scissor_rect = rect;
+    glScissor(rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top);
+}
+
 class ScissorRectSet : public Command {
+    GLState &mGLState;
     RECT mRect;
 
 public:
-    ScissorRectSet(const RECT &rect) : mRect(rect) { }
+    ScissorRectSet(GLState &glstate, const RECT &rect) : mGLState(glstate), mRect(rect) { }
+
+    void execute()
+    {
+        ScissorRectGL(mGLState, mRect);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mRect);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        RECT rect = reader.read<RECT>();
+        replay.sendState<ScissorRectSet>(make_ref(replay.getGLState()), make_ref(rect));
+    }
+};
+
+class ScissorTestSet : public Command {
+    GLState &mGLState;
+    bool mEnable;
+
+public:
+    ScissorTestSet(GLState &glstate, bool enable) : mGLState(glstate), mEnable(enable) { }
+
+    void execute()
+    {
+        mGLState.scissor_test = mEnable;
+        if(mEnable)
+            glEnable(GL_SCISSOR_TEST);
+        else
+            glDisable(GL_SCISSOR_TEST);
+    }
 
-    virtual ULONG execute()
+    void capture(CommandCapture &capture) const
     {
-        glScissor(mRect.left, mRect.top, mRect.right-mRect.left, mRect.bottom-mRect.top);
-        return sizeof(*this);
+        capture.write(mEnable);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.sendState<ScissorTestSet>(make_ref(replay.getGLState()), reader.read<bool>());
     }
 };
 
@@ -495,10 +656,18 @@ class PolygonModeSet : public Command {
 public:
     PolygonModeSet(GLenum mode) : mMode(mode) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glPolygonMode(GL_FRONT_AND_BACK, mMode);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mMode);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.sendState<PolygonModeSet>(reader.read<GLenum>());
     }
 };
 
@@ -508,7 +677,7 @@ class CullFaceSet : public Command {
 public:
     CullFaceSet(GLenum face) : mFace(face) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         if(!mFace)
             glDisable(GL_CULL_FACE);
@@ -517,37 +686,73 @@ public:
             glEnable(GL_CULL_FACE);
             glCullFace(mFace);
         }
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mFace);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.sendState<CullFaceSet>(reader.read<GLenum>());
     }
 };
 
+void ColorMaskGL(GLState &glstate, UINT index, UINT enable)
+{
+    glstate.color_write_masks[index] = enable;
+    glColorMaski(index,
+        !!(enable&D3DCOLORWRITEENABLE_RED), !!(enable&D3DCOLORWRITEENABLE_GREEN),
+        !!(enable&D3DCOLORWRITEENABLE_BLUE), !!(enable&D3DCOLORWRITEENABLE_ALPHA)
+    );
+}
+
 class ColorMaskSet : public Command {
+    GLState &mGLState;
     UINT mIndex;
     UINT mEnable;
 
 public:
-    ColorMaskSet(UINT index, UINT enable) : mIndex(index), mEnable(enable) { }
+    ColorMaskSet(GLState &glstate, UINT index, UINT enable) : mGLState(glstate), mIndex(index), mEnable(enable) { }
 
-    virtual ULONG execute()
+    void execute()
     {
-        glColorMaski(mIndex,
-            !!(mEnable&D3DCOLORWRITEENABLE_RED), !!(mEnable&D3DCOLORWRITEENABLE_GREEN),
-            !!(mEnable&D3DCOLORWRITEENABLE_BLUE), !!(mEnable&D3DCOLORWRITEENABLE_ALPHA)
-        );
-        return sizeof(*this);
+        ColorMaskGL(mGLState, mIndex, mEnable);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mIndex);
+        capture.write(mEnable);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        UINT index = reader.read<UINT>();
+        UINT enable = reader.read<UINT>();
+        replay.sendState<ColorMaskSet>(make_ref(replay.getGLState()), index, enable);
     }
 };
 
 class DepthMaskSet : public Command {
+    GLState &mGLState;
     bool mEnable;
 
 public:
-    DepthMaskSet(bool enable) : mEnable(enable) { }
+    DepthMaskSet(GLState &glstate, bool enable) : mGLState(glstate), mEnable(enable) { }
 
-    virtual ULONG execute()
+    void execute()
     {
+        mGLState.depth_write_mask = mEnable;
         glDepthMask(mEnable);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mEnable);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.sendState<DepthMaskSet>(make_ref(replay.getGLState()), reader.read<bool>());
     }
 };
 
@@ -557,10 +762,18 @@ class DepthFuncSet : public Command {
 public:
     DepthFuncSet(GLenum func) : mFunc(func) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glDepthFunc(mFunc);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mFunc);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.sendState<DepthFuncSet>(reader.read<GLenum>());
     }
 };
 
@@ -571,10 +784,21 @@ class AlphaFuncSet : public Command {
 public:
     AlphaFuncSet(GLenum func, GLclampf ref) : mFunc(func), mRef(ref) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glAlphaFunc(mFunc, std::min(std::max(mRef, 0.0f), 1.0f));
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mFunc);
+        capture.write(mRef);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum func = reader.read<GLenum>();
+        GLclampf ref = reader.read<GLclampf>();
+        replay.sendState<AlphaFuncSet>(func, ref);
     }
 };
 
@@ -584,10 +808,21 @@ class BlendFuncSet : public Command {
 public:
     BlendFuncSet(GLenum src, GLenum dst) : mSrc(src), mDst(dst) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glBlendFunc(mSrc, mDst);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mSrc);
+        capture.write(mDst);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum src = reader.read<GLenum>();
+        GLenum dst = reader.read<GLenum>();
+        replay.sendState<BlendFuncSet>(src, dst);
     }
 };
 
@@ -600,10 +835,25 @@ class StencilFuncSet : public Command {
 public:
     StencilFuncSet(GLenum face, GLenum func, GLuint ref, GLuint mask) : mFace(face), mFunc(func), mRef(ref), mMask(mask) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glStencilFuncSeparate(mFace, mFunc, mRef, mMask);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mFace);
+        capture.write(mFunc);
+        capture.write(mRef);
+        capture.write(mMask);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum face = reader.read<GLenum>();
+        GLenum func = reader.read<GLenum>();
+        GLuint ref = reader.read<GLuint>();
+        GLuint mask = reader.read<GLuint>();
+        replay.sendState<StencilFuncSet>(face, func, ref, mask);
     }
 };
 
@@ -614,10 +864,19 @@ class BlendOpSet : public Command {
 public:
     BlendOpSet(GLenum op) : mColorOp(op), mAlphaOp(op) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glBlendEquationSeparate(mColorOp, mAlphaOp);
-        return sizeof(*this);
+    }
+
+    // Both ops are always the same.
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mColorOp);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.sendState<BlendOpSet>(reader.read<GLenum>());
     }
 };
 
@@ -632,23 +891,48 @@ public:
       : mFace(face), mFail(fail), mZFail(zfail), mZPass(zpass)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glStencilOpSeparate(mFace, mFail, mZFail, mZPass);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mFace);
+        capture.write(mFail);
+        capture.write(mZFail);
+        capture.write(mZPass);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum face = reader.read<GLenum>();
+        GLenum fail = reader.read<GLenum>();
+        GLenum zfail = reader.read<GLenum>();
+        GLenum zpass = reader.read<GLenum>();
+        replay.sendState<StencilOpSet>(face, fail, zfail, zpass);
     }
 };
 
 class StencilMaskSet : public Command {
+    GLState &mGLState;
     GLuint mMask;
 
 public:
-    StencilMaskSet(GLuint mask) : mMask(mask) { }
+    StencilMaskSet(GLState &glstate, GLuint mask) : mGLState(glstate), mMask(mask) { }
 
-    virtual ULONG execute()
+    void execute()
     {
+        mGLState.stencil_write_mask = mMask;
         glStencilMask(mMask);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mMask);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.sendState<StencilMaskSet>(make_ref(replay.getGLState()), reader.read<GLuint>());
     }
 };
 
@@ -659,7 +943,7 @@ class DepthBiasSet : public Command {
 public:
     DepthBiasSet(GLfloat scale, GLfloat bias) : mScale(scale), mBias(bias) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         if(mScale == 0.0f && mBias == 0.0f)
             glDisable(GL_POLYGON_OFFSET_FILL);
@@ -668,7 +952,18 @@ public:
             glEnable(GL_POLYGON_OFFSET_FILL);
             glPolygonOffset(mScale, mBias);
         }
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mScale);
+        capture.write(mBias);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLfloat scale = reader.read<GLfloat>();
+        GLfloat bias = reader.read<GLfloat>();
+        replay.sendState<DepthBiasSet>(scale, bias);
     }
 };
 
@@ -680,97 +975,236 @@ public:
     FogValuefSet(GLenum param, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3) : mParam(param), mValues{v0, v1, v2, v3} { }
     FogValuefSet(GLenum param, GLfloat v0) : mParam(param), mValues{v0, v0, v0, v0} { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glFogfv(mParam, mValues);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mParam);
+        capture.write(mValues);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum param = reader.read<GLenum>();
+        GLfloat v0 = reader.read<GLfloat>();
+        GLfloat v1 = reader.read<GLfloat>();
+        GLfloat v2 = reader.read<GLfloat>();
+        GLfloat v3 = reader.read<GLfloat>();
+        replay.sendState<FogValuefSet>(param, v0, v1, v2, v3);
     }
 };
 
-class SetSamplerParameteri : public Command {
-    GLuint mSampler;
-    GLenum mParameter;
-    GLint mValue;
+class InitSamplerCmd : public Command {
+    GLState &mGLState;
+    UINT mSlot;
+    SamplerKey mKey;
 
 public:
-    SetSamplerParameteri(GLuint sampler, GLenum parameter, GLint value)
-      : mSampler(sampler), mParameter(parameter), mValue(value)
+    InitSamplerCmd(GLState &glstate, UINT slot, const SamplerKey &key)
+      : mGLState(glstate), mSlot(slot), mKey(key)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
-        if(mParameter != GL_TEXTURE_MAX_ANISOTROPY_EXT ||
-           (mParameter == GL_TEXTURE_MAX_ANISOTROPY_EXT && GLEW_EXT_texture_filter_anisotropic))
-        {
-            glSamplerParameteri(mSampler, mParameter, mValue);
-            checkGLError();
-        }
-        return sizeof(*this);
+        GLuint &sampler = mGLState.sampler_objects[mSlot];
+        if(!sampler)
+            glGenSamplers(1, &sampler);
+
+        const auto &ss = mKey.mStates;
+        DWORD color = ss[D3DSAMP_BORDERCOLOR];
+        GLfloat border[4]{
+            D3DCOLOR_R(color)/255.0f, D3DCOLOR_G(color)/255.0f,
+            D3DCOLOR_B(color)/255.0f, D3DCOLOR_A(color)/255.0f
+        };
+        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, GetGLWrapMode(ss[D3DSAMP_ADDRESSU]));
+        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, GetGLWrapMode(ss[D3DSAMP_ADDRESSV]));
+        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_R, GetGLWrapMode(ss[D3DSAMP_ADDRESSW]));
+        glSamplerParameterfv(sampler, GL_TEXTURE_BORDER_COLOR, border);
+        glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER,
+                            GetGLFilterMode(ss[D3DSAMP_MAGFILTER], D3DTEXF_NONE));
+        glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER,
+                            GetGLFilterMode(ss[D3DSAMP_MINFILTER], ss[D3DSAMP_MIPFILTER]));
+        glSamplerParameterf(sampler, GL_TEXTURE_LOD_BIAS, dword_to_float(ss[D3DSAMP_MIPMAPLODBIAS]));
+        // D3D's max mip level is the largest mipmap used.
+        glSamplerParameterf(sampler, GL_TEXTURE_MIN_LOD, (GLfloat)ss[D3DSAMP_MAXMIPLEVEL]);
+        if(GLEW_EXT_texture_filter_anisotropic)
+            glSamplerParameteri(sampler, GL_TEXTURE_MAX_ANISOTROPY_EXT,
+                                std::max<DWORD>(ss[D3DSAMP_MAXANISOTROPY], 1));
+        glSamplerParameteri(sampler, GL_TEXTURE_SRGB_DECODE_EXT,
+                            ss[D3DSAMP_SRGBTEXTURE] ? GL_DECODE_EXT : GL_SKIP_DECODE_EXT);
+        glSamplerParameteri(sampler, GL_TEXTURE_COMPARE_MODE,
+                            mKey.mShadow ? GL_COMPARE_REF_TO_TEXTURE : GL_NONE);
+        checkGLError();
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mSlot);
+        capture.write(mKey.mStates);
+        capture.write(mKey.mShadow);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        UINT slot = reader.read<UINT>();
+        SamplerKey key;
+        key.mStates = reader.read<decltype(key.mStates)>();
+        key.mShadow = reader.read<bool>();
+        replay.sendState<InitSamplerCmd>(make_ref(replay.getGLState()), slot, make_ref(key));
     }
 };
-class SetSamplerParameter4f : public Command {
-    GLuint mSampler;
-    GLenum mParameter;
-    GLfloat mValues[4];
+
+class BindSamplerCmd : public Command {
+    GLState &mGLState;
+    UINT mStage;
+    UINT mSlot;
 
 public:
-    SetSamplerParameter4f(GLuint sampler, GLenum parameter, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3)
-      : mSampler(sampler), mParameter(parameter), mValues{v0,v1,v2,v3}
+    BindSamplerCmd(GLState &glstate, UINT stage, UINT slot)
+      : mGLState(glstate), mStage(stage), mSlot(slot)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
-        glSamplerParameterfv(mSampler, mParameter, mValues);
+        glBindSampler(mStage, mGLState.sampler_objects[mSlot]);
         checkGLError();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mStage);
+        capture.write(mSlot);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        UINT stage = reader.read<UINT>();
+        UINT slot = reader.read<UINT>();
+        replay.sendState<BindSamplerCmd>(make_ref(replay.getGLState()), stage, slot);
     }
 };
 
-template<size_t MAXCOUNT>
+// The vectors are stored inline after the command, so it must be sent with
+// doSendPayload.
 class SetBufferValue4fv : public Command {
     GLuint mBuffer;
     GLintptr mOffset;
     GLsizeiptr mSize;
-    union {
-        char mData[MAXCOUNT*4*4];
-        float mVec4fs[MAXCOUNT][4];
-    };
+
+    GLubyte *getData() { return reinterpret_cast<GLubyte*>(this+1); }
+    const GLubyte *getData() const { return reinterpret_cast<const GLubyte*>(this+1); }
 
 public:
-    SetBufferValue4fv(GLuint buffer, GLintptr offset, const float *data, GLsizeiptr count=MAXCOUNT)
-      : mBuffer(buffer), mOffset(offset)
+    SetBufferValue4fv(GLuint buffer, GLintptr offset, const float *data, GLsizeiptr count)
+      : mBuffer(buffer), mOffset(offset), mSize(count * 4 * sizeof(float))
+    { memcpy(getData(), data, mSize); }
+
+    void execute()
     {
-        mSize = count * 4 * 4;
-        for(GLsizeiptr i = 0;i < count;++i)
-        {
-            mVec4fs[i][0] = *(data++);
-            mVec4fs[i][1] = *(data++);
-            mVec4fs[i][2] = *(data++);
-            mVec4fs[i][3] = *(data++);
-        }
+        glNamedBufferSubDataEXT(mBuffer, mOffset, mSize, getData());
+        checkGLError();
+    }
+
+    static size_t getPayloadSize(GLsizeiptr count) { return count * 4 * sizeof(float); }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Buffer, mBuffer);
+        capture.write<LONGLONG>(mOffset);
+        capture.writeData(getData(), mSize);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        ULONG id = reader.read<ULONG>();
+        LONGLONG offset = reader.read<LONGLONG>();
+        size_t size;
+        const float *data = reinterpret_cast<const float*>(reader.readData(size));
+        if(data)
+            replay.sendPayload<SetBufferValue4fv>(size, replay.getName(id), (GLintptr)offset,
+                                                  data, (GLsizeiptr)(size / (4*sizeof(float))));
     }
+};
+
+
+class BindBufferRangeCmd : public Command {
+    GLuint mIndex;
+    GLuint mBuffer;
+    GLintptr mOffset;
+    GLsizeiptr mSize;
+
+public:
+    BindBufferRangeCmd(GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+      : mIndex(index), mBuffer(buffer), mOffset(offset), mSize(size)
+    { }
 
-    virtual ULONG execute()
+    void execute()
     {
-        glNamedBufferSubDataEXT(mBuffer, mOffset, mSize, mData);
+        glBindBufferRange(GL_UNIFORM_BUFFER, mIndex, mBuffer, mOffset, mSize);
         checkGLError();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mIndex);
+        capture.writeName(CaptureName_Buffer, mBuffer);
+        capture.write<LONGLONG>(mOffset);
+        capture.write<LONGLONG>(mSize);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLuint index = reader.read<GLuint>();
+        ULONG id = reader.read<ULONG>();
+        LONGLONG offset = reader.read<LONGLONG>();
+        LONGLONG size = reader.read<LONGLONG>();
+        replay.send<BindBufferRangeCmd>(index, replay.getName(id), (GLintptr)offset, (GLsizeiptr)size);
     }
 };
-typedef SetBufferValue4fv<1> SetBufferValue4f;
+
+void DestroyRingGL(GLRing &ring, bool mapped)
+{
+    if(ring.buffer)
+    {
+        if(mapped)
+            glUnmapNamedBufferEXT(ring.buffer);
+        glDeleteBuffers(1, &ring.buffer);
+        ring.buffer = 0;
+    }
+    for(GLsync &fence : ring.fences)
+    {
+        if(fence)
+            glDeleteSync(fence);
+        fence = 0;
+    }
+}
 
 
 class ElementArraySet : public Command {
+    GLState &mGLState;
     GLuint mBufferId;
 
 public:
-    ElementArraySet(GLuint bufferid) : mBufferId(bufferid) { }
+    ElementArraySet(GLState &glstate, GLuint bufferid) : mGLState(glstate), mBufferId(bufferid) { }
 
-    virtual ULONG execute()
+    void execute()
     {
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mBufferId);
-        checkGLError();
-        return sizeof(*this);
+        // The binding goes to the current VAO. Others get it when bound.
+        mGLState.element_array_buffer = mBufferId;
+        if(mGLState.current_vertex_array < MAX_VERTEX_ARRAYS)
+        {
+            mGLState.vertex_arrays[mGLState.current_vertex_array].mElements = mBufferId;
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mBufferId);
+            checkGLError();
+        }
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Buffer, mBufferId);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLuint bufferid = replay.getName(reader.read<ULONG>());
+        replay.send<ElementArraySet>(make_ref(replay.getGLState()), bufferid);
     }
 };
 
@@ -786,7 +1220,7 @@ public:
       : mGLState(glstate), mStage(stage), mType(type), mBinding(binding)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
         if(mStage != mGLState.active_texture_stage)
         {
@@ -797,7 +1231,20 @@ public:
         glBindTexture(mType, mBinding);
         checkGLError();
 
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mStage);
+        capture.write(mType);
+        capture.writeName(CaptureName_Texture, mBinding);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLuint stage = reader.read<GLuint>();
+        GLenum type = reader.read<GLenum>();
+        GLuint binding = replay.getName(reader.read<ULONG>());
+        replay.sendState<SetTextureCmd>(make_ref(replay.getGLState()), stage, type, binding);
     }
 };
 
@@ -809,7 +1256,7 @@ class ClipPlaneEnableCmd : public Command {
 public:
     ClipPlaneEnableCmd(GLState &glstate, UINT planes) : mGLState(glstate), mPlanes(planes) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         if(mPlanes != mGLState.clip_plane_enabled)
         {
@@ -828,189 +1275,676 @@ public:
             }
             checkGLError();
         }
-        return sizeof(*this);
     }
-};
-
-
-class SetFBAttachmentCmd : public Command {
-    GLState &mGLState;
-    GLenum mAttachment;
-    GLenum mTarget;
-    GLuint mId;
-    GLint mLevel;
 
-public:
-    SetFBAttachmentCmd(GLState &glstate, GLenum attachment, GLenum target, GLuint id, GLint level)
-      : mGLState(glstate), mAttachment(attachment), mTarget(target), mId(id), mLevel(level)
-    { }
-
-    virtual ULONG execute()
+    void capture(CommandCapture &capture) const
     {
-        if(mTarget == GL_RENDERBUFFER)
-            glNamedFramebufferRenderbufferEXT(mGLState.main_framebuffer, mAttachment, GL_RENDERBUFFER, mId);
-        else if(mTarget == GL_TEXTURE_2D || mTarget == GL_TEXTURE_CUBE_MAP_POSITIVE_X ||
-                mTarget == GL_TEXTURE_CUBE_MAP_NEGATIVE_X || mTarget == GL_TEXTURE_CUBE_MAP_POSITIVE_Y ||
-                mTarget == GL_TEXTURE_CUBE_MAP_NEGATIVE_Y || mTarget == GL_TEXTURE_CUBE_MAP_POSITIVE_Z ||
-                mTarget == GL_TEXTURE_CUBE_MAP_NEGATIVE_Z)
-            glNamedFramebufferTexture2DEXT(mGLState.main_framebuffer, mAttachment, mTarget, mId, mLevel);
-        checkGLError();
-
-        return sizeof(*this);
+        capture.write(mPlanes);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.sendState<ClipPlaneEnableCmd>(make_ref(replay.getGLState()), reader.read<UINT>());
     }
 };
 
 
-class SetVertexAttribArrayCmd : public Command {
-    GLState &mGLState;
-    UINT mAttribs;
+// Applies the state that changed since the last draw, from a packet of state
+// commands.
+class ApplyStateCmd : public Command {
+    ULONG mLength;
 
 public:
-    SetVertexAttribArrayCmd(GLState &glstate, UINT attribs) : mGLState(glstate), mAttribs(attribs) { }
+    ApplyStateCmd(const CommandPacket &packet) : mLength(packet.size())
+    { memcpy(this+1, packet.data(), mLength); }
 
-    virtual ULONG execute()
+    void execute()
     {
-        if(mAttribs != mGLState.attrib_array_enabled)
-        {
-            UINT old_attribs = mGLState.attrib_array_enabled;
-            mGLState.attrib_array_enabled = mAttribs;
-
-            for(UINT i = 0;old_attribs || mAttribs;++i)
-            {
-                if((mAttribs&1) && !(old_attribs&1))
-                    glEnableVertexAttribArray(i);
-                else if(!(mAttribs&1) && (old_attribs&1))
-                {
-                    glDisableVertexAttribArray(i);
-                    glVertexAttrib4f(i, 0.0f, 0.0f, 0.0f, 1.0f);
-                }
-
-                old_attribs >>= 1;
-                mAttribs >>= 1;
-            }
-            checkGLError();
-        }
+        CommandPacket::execute(reinterpret_cast<char*>(this+1), mLength);
+    }
 
-        return sizeof(*this);
+    // The packet's commands are written as records of their own.
+    void capture(CommandCapture &capture) const
+    {
+        CommandPacket::capture(reinterpret_cast<const char*>(this+1), mLength, capture);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        CommandPacket packet;
+        replay.replayPacket(reader, packet);
+        if(!packet.empty())
+            replay.sendPayload<ApplyStateCmd>(packet.size(), make_ref(packet));
     }
 };
 
 
-class ClearCmd : public Command {
-    GLState &mGLState;
-    GLbitfield mMask;
-    GLuint mColor;
-    GLfloat mDepth;
-    GLuint mStencil;
-    RECT mRect;
-
-public:
-    ClearCmd(GLState &glstate, GLbitfield mask, GLuint color, GLfloat depth, GLuint stencil, const RECT &rect)
-      : mGLState(glstate), mMask(mask), mColor(color), mDepth(depth), mStencil(stencil), mRect(rect)
-    { }
+// Finds or makes the cached framebuffer with the current attachments, and
+// makes it the main framebuffer. The least recently used one is replaced
+// when the cache is full.
+void UpdateMainFramebufferGL(GLState &gl)
+{
+    static const std::array<GLenum,FBAttachment_Count> attachments{{
+        GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2,
+        GL_COLOR_ATTACHMENT3, GL_DEPTH_ATTACHMENT, GL_STENCIL_ATTACHMENT
+    }};
 
-    virtual ULONG execute()
+    gl.framebuffer_dirty = false;
+    GLFramebuffer *fb = nullptr;
+    GLFramebuffer *oldest = nullptr;
+    for(GLFramebuffer &cached : gl.framebuffers)
     {
-        if(mGLState.current_framebuffer[0] != mGLState.main_framebuffer)
+        if(cached.mId && cached.mAttachments == gl.fb_attachments)
         {
-            mGLState.current_framebuffer[0] = mGLState.main_framebuffer;
-            mGLState.current_framebuffer[1] = mGLState.main_framebuffer;
-            glBindFramebuffer(GL_FRAMEBUFFER, mGLState.main_framebuffer);
+            fb = &cached;
+            break;
         }
+        if(!oldest || (oldest->mId && (!cached.mId || cached.mLastUse < oldest->mLastUse)))
+            oldest = &cached;
+    }
 
-        glPushAttrib(mMask | GL_SCISSOR_BIT);
-
-        if((mMask&GL_COLOR_BUFFER_BIT))
-        {
-            glClearColor(D3DCOLOR_R(mColor)/255.0f, D3DCOLOR_G(mColor)/255.0f,
-                         D3DCOLOR_B(mColor)/255.0f, D3DCOLOR_A(mColor)/255.0f);
-            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-        }
-        if((mMask&GL_DEPTH_BUFFER_BIT))
+    if(!fb)
+    {
+        fb = oldest;
+        if(fb->mId)
         {
-            glClearDepth(mDepth);
-            glDepthMask(GL_TRUE);
+            for(GLuint &current : gl.current_framebuffer)
+            {
+                if(current == fb->mId)
+                    current = 0;
+            }
+            glDeleteFramebuffers(1, &fb->mId);
         }
-        if((mMask&GL_STENCIL_BUFFER_BIT))
+
+        glGenFramebuffers(1, &fb->mId);
+        fb->mAttachments = gl.fb_attachments;
+        for(size_t i = 0;i < attachments.size();++i)
         {
-            glClearStencil(mStencil);
-            glStencilMask(GL_TRUE);
+            const GLFBAttachment &attachment = fb->mAttachments[i];
+            if(!attachment.mId)
+                continue;
+            if(attachment.mTarget == GL_RENDERBUFFER)
+                glNamedFramebufferRenderbufferEXT(fb->mId, attachments[i], GL_RENDERBUFFER, attachment.mId);
+            else
+                glNamedFramebufferTexture2DEXT(fb->mId, attachments[i], attachment.mTarget,
+                                               attachment.mId, attachment.mLevel);
         }
+        glFramebufferDrawBuffersEXT(fb->mId, 4, attachments.data());
 
-        glEnable(GL_SCISSOR_TEST);
-        glScissor(mRect.left, mRect.top, mRect.right-mRect.left, mRect.bottom-mRect.top);
-        glClear(mMask);
-
-        glPopAttrib();
+        GLenum status = glCheckNamedFramebufferStatusEXT(fb->mId, GL_FRAMEBUFFER);
+        if(status != GL_FRAMEBUFFER_COMPLETE)
+            WARN("Framebuffer %u is incomplete: 0x%x\n", fb->mId, status);
         checkGLError();
-
-        return sizeof(*this);
     }
-};
 
-class SetVtxDataCmd : public Command {
-    GLStreamData mStreams[16];
-    GLuint mNumStreams;
+    fb->mLastUse = ++gl.framebuffer_use_count;
+    gl.main_framebuffer = fb->mId;
+}
 
-public:
-    SetVtxDataCmd(const GLStreamData *streams, GLuint numstream)
+void BindMainFramebufferGL(GLState &gl)
+{
+    if(gl.framebuffer_dirty)
+        UpdateMainFramebufferGL(gl);
+    if(gl.current_framebuffer[0] != gl.main_framebuffer)
     {
-        for(GLuint i = 0;i < numstream;++i)
-            mStreams[i] = streams[i];
-        mNumStreams = numstream;
+        gl.current_framebuffer[0] = gl.main_framebuffer;
+        gl.current_framebuffer[1] = gl.main_framebuffer;
+        glBindFramebuffer(GL_FRAMEBUFFER, gl.main_framebuffer);
     }
+}
 
-    virtual ULONG execute()
-    {
-        GLuint binding = 0;
+// The namespace of a framebuffer attachment's or source's GL name.
+CaptureNameType FBNameType(GLenum target)
+{
+    return (target == GL_RENDERBUFFER) ? CaptureName_Renderbuffer : CaptureName_Texture;
+}
 
-        for(GLuint i = 0;i < mNumStreams;++i)
-        {
-            if(binding != mStreams[i].mBufferId)
+class SetFBAttachmentCmd : public Command {
+    GLState &mGLState;
+    GLenum mAttachment;
+    GLFBAttachment mImage;
+
+    void set(UINT slot)
+    {
+        if(mGLState.fb_attachments[slot] != mImage)
+        {
+            mGLState.fb_attachments[slot] = mImage;
+            mGLState.framebuffer_dirty = true;
+        }
+    }
+
+public:
+    SetFBAttachmentCmd(GLState &glstate, GLenum attachment, GLenum target, GLuint id, GLint level)
+      : mGLState(glstate), mAttachment(attachment)
+      , mImage(id ? GLFBAttachment{target, id, level} : GLFBAttachment{0, 0, 0})
+    { }
+
+    // The framebuffer with the new attachments is found when next drawing.
+    void execute()
+    {
+        if(mAttachment == GL_DEPTH_STENCIL_ATTACHMENT)
+        {
+            set(FBAttachment_Depth);
+            set(FBAttachment_Stencil);
+        }
+        else if(mAttachment == GL_DEPTH_ATTACHMENT)
+            set(FBAttachment_Depth);
+        else if(mAttachment == GL_STENCIL_ATTACHMENT)
+            set(FBAttachment_Stencil);
+        else
+            set(mAttachment - GL_COLOR_ATTACHMENT0);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mAttachment);
+        capture.write(mImage.mTarget);
+        capture.writeName(FBNameType(mImage.mTarget), mImage.mId);
+        capture.write(mImage.mLevel);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum attachment = reader.read<GLenum>();
+        GLenum target = reader.read<GLenum>();
+        GLuint id = replay.getName(reader.read<ULONG>());
+        GLint level = reader.read<GLint>();
+        replay.send<SetFBAttachmentCmd>(make_ref(replay.getGLState()), attachment, target, id, level);
+    }
+};
+
+// Removes the cached framebuffers using a texture or renderbuffer that's
+// being deleted, and detaches it from the render targets.
+class ReleaseFBAttachmentCmd : public Command {
+    GLState &mGLState;
+    bool mRenderbuffer;
+    GLuint mId;
+
+    bool matches(const GLFBAttachment &attachment) const
+    { return attachment.mId == mId && (attachment.mTarget == GL_RENDERBUFFER) == mRenderbuffer; }
+
+public:
+    ReleaseFBAttachmentCmd(GLState &glstate, bool renderbuffer, GLuint id)
+      : mGLState(glstate), mRenderbuffer(renderbuffer), mId(id)
+    { }
+
+    void execute()
+    {
+        for(GLFramebuffer &fb : mGLState.framebuffers)
+        {
+            if(!fb.mId || std::none_of(fb.mAttachments.begin(), fb.mAttachments.end(),
+                                       [this](const GLFBAttachment &a) { return matches(a); }))
+                continue;
+            for(GLuint &current : mGLState.current_framebuffer)
+            {
+                if(current == fb.mId)
+                    current = 0;
+            }
+            if(mGLState.main_framebuffer == fb.mId)
+            {
+                mGLState.main_framebuffer = 0;
+                mGLState.framebuffer_dirty = true;
+            }
+            glDeleteFramebuffers(1, &fb.mId);
+            fb = GLFramebuffer{};
+        }
+        for(GLFBAttachment &attachment : mGLState.fb_attachments)
+        {
+            if(matches(attachment))
+            {
+                attachment = GLFBAttachment{0, 0, 0};
+                mGLState.framebuffer_dirty = true;
+            }
+        }
+        checkGLError();
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mRenderbuffer);
+        capture.writeName(mRenderbuffer ? CaptureName_Renderbuffer : CaptureName_Texture, mId);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        bool renderbuffer = reader.read<bool>();
+        GLuint id = replay.getName(reader.read<ULONG>());
+        replay.send<ReleaseFBAttachmentCmd>(make_ref(replay.getGLState()), renderbuffer, id);
+    }
+};
+
+// Clears the main framebuffer, either whole or within each of the given
+// rects. The rects follow the command.
+class ClearCmd : public Command {
+    GLState &mGLState;
+    GLbitfield mMask;
+    GLuint mColor;
+    GLfloat mDepth;
+    GLint mStencil;
+    GLsizei mNumRects;
+
+    RECT *getRects() { return reinterpret_cast<RECT*>(this+1); }
+    const RECT *getRects() const { return reinterpret_cast<const RECT*>(this+1); }
+
+    void clearBuffers()
+    {
+        if((mMask&GL_COLOR_BUFFER_BIT))
+        {
+            const GLfloat color[4] = {
+                D3DCOLOR_R(mColor)/255.0f, D3DCOLOR_G(mColor)/255.0f,
+                D3DCOLOR_B(mColor)/255.0f, D3DCOLOR_A(mColor)/255.0f
+            };
+            for(GLint i = 0;i < FBAttachment_Depth;++i)
+            {
+                if(mGLState.fb_attachments[i].mId)
+                    glClearBufferfv(GL_COLOR, i, color);
+            }
+        }
+        if((mMask&GL_DEPTH_BUFFER_BIT) && (mMask&GL_STENCIL_BUFFER_BIT))
+            glClearBufferfi(GL_DEPTH_STENCIL, 0, mDepth, mStencil);
+        else if((mMask&GL_DEPTH_BUFFER_BIT))
+            glClearBufferfv(GL_DEPTH, 0, &mDepth);
+        else if((mMask&GL_STENCIL_BUFFER_BIT))
+            glClearBufferiv(GL_STENCIL, 0, &mStencil);
+    }
+
+public:
+    ClearCmd(GLState &glstate, GLbitfield mask, GLuint color, GLfloat depth, GLuint stencil,
+             GLsizei numrects, const RECT *rects)
+      : mGLState(glstate), mMask(mask), mColor(color), mDepth(depth), mStencil(stencil)
+      , mNumRects(numrects)
+    {
+        if(numrects)
+            memcpy(getRects(), rects, numrects*sizeof(*rects));
+    }
+
+    void execute()
+    {
+        BindMainFramebufferGL(mGLState);
+
+        // Clears go through the write masks, so only the ones that aren't
+        // fully on need changing, and restoring after.
+        DWORD color_masks = 0;
+        if((mMask&GL_COLOR_BUFFER_BIT))
+        {
+            for(UINT i = 0;i < mGLState.color_write_masks.size();++i)
+            {
+                if(mGLState.fb_attachments[i].mId && mGLState.color_write_masks[i] != 0xf)
+                {
+                    color_masks |= 1<<i;
+                    glColorMaski(i, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                }
+            }
+        }
+        bool depth_mask = (mMask&GL_DEPTH_BUFFER_BIT) && !mGLState.depth_write_mask;
+        if(depth_mask)
+            glDepthMask(GL_TRUE);
+        bool stencil_mask = (mMask&GL_STENCIL_BUFFER_BIT) && mGLState.stencil_write_mask != ~0u;
+        if(stencil_mask)
+            glStencilMask(~0u);
+
+        // Without rects the whole framebuffer is cleared, otherwise the
+        // scissor limits each clear to its rect.
+        if(!mNumRects)
+        {
+            if(mGLState.scissor_test)
+                glDisable(GL_SCISSOR_TEST);
+            clearBuffers();
+            if(mGLState.scissor_test)
+                glEnable(GL_SCISSOR_TEST);
+        }
+        else
+        {
+            RECT old_rect = mGLState.scissor_rect;
+            if(!mGLState.scissor_test)
+                glEnable(GL_SCISSOR_TEST);
+            for(GLsizei i = 0;i < mNumRects;++i)
+            {
+                ScissorRectGL(mGLState, getRects()[i]);
+                clearBuffers();
+            }
+            if(!mGLState.scissor_test)
+                glDisable(GL_SCISSOR_TEST);
+            if(old_rect.right >= old_rect.left && old_rect.bottom >= old_rect.top)
+                ScissorRectGL(mGLState, old_rect);
+        }
+
+        for(UINT i = 0;color_masks;++i,color_masks >>= 1)
+        {
+            if((color_masks&1))
+                ColorMaskGL(mGLState, i, mGLState.color_write_masks[i]);
+        }
+        if(depth_mask)
+            glDepthMask(GL_FALSE);
+        if(stencil_mask)
+            glStencilMask(mGLState.stencil_write_mask);
+        checkGLError();
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mMask);
+        capture.write(mColor);
+        capture.write(mDepth);
+        capture.write(mStencil);
+        capture.writeData(getRects(), mNumRects*sizeof(RECT));
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLbitfield mask = reader.read<GLbitfield>();
+        GLuint color = reader.read<GLuint>();
+        GLfloat depth = reader.read<GLfloat>();
+        GLint stencil = reader.read<GLint>();
+        size_t size;
+        const RECT *rects = reinterpret_cast<const RECT*>(reader.readData(size));
+        GLsizei numrects = rects ? (GLsizei)(size / sizeof(RECT)) : 0;
+        replay.sendPayload<ClearCmd>(getPayloadSize(numrects), make_ref(replay.getGLState()),
+                                     mask, color, depth, stencil, numrects, rects);
+    }
+
+    static size_t getPayloadSize(GLsizei numrects)
+    { return numrects * sizeof(RECT); }
+};
+
+// Binds the buffers and element buffer the current VAO is missing.
+void BindVertexBuffersGL(GLState &glstate)
+{
+    GLVertexArray &vao = glstate.vertex_arrays[glstate.current_vertex_array];
+    if(vao.mElements != glstate.element_array_buffer)
+    {
+        vao.mElements = glstate.element_array_buffer;
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vao.mElements);
+    }
+
+    UINT changed = 0;
+    for(UINT i = 0;i < MAX_STREAMS;++i)
+    {
+        if(!(vao.mStreams&(1<<i)))
+            continue;
+        const GLVertexBuffer &buffer = glstate.vertex_buffers[i];
+        GLVertexBuffer &bound = vao.mBuffers[i];
+        if(!GLEW_ARB_vertex_attrib_binding)
+        {
+            if(bound != buffer)
+                changed |= 1<<i;
+        }
+        else
+        {
+            if(bound.mDivisor != buffer.mDivisor)
+                glVertexBindingDivisor(i, buffer.mDivisor);
+            if(bound.mBufferId != buffer.mBufferId || bound.mOffset != buffer.mOffset ||
+               bound.mStride != buffer.mStride)
+                changed |= 1<<i;
+        }
+        bound = buffer;
+    }
+    if(!changed)
+        return;
+
+    if(!GLEW_ARB_vertex_attrib_binding)
+    {
+        GLuint binding = ~0u;
+        for(GLuint i = 0;i < vao.mKey.mNumAttribs;++i)
+        {
+            const GLVertexAttrib &attrib = vao.mKey.mAttribs[i];
+            if(!(changed&(1<<attrib.mBinding)))
+                continue;
+            const GLVertexBuffer &buffer = vao.mBuffers[attrib.mBinding];
+            if(binding != buffer.mBufferId)
             {
-                binding = mStreams[i].mBufferId;
+                binding = buffer.mBufferId;
                 glBindBuffer(GL_ARRAY_BUFFER, binding);
             }
-            glVertexAttribPointer(mStreams[i].mTarget, mStreams[i].mGLCount,
-                                  mStreams[i].mGLType, mStreams[i].mNormalize,
-                                  mStreams[i].mStride, mStreams[i].mPointer);
-            // Setting a high divisor will keep the vertex attribute from
-            // incrementing, just like D3D's stride==0 setting.
-            if(mStreams[i].mStride == 0)
-                glVertexAttribDivisor(mStreams[i].mTarget, 65535);
+            glVertexAttribPointer(attrib.mTarget, attrib.mGLCount, attrib.mGLType, attrib.mNormalize,
+                                  buffer.mStride, ((GLubyte*)0) + buffer.mOffset + attrib.mOffset);
+            // A stride of 0 means tightly packed here, so a high divisor is
+            // used instead to keep the attribute from advancing.
+            if(buffer.mStride == 0)
+                glVertexAttribDivisor(attrib.mTarget, 65535);
             else
-                glVertexAttribDivisor(mStreams[i].mTarget, mStreams[i].mDivisor);
+                glVertexAttribDivisor(attrib.mTarget, buffer.mDivisor);
         }
         glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    else if(GLEW_ARB_multi_bind)
+    {
+        // Bind the whole range at once. Streams in between that the VAO
+        // doesn't read get bound too, which is harmless.
+        UINT first = 0, last = MAX_STREAMS-1;
+        while(!(changed&(1<<first))) ++first;
+        while(!(changed&(1<<last))) --last;
+
+        GLuint ids[MAX_STREAMS];
+        GLintptr offsets[MAX_STREAMS];
+        GLsizei strides[MAX_STREAMS];
+        for(UINT i = first;i <= last;++i)
+        {
+            vao.mBuffers[i] = glstate.vertex_buffers[i];
+            ids[i-first] = vao.mBuffers[i].mBufferId;
+            offsets[i-first] = vao.mBuffers[i].mOffset;
+            strides[i-first] = vao.mBuffers[i].mStride;
+        }
+        glBindVertexBuffers(first, last-first+1, ids, offsets, strides);
+    }
+    else for(UINT i = 0;changed;++i,changed >>= 1)
+    {
+        if((changed&1))
+            glBindVertexBuffer(i, vao.mBuffers[i].mBufferId, vao.mBuffers[i].mOffset,
+                               vao.mBuffers[i].mStride);
+    }
+}
+
+class InitVertexArrayCmd : public Command {
+    GLState &mGLState;
+    UINT mSlot;
+    VertexArrayKey mKey;
+
+public:
+    InitVertexArrayCmd(GLState &glstate, UINT slot, const VertexArrayKey &key)
+      : mGLState(glstate), mSlot(slot), mKey(key)
+    { }
+
+    void execute()
+    {
+        // Start from a new VAO, so nothing is left enabled from the old key.
+        GLVertexArray &vao = mGLState.vertex_arrays[mSlot];
+        if(vao.mId)
+            glDeleteVertexArrays(1, &vao.mId);
+        glGenVertexArrays(1, &vao.mId);
+        glBindVertexArray(vao.mId);
+        mGLState.current_vertex_array = mSlot;
+
+        vao.mStreams = 0;
+        for(GLuint i = 0;i < mKey.mNumAttribs;++i)
+        {
+            const GLVertexAttrib &attrib = mKey.mAttribs[i];
+            glEnableVertexAttribArray(attrib.mTarget);
+            if(GLEW_ARB_vertex_attrib_binding)
+            {
+                glVertexAttribFormat(attrib.mTarget, attrib.mGLCount, attrib.mGLType,
+                                     attrib.mNormalize, attrib.mOffset);
+                glVertexAttribBinding(attrib.mTarget, attrib.mBinding);
+            }
+            vao.mStreams |= 1<<attrib.mBinding;
+        }
+        vao.mKey = mKey;
+
+        // A new VAO has nothing bound.
+        vao.mElements = 0;
+        vao.mBuffers.fill(GLVertexBuffer{~0u, 0, 0, 0});
+        BindVertexBuffersGL(mGLState);
+        checkGLError();
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mSlot);
+        capture.write(mKey);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        UINT slot = reader.read<UINT>();
+        VertexArrayKey key = reader.read<VertexArrayKey>();
+        replay.send<InitVertexArrayCmd>(make_ref(replay.getGLState()), slot, make_ref(key));
+    }
+};
+
+class BindVertexArrayCmd : public Command {
+    GLState &mGLState;
+    UINT mSlot;
+
+public:
+    BindVertexArrayCmd(GLState &glstate, UINT slot) : mGLState(glstate), mSlot(slot) { }
+
+    void execute()
+    {
+        if(mGLState.current_vertex_array != mSlot)
+        {
+            glBindVertexArray(mGLState.vertex_arrays[mSlot].mId);
+            mGLState.current_vertex_array = mSlot;
+        }
+        BindVertexBuffersGL(mGLState);
         checkGLError();
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mSlot);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.send<BindVertexArrayCmd>(make_ref(replay.getGLState()), reader.read<UINT>());
+    }
+};
+
+// The buffers are stored inline after the command, so it must be sent with
+// doSendPayload. They're bound to the VAO by the next BindVertexArrayCmd.
+class SetVertexBuffersCmd : public Command {
+    GLState &mGLState;
+    UINT mFirst;
+    UINT mCount;
+
+    GLVertexBuffer *getBuffers() { return reinterpret_cast<GLVertexBuffer*>(this+1); }
+    const GLVertexBuffer *getBuffers() const { return reinterpret_cast<const GLVertexBuffer*>(this+1); }
+
+public:
+    SetVertexBuffersCmd(GLState &glstate, UINT first, UINT count, const GLVertexBuffer *buffers)
+      : mGLState(glstate), mFirst(first), mCount(count)
+    { std::copy(buffers, buffers+count, getBuffers()); }
+
+    void execute()
+    {
+        std::copy(getBuffers(), getBuffers()+mCount, mGLState.vertex_buffers.begin()+mFirst);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mFirst);
+        capture.write(mCount);
+        for(UINT i = 0;i < mCount;++i)
+        {
+            const GLVertexBuffer &buffer = getBuffers()[i];
+            capture.writeName(CaptureName_Buffer, buffer.mBufferId);
+            capture.write(buffer.mOffset);
+            capture.write(buffer.mStride);
+            capture.write(buffer.mDivisor);
+        }
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        UINT first = reader.read<UINT>();
+        UINT count = reader.read<UINT>();
+        if(first >= MAX_STREAMS || count > MAX_STREAMS-first)
+        {
+            ERR("Invalid vertex buffer range: %u, %u\n", first, count);
+            return;
+        }
+        std::array<GLVertexBuffer,MAX_STREAMS> buffers;
+        for(UINT i = 0;i < count;++i)
+        {
+            buffers[i].mBufferId = replay.getName(reader.read<ULONG>());
+            buffers[i].mOffset = reader.read<GLuint>();
+            buffers[i].mStride = reader.read<GLsizei>();
+            buffers[i].mDivisor = reader.read<GLuint>();
+        }
+        replay.sendPayload<SetVertexBuffersCmd>(getPayloadSize(count), make_ref(replay.getGLState()),
+                                                first, count, buffers.data());
+    }
+
+    static size_t getPayloadSize(UINT count) { return count * sizeof(GLVertexBuffer); }
+};
+
+// Forgets a buffer that's about to be deleted, so VAOs still holding the old
+// buffer get it rebound if a new buffer reuses the ID.
+class ReleaseBufferCmd : public Command {
+    GLState &mGLState;
+    GLuint mBufferId;
+
+public:
+    ReleaseBufferCmd(GLState &glstate, GLuint bufferid) : mGLState(glstate), mBufferId(bufferid) { }
+
+    void execute()
+    {
+        if(mGLState.element_array_buffer == mBufferId)
+            mGLState.element_array_buffer = 0;
+        for(GLVertexBuffer &buffer : mGLState.vertex_buffers)
+        {
+            if(buffer.mBufferId == mBufferId)
+                buffer.mBufferId = 0;
+        }
+        for(GLVertexArray &vao : mGLState.vertex_arrays)
+        {
+            if(vao.mElements == mBufferId)
+                vao.mElements = ~0u;
+            for(GLVertexBuffer &buffer : vao.mBuffers)
+            {
+                if(buffer.mBufferId == mBufferId)
+                    buffer.mBufferId = ~0u;
+            }
+        }
+    }
 
-        return sizeof(*this);
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Buffer, mBufferId);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLuint bufferid = replay.getName(reader.read<ULONG>());
+        replay.send<ReleaseBufferCmd>(make_ref(replay.getGLState()), bufferid);
     }
 };
 
 class DrawGLArraysCmd : public Command {
     GLState &mGLState;
     GLenum mMode;
+    GLint mFirst;
     GLint mCount;
     GLsizei mNumInstances;
 
 public:
-    DrawGLArraysCmd(GLState &glstate, GLenum mode, GLint count, GLsizei num_instances)
-      : mGLState(glstate), mMode(mode), mCount(count), mNumInstances(num_instances)
+    DrawGLArraysCmd(GLState &glstate, GLenum mode, GLint first, GLint count, GLsizei num_instances)
+      : mGLState(glstate), mMode(mode), mFirst(first), mCount(count), mNumInstances(num_instances)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
-        if(mGLState.current_framebuffer[0] != mGLState.main_framebuffer)
-        {
-            mGLState.current_framebuffer[0] = mGLState.main_framebuffer;
-            mGLState.current_framebuffer[1] = mGLState.main_framebuffer;
-            glBindFramebuffer(GL_FRAMEBUFFER, mGLState.main_framebuffer);
-        }
-        glDrawArraysInstanced(mMode, 0, mCount, mNumInstances);
+        BindMainFramebufferGL(mGLState);
+        glDrawArraysInstanced(mMode, mFirst, mCount, mNumInstances);
         checkGLError();
 
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mMode);
+        capture.write(mFirst);
+        capture.write(mCount);
+        capture.write(mNumInstances);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum mode = reader.read<GLenum>();
+        GLint first = reader.read<GLint>();
+        GLint count = reader.read<GLint>();
+        GLsizei num_instances = reader.read<GLsizei>();
+        replay.send<DrawGLArraysCmd>(make_ref(replay.getGLState()), mode, first, count, num_instances);
     }
 };
 
@@ -1028,25 +1962,152 @@ public:
       : mGLState(glstate), mMode(mode), mCount(count), mType(type), mPointer(pointer), mNumInstances(num_instances), mBaseVtx(basevtx)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
-        if(mGLState.current_framebuffer[0] != mGLState.main_framebuffer)
-        {
-            mGLState.current_framebuffer[0] = mGLState.main_framebuffer;
-            mGLState.current_framebuffer[1] = mGLState.main_framebuffer;
-            glBindFramebuffer(GL_FRAMEBUFFER, mGLState.main_framebuffer);
-        }
+        BindMainFramebufferGL(mGLState);
         glDrawElementsInstancedBaseVertex(mMode, mCount, mType, mPointer, mNumInstances, mBaseVtx);
         checkGLError();
 
-        return sizeof(*this);
+    }
+
+    // The pointer is an offset into the element buffer.
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mMode);
+        capture.write(mCount);
+        capture.write(mType);
+        capture.write<LONGLONG>(reinterpret_cast<INT_PTR>(mPointer));
+        capture.write(mNumInstances);
+        capture.write(mBaseVtx);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum mode = reader.read<GLenum>();
+        GLint count = reader.read<GLint>();
+        GLenum type = reader.read<GLenum>();
+        GLubyte *pointer = reinterpret_cast<GLubyte*>((INT_PTR)reader.read<LONGLONG>());
+        GLsizei num_instances = reader.read<GLsizei>();
+        GLsizei basevtx = reader.read<GLsizei>();
+        replay.send<DrawGLElementsCmd>(make_ref(replay.getGLState()), mode, count, type, pointer,
+                                       num_instances, basevtx);
     }
 };
 
-} // namespace
+// Draws a batch of indexed draws, with the pointers, counts and base
+// vertices of each one following the command.
+class MultiDrawGLElementsCmd : public Command {
+    GLState &mGLState;
+    GLenum mMode;
+    GLenum mType;
+    GLsizei mDrawCount;
+
+    GLubyte **getPointers() { return reinterpret_cast<GLubyte**>(this+1); }
+    GLsizei *getCounts() { return reinterpret_cast<GLsizei*>(getPointers()+mDrawCount); }
+    GLint *getBaseVertices() { return reinterpret_cast<GLint*>(getCounts()+mDrawCount); }
+    GLubyte*const *getPointers() const { return reinterpret_cast<GLubyte*const*>(this+1); }
+    const GLsizei *getCounts() const { return reinterpret_cast<const GLsizei*>(getPointers()+mDrawCount); }
+    const GLint *getBaseVertices() const { return reinterpret_cast<const GLint*>(getCounts()+mDrawCount); }
+
+public:
+    MultiDrawGLElementsCmd(GLState &glstate, GLenum mode, GLenum type, GLsizei drawcount,
+                           GLubyte*const *pointers, const GLsizei *counts, const GLint *basevtxs)
+      : mGLState(glstate), mMode(mode), mType(type), mDrawCount(drawcount)
+    {
+        memcpy(getPointers(), pointers, drawcount*sizeof(*pointers));
+        memcpy(getCounts(), counts, drawcount*sizeof(*counts));
+        memcpy(getBaseVertices(), basevtxs, drawcount*sizeof(*basevtxs));
+    }
+
+    void execute()
+    {
+        BindMainFramebufferGL(mGLState);
+        glMultiDrawElementsBaseVertex(mMode, getCounts(), mType,
+            reinterpret_cast<const GLvoid*const*>(getPointers()), mDrawCount, getBaseVertices()
+        );
+        checkGLError();
+    }
+
+    // The pointers are offsets into the element buffer.
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mMode);
+        capture.write(mType);
+        capture.write(mDrawCount);
+        for(GLsizei i = 0;i < mDrawCount;++i)
+        {
+            capture.write<LONGLONG>(reinterpret_cast<INT_PTR>(getPointers()[i]));
+            capture.write(getCounts()[i]);
+            capture.write(getBaseVertices()[i]);
+        }
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum mode = reader.read<GLenum>();
+        GLenum type = reader.read<GLenum>();
+        GLsizei drawcount = reader.read<GLsizei>();
+        std::vector<GLubyte*> pointers;
+        std::vector<GLsizei> counts;
+        std::vector<GLint> basevtxs;
+        for(GLsizei i = 0;i < drawcount && !reader.overrun();++i)
+        {
+            pointers.push_back(reinterpret_cast<GLubyte*>((INT_PTR)reader.read<LONGLONG>()));
+            counts.push_back(reader.read<GLsizei>());
+            basevtxs.push_back(reader.read<GLint>());
+        }
+        if(reader.overrun() || pointers.empty())
+            return;
+        drawcount = (GLsizei)pointers.size();
+        replay.sendPayload<MultiDrawGLElementsCmd>(getPayloadSize(drawcount),
+            make_ref(replay.getGLState()), mode, type, drawcount,
+            pointers.data(), counts.data(), basevtxs.data()
+        );
+    }
+
+    static size_t getPayloadSize(GLsizei drawcount)
+    { return drawcount * (sizeof(GLubyte*) + sizeof(GLsizei) + sizeof(GLint)); }
+};
 
+} // namespace
 
-void D3DGLDevice::readFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum format, GLenum type, GLubyte* data, std::atomic<ULONG> &pendingupdates)
+DEFINE_COMMAND(StateEnable)
+DEFINE_COMMAND(MaterialSet)
+DEFINE_COMMAND(ViewportSet)
+DEFINE_COMMAND(ScissorRectSet)
+DEFINE_COMMAND(ScissorTestSet)
+DEFINE_COMMAND(PolygonModeSet)
+DEFINE_COMMAND(CullFaceSet)
+DEFINE_COMMAND(ColorMaskSet)
+DEFINE_COMMAND(DepthMaskSet)
+DEFINE_COMMAND(DepthFuncSet)
+DEFINE_COMMAND(AlphaFuncSet)
+DEFINE_COMMAND(BlendFuncSet)
+DEFINE_COMMAND(StencilFuncSet)
+DEFINE_COMMAND(BlendOpSet)
+DEFINE_COMMAND(StencilOpSet)
+DEFINE_COMMAND(StencilMaskSet)
+DEFINE_COMMAND(DepthBiasSet)
+DEFINE_COMMAND(FogValuefSet)
+DEFINE_COMMAND(InitSamplerCmd)
+DEFINE_COMMAND(BindSamplerCmd)
+DEFINE_COMMAND(SetBufferValue4fv)
+DEFINE_COMMAND(BindBufferRangeCmd)
+DEFINE_COMMAND(ElementArraySet)
+DEFINE_COMMAND(SetTextureCmd)
+DEFINE_COMMAND(ClipPlaneEnableCmd)
+DEFINE_COMMAND(ApplyStateCmd)
+DEFINE_COMMAND(SetFBAttachmentCmd)
+DEFINE_COMMAND(ReleaseFBAttachmentCmd)
+DEFINE_COMMAND(ClearCmd)
+DEFINE_COMMAND(InitVertexArrayCmd)
+DEFINE_COMMAND(BindVertexArrayCmd)
+DEFINE_COMMAND(SetVertexBuffersCmd)
+DEFINE_COMMAND(ReleaseBufferCmd)
+DEFINE_COMMAND(DrawGLArraysCmd)
+DEFINE_COMMAND(DrawGLElementsCmd)
+DEFINE_COMMAND(MultiDrawGLElementsCmd)
+
+
+void D3DGLDevice::readFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum format, GLenum type, GLubyte* data)
 {
     if(mGLState.current_framebuffer[0] != mGLState.copy_framebuffers[0])
     {
@@ -1070,7 +2131,6 @@ void D3DGLDevice::readFramebufferGL(GLenum src_target, GLuint src_binding, GLint
                  format, type, data);
 
 done:
-    --pendingupdates;
     checkGLError();
 }
 class ReadFramebufferCmd : public Command {
@@ -1082,21 +2142,48 @@ class ReadFramebufferCmd : public Command {
     GLenum mFormat;
     GLenum mType;
     std::shared_ptr<GLubyte> mData;
-    std::atomic<ULONG> &mPendingUpdates;
 
 public:
-    ReadFramebufferCmd(D3DGLDevice *target, GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum format, GLenum type, std::shared_ptr<GLubyte> data, std::atomic<ULONG> &pendingupdates)
+    ReadFramebufferCmd(D3DGLDevice *target, GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum format, GLenum type, std::shared_ptr<GLubyte> data)
       : mTarget(target), mSrcTarget(src_target), mSrcBinding(src_binding), mSrcLevel(src_level), mSrcRect(src_rect)
-      , mFormat(format), mType(type), mData(data), mPendingUpdates(pendingupdates)
+      , mFormat(format), mType(type), mData(data)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->readFramebufferGL(mSrcTarget, mSrcBinding, mSrcLevel, mSrcRect,
-                                   mFormat, mType, mData.get(), mPendingUpdates);
-        return sizeof(*this);
+                                   mFormat, mType, mData.get());
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mSrcTarget);
+        capture.writeName(FBNameType(mSrcTarget), mSrcBinding);
+        capture.write(mSrcLevel);
+        capture.write(mSrcRect);
+        capture.write(mFormat);
+        capture.write(mType);
+    }
+    // The pixels are read into a scratch buffer, big enough for the largest
+    // format, and dropped.
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum src_target = reader.read<GLenum>();
+        GLuint src_binding = replay.getName(reader.read<ULONG>());
+        GLint src_level = reader.read<GLint>();
+        RECT src_rect = reader.read<RECT>();
+        GLenum format = reader.read<GLenum>();
+        GLenum type = reader.read<GLenum>();
+
+        LONG width = std::max<LONG>(src_rect.right-src_rect.left, 0);
+        LONG height = std::max<LONG>(src_rect.bottom-src_rect.top, 0);
+        size_t data_len = std::max<size_t>((size_t)width*height*16, 16);
+        std::shared_ptr<GLubyte> data(DataAllocator<GLubyte>()(data_len), DataDeallocator<GLubyte>());
+        replay.send<ReadFramebufferCmd>(replay.getDevice(), src_target, src_binding, src_level,
+                                        make_ref(src_rect), format, type, data);
     }
 };
+DEFINE_COMMAND(ReadFramebufferCmd)
 
 
 void D3DGLDevice::blitFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum dst_target, GLuint dst_binding, GLint dst_level, const RECT &dst_rect, GLenum filter)
@@ -1148,14 +2235,15 @@ void D3DGLDevice::blitFramebufferGL(GLenum src_target, GLuint src_binding, GLint
         }
     }
 
-    glPushAttrib(GL_SCISSOR_BIT);
-    glDisable(GL_SCISSOR_TEST);
+    if(mGLState.scissor_test)
+        glDisable(GL_SCISSOR_TEST);
 
     glBlitFramebuffer(src_rect.left, src_rect.top, src_rect.right, src_rect.bottom,
                       dst_rect.left, dst_rect.top, dst_rect.right, dst_rect.bottom,
                       GL_COLOR_BUFFER_BIT, filter);
 
-    glPopAttrib();
+    if(mGLState.scissor_test)
+        glEnable(GL_SCISSOR_TEST);
 
 done:
     checkGLError();
@@ -1178,14 +2266,43 @@ public:
       , mDstTarget(dst_target), mDstBinding(dst_binding), mDstLevel(dst_level), mDstRect(dst_rect), mFilter(filter)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->blitFramebufferGL(mSrcTarget, mSrcBinding, mSrcLevel, mSrcRect,
                                    mDstTarget, mDstBinding, mDstLevel, mDstRect,
                                    mFilter);
-        return sizeof(*this);
+    }
+
+    // A destination target of 0 is the window.
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mSrcTarget);
+        capture.writeName(FBNameType(mSrcTarget), mSrcBinding);
+        capture.write(mSrcLevel);
+        capture.write(mSrcRect);
+        capture.write(mDstTarget);
+        capture.writeName(FBNameType(mDstTarget), mDstTarget ? mDstBinding : 0);
+        capture.write(mDstLevel);
+        capture.write(mDstRect);
+        capture.write(mFilter);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        GLenum src_target = reader.read<GLenum>();
+        GLuint src_binding = replay.getName(reader.read<ULONG>());
+        GLint src_level = reader.read<GLint>();
+        RECT src_rect = reader.read<RECT>();
+        GLenum dst_target = reader.read<GLenum>();
+        GLuint dst_binding = replay.getName(reader.read<ULONG>());
+        GLint dst_level = reader.read<GLint>();
+        RECT dst_rect = reader.read<RECT>();
+        GLenum filter = reader.read<GLenum>();
+        replay.send<BlitFramebufferCmd>(replay.getDevice(), src_target, src_binding, src_level,
+            make_ref(src_rect), dst_target, dst_binding, dst_level, make_ref(dst_rect), filter
+        );
     }
 };
+DEFINE_COMMAND(BlitFramebufferCmd)
 
 void D3DGLDevice::debugProcGL(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei /*length*/, const GLchar *message) const
 {
@@ -1250,34 +2367,12 @@ void D3DGLDevice::initGL(HDC dc, HGLRC glcontext)
         checkGLError();
     }
 
-    glGenSamplers(mGLState.samplers.size(), mGLState.samplers.data());
+    glGenProgramPipelines(1, &mGLState.pipeline);
+    glBindProgramPipeline(mGLState.pipeline);
     checkGLError();
 
-    for(size_t i = 0;i < mGLState.samplers.size();++i)
-    {
-        auto &sampler = mGLState.samplers[i];
-
-        GLint color[4]{0, 0, 0, 0};
-        glBindSampler(i, sampler);
-        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_R, GL_REPEAT);
-        glSamplerParameteriv(sampler, GL_TEXTURE_BORDER_COLOR, color);
-        glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glSamplerParameteri(sampler, GL_TEXTURE_SRGB_DECODE_EXT, GL_SKIP_DECODE_EXT);
-        if(GLEW_EXT_texture_filter_anisotropic)
-            glSamplerParameteri(sampler, GL_TEXTURE_MAX_ANISOTROPY_EXT, 1);
-        checkGLError();
-    }
-
-    glGenProgramPipelines(1, &mGLState.pipeline);
-    glBindProgramPipeline(mGLState.pipeline);
-    checkGLError();
-
-    glGenFramebuffers(1, &mGLState.main_framebuffer);
-    glGenFramebuffers(2, mGLState.copy_framebuffers);
-    checkGLError();
+    glGenFramebuffers(2, mGLState.copy_framebuffers);
+    checkGLError();
 
     {
         GLVertexState vtxState;
@@ -1293,6 +2388,23 @@ void D3DGLDevice::initGL(HDC dc, HGLRC glcontext)
         glBindBuffer(GL_UNIFORM_BUFFER, mGLState.ps_uniform_bufferf);
         glBufferData(GL_UNIFORM_BUFFER, mPSConstantsF.size()*sizeof(Vector4f), zero, GL_STREAM_DRAW);
         glBindBufferBase(GL_UNIFORM_BUFFER, PSF_BINDING_IDX, mGLState.ps_uniform_bufferf);
+        // Ints and bools
+        glGenBuffers(1, &mGLState.vs_uniform_bufferi);
+        glBindBuffer(GL_UNIFORM_BUFFER, mGLState.vs_uniform_bufferi);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(mVSConstantsI), zero, GL_STREAM_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, VSI_BINDING_IDX, mGLState.vs_uniform_bufferi);
+        glGenBuffers(1, &mGLState.vs_uniform_bufferb);
+        glBindBuffer(GL_UNIFORM_BUFFER, mGLState.vs_uniform_bufferb);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(mVSConstantsB), zero, GL_STREAM_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, VSB_BINDING_IDX, mGLState.vs_uniform_bufferb);
+        glGenBuffers(1, &mGLState.ps_uniform_bufferi);
+        glBindBuffer(GL_UNIFORM_BUFFER, mGLState.ps_uniform_bufferi);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(mPSConstantsI), zero, GL_STREAM_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, PSI_BINDING_IDX, mGLState.ps_uniform_bufferi);
+        glGenBuffers(1, &mGLState.ps_uniform_bufferb);
+        glBindBuffer(GL_UNIFORM_BUFFER, mGLState.ps_uniform_bufferb);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(mPSConstantsB), zero, GL_STREAM_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, PSB_BINDING_IDX, mGLState.ps_uniform_bufferb);
         // Vertex state
         glGenBuffers(1, &mGLState.vtx_state_uniform_buffer);
         glBindBuffer(GL_UNIFORM_BUFFER, mGLState.vtx_state_uniform_buffer);
@@ -1304,24 +2416,56 @@ void D3DGLDevice::initGL(HDC dc, HGLRC glcontext)
         glBufferData(GL_UNIFORM_BUFFER, sizeof(Vector4f), zero, GL_STREAM_DRAW);
         glBindBufferBase(GL_UNIFORM_BUFFER, POSFIXUP_BINDING_IDX, mGLState.pos_fixup_uniform_buffer);
     }
+    // Captures can't see what's written through a mapped ring, so the data is
+    // sent through the queue instead.
+    bool map_rings = GLEW_ARB_buffer_storage && !mQueue.isCapturing();
+    if(map_rings)
+    {
+        // Float constant ring
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        GLint align = 0;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+        mConstantRingAlign = std::max(align, 16);
+
+        glGenBuffers(1, &mGLState.constant_ring.buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, mGLState.constant_ring.buffer);
+        glBufferStorage(GL_UNIFORM_BUFFER, CONSTANT_RING_SIZE, nullptr, flags);
+        mConstantRing.mData = (GLubyte*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, CONSTANT_RING_SIZE, flags);
+        if(!mConstantRing.mData)
+        {
+            ERR("Failed to map constant ring, sending constants through the queue\n");
+            glDeleteBuffers(1, &mGLState.constant_ring.buffer);
+            mGLState.constant_ring.buffer = 0;
+        }
+    }
     glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    {
+        // User-pointer vertex data ring
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &mGLState.vertex_ring.buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, mGLState.vertex_ring.buffer);
+        if(map_rings)
+        {
+            glBufferStorage(GL_ARRAY_BUFFER, VERTEX_RING_SIZE, nullptr, flags);
+            mVertexRing.mData = (GLubyte*)glMapBufferRange(GL_ARRAY_BUFFER, 0, VERTEX_RING_SIZE, flags);
+            if(!mVertexRing.mData)
+            {
+                ERR("Failed to map vertex ring, sending vertex data through the queue\n");
+                glDeleteBuffers(1, &mGLState.vertex_ring.buffer);
+                glGenBuffers(1, &mGLState.vertex_ring.buffer);
+                glBindBuffer(GL_ARRAY_BUFFER, mGLState.vertex_ring.buffer);
+            }
+        }
+        if(!mVertexRing.mData)
+            glBufferData(GL_ARRAY_BUFFER, VERTEX_RING_SIZE, nullptr, GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
     checkGLError();
 
     glActiveTexture(GL_TEXTURE0);
     mGLState.active_texture_stage = 0;
 
-    mGLState.attrib_array_enabled = 0;
-
-    {
-        glBindFramebuffer(GL_FRAMEBUFFER, mGLState.main_framebuffer);
-        mGLState.current_framebuffer[0] = mGLState.main_framebuffer;
-        mGLState.current_framebuffer[1] = mGLState.main_framebuffer;
-        std::array<GLenum,4> buffers{
-            GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
-            GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3
-        };
-        glDrawBuffers(buffers.size(), buffers.data());
-    }
+    BindMainFramebufferGL(mGLState);
 
     glFrontFace(GL_CCW);
     checkGLError();
@@ -1330,15 +2474,70 @@ class InitGLDeviceCmd : public Command {
     D3DGLDevice *mTarget;
     HDC mDc;
     HGLRC mGLContext;
+    // Only used to create the device again when replaying.
+    D3DPRESENT_PARAMETERS mParams;
 
 public:
-    InitGLDeviceCmd(D3DGLDevice *target, HDC dc, HGLRC glcontext) : mTarget(target), mDc(dc), mGLContext(glcontext) { }
-    virtual ULONG execute()
+    InitGLDeviceCmd(D3DGLDevice *target, HDC dc, HGLRC glcontext, const D3DPRESENT_PARAMETERS &params)
+      : mTarget(target), mDc(dc), mGLContext(glcontext), mParams(params)
+    { }
+    void execute()
     {
         mTarget->initGL(mDc, mGLContext);
-        return sizeof(*this);
+    }
+
+    // The window is the replay's own.
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mParams.BackBufferWidth);
+        capture.write(mParams.BackBufferHeight);
+        capture.write(mParams.BackBufferFormat);
+        capture.write(mParams.BackBufferCount);
+        capture.write(mParams.MultiSampleType);
+        capture.write(mParams.MultiSampleQuality);
+        capture.write(mParams.SwapEffect);
+        capture.write(mParams.Windowed);
+        capture.write(mParams.EnableAutoDepthStencil);
+        capture.write(mParams.AutoDepthStencilFormat);
+        capture.write(mParams.Flags);
+        capture.write(mParams.FullScreen_RefreshRateInHz);
+        capture.write(mParams.PresentationInterval);
+    }
+    // The device's own buffers get the reserved IDs.
+    void captured(CommandCapture &capture) const
+    {
+        const GLState &glstate = mTarget->getGLState();
+        capture.addName(CaptureName_Buffer, glstate.vs_uniform_bufferf, CaptureId_VSUniformF);
+        capture.addName(CaptureName_Buffer, glstate.vs_uniform_bufferi, CaptureId_VSUniformI);
+        capture.addName(CaptureName_Buffer, glstate.vs_uniform_bufferb, CaptureId_VSUniformB);
+        capture.addName(CaptureName_Buffer, glstate.ps_uniform_bufferf, CaptureId_PSUniformF);
+        capture.addName(CaptureName_Buffer, glstate.ps_uniform_bufferi, CaptureId_PSUniformI);
+        capture.addName(CaptureName_Buffer, glstate.ps_uniform_bufferb, CaptureId_PSUniformB);
+        capture.addName(CaptureName_Buffer, glstate.vtx_state_uniform_buffer, CaptureId_VtxStateUniform);
+        capture.addName(CaptureName_Buffer, glstate.pos_fixup_uniform_buffer, CaptureId_PosFixupUniform);
+        capture.addName(CaptureName_Buffer, glstate.vertex_ring.buffer, CaptureId_VertexRing);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        D3DPRESENT_PARAMETERS params{};
+        params.BackBufferWidth = reader.read<UINT>();
+        params.BackBufferHeight = reader.read<UINT>();
+        params.BackBufferFormat = reader.read<D3DFORMAT>();
+        params.BackBufferCount = reader.read<UINT>();
+        params.MultiSampleType = reader.read<D3DMULTISAMPLE_TYPE>();
+        params.MultiSampleQuality = reader.read<DWORD>();
+        params.SwapEffect = reader.read<D3DSWAPEFFECT>();
+        params.Windowed = reader.read<BOOL>();
+        params.EnableAutoDepthStencil = reader.read<BOOL>();
+        params.AutoDepthStencilFormat = reader.read<D3DFORMAT>();
+        params.Flags = reader.read<DWORD>();
+        params.FullScreen_RefreshRateInHz = reader.read<UINT>();
+        params.PresentationInterval = reader.read<UINT>();
+        if(!reader.overrun())
+            replay.createDevice(params);
     }
 };
+DEFINE_COMMAND(InitGLDeviceCmd)
 
 void D3DGLDevice::deinitGL()
 {
@@ -1346,32 +2545,788 @@ void D3DGLDevice::deinitGL()
 
     glDeleteBuffers(1, &mGLState.vtx_state_uniform_buffer);
     glDeleteBuffers(1, &mGLState.pos_fixup_uniform_buffer);
+    glDeleteBuffers(1, &mGLState.ps_uniform_bufferb);
+    glDeleteBuffers(1, &mGLState.ps_uniform_bufferi);
     glDeleteBuffers(1, &mGLState.ps_uniform_bufferf);
+    glDeleteBuffers(1, &mGLState.vs_uniform_bufferb);
+    glDeleteBuffers(1, &mGLState.vs_uniform_bufferi);
     glDeleteBuffers(1, &mGLState.vs_uniform_bufferf);
+    DestroyRingGL(mGLState.constant_ring, mConstantRing.mData != nullptr);
+    DestroyRingGL(mGLState.vertex_ring, mVertexRing.mData != nullptr);
 
     glDeleteFramebuffers(2, mGLState.copy_framebuffers);
-    glDeleteFramebuffers(1, &mGLState.main_framebuffer);
+    for(GLFramebuffer &fb : mGLState.framebuffers)
+    {
+        if(fb.mId)
+            glDeleteFramebuffers(1, &fb.mId);
+    }
+
+    glBindProgramPipeline(0);
+    glDeleteProgramPipelines(1, &mGLState.pipeline);
+
+    for(size_t i = 0;i < MAX_COMBINED_SAMPLERS;++i)
+        glBindSampler(i, 0);
+    for(GLuint sampler : mGLState.sampler_objects)
+    {
+        if(sampler)
+            glDeleteSamplers(1, &sampler);
+    }
+
+    glBindVertexArray(0);
+    for(GLVertexArray &vao : mGLState.vertex_arrays)
+    {
+        if(vao.mId)
+            glDeleteVertexArrays(1, &vao.mId);
+    }
+
+    wglMakeCurrent(nullptr, nullptr);
+}
+class DeinitGLDeviceCmd : public Command {
+    D3DGLDevice *mTarget;
+
+public:
+    DeinitGLDeviceCmd(D3DGLDevice *target) : mTarget(target) { }
+    void execute()
+    {
+        mTarget->deinitGL();
+    }
+
+    void capture(CommandCapture&) const
+    { }
+    // The replayed device is released when the replay ends.
+    static void replay(CaptureReader&, CaptureReplay&)
+    { }
+};
+DEFINE_COMMAND(DeinitGLDeviceCmd)
+
+class FenceRingCmd : public Command {
+    GLRing &mRing;
+    std::atomic<ULONG> &mDone;
+    ULONG mSegment;
+
+public:
+    FenceRingCmd(GLRing &ring, std::atomic<ULONG> &done, ULONG segment)
+      : mRing(ring), mDone(done), mSegment(segment)
+    { }
+    void execute()
+    {
+        mRing.fences[mSegment%RING_SEGMENTS] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        mRing.fenced = mSegment+1;
+
+        // Check for older segments that are done, so the writer doesn't have
+        // to wait on them.
+        while(mRing.done < mRing.fenced)
+        {
+            GLsync &fence = mRing.fences[mRing.done%RING_SEGMENTS];
+            GLenum ret = glClientWaitSync(fence, 0, 0);
+            if(ret != GL_ALREADY_SIGNALED && ret != GL_CONDITION_SATISFIED)
+                break;
+            glDeleteSync(fence);
+            fence = 0;
+            ++mRing.done;
+        }
+        mDone.store(mRing.done);
+    }
+
+    // Only mapped rings are fenced, and they aren't used while capturing.
+    void capture(CommandCapture&) const
+    { }
+    static void replay(CaptureReader&, CaptureReplay&)
+    { }
+};
+DEFINE_COMMAND(FenceRingCmd)
+
+class WaitRingCmd : public Command {
+    GLRing &mRing;
+    std::atomic<ULONG> &mDone;
+    ULONG mSegment;
+
+public:
+    WaitRingCmd(GLRing &ring, std::atomic<ULONG> &done, ULONG segment)
+      : mRing(ring), mDone(done), mSegment(segment)
+    { }
+    void execute()
+    {
+        while(mRing.done <= mSegment && mRing.done < mRing.fenced)
+        {
+            GLsync &fence = mRing.fences[mRing.done%RING_SEGMENTS];
+            GLenum ret = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, ~GLuint64(0));
+            if(ret == GL_WAIT_FAILED)
+                ERR("Failed to wait on ring fence\n");
+            glDeleteSync(fence);
+            fence = 0;
+            ++mRing.done;
+        }
+        mDone.store(mRing.done);
+    }
+
+    // Only mapped rings are fenced, and they aren't used while capturing.
+    void capture(CommandCapture&) const
+    { }
+    static void replay(CaptureReader&, CaptureReplay&)
+    { }
+};
+DEFINE_COMMAND(WaitRingCmd)
+
+// Writes data to an unmapped ring, orphaning its storage first when starting
+// over at the beginning.
+class StreamRingDataCmd : public Command {
+    GLuint mBuffer;
+    GLsizeiptr mOrphanSize;
+    GLintptr mOffset;
+    GLsizeiptr mSize;
+
+    GLubyte *getData() { return reinterpret_cast<GLubyte*>(this+1); }
+    const GLubyte *getData() const { return reinterpret_cast<const GLubyte*>(this+1); }
+
+public:
+    StreamRingDataCmd(GLuint buffer, GLsizeiptr orphan_size, GLintptr offset, const void *data, GLsizeiptr size)
+      : mBuffer(buffer), mOrphanSize(orphan_size), mOffset(offset), mSize(size)
+    { memcpy(getData(), data, mSize); }
+
+    void execute()
+    {
+        if(mOrphanSize)
+            glNamedBufferDataEXT(mBuffer, mOrphanSize, nullptr, GL_STREAM_DRAW);
+        glNamedBufferSubDataEXT(mBuffer, mOffset, mSize, getData());
+        checkGLError();
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Buffer, mBuffer);
+        capture.write<LONGLONG>(mOrphanSize);
+        capture.write<LONGLONG>(mOffset);
+        capture.writeData(getData(), mSize);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        ULONG id = reader.read<ULONG>();
+        LONGLONG orphan_size = reader.read<LONGLONG>();
+        LONGLONG offset = reader.read<LONGLONG>();
+        size_t size;
+        const void *data = reader.readData(size);
+        if(data)
+            replay.sendPayload<StreamRingDataCmd>(size, replay.getName(id), (GLsizeiptr)orphan_size,
+                                                  (GLintptr)offset, data, (GLsizeiptr)size);
+    }
+};
+DEFINE_COMMAND(StreamRingDataCmd)
+
+
+template<typename T, typename ...Args>
+void D3DGLDevice::sendState(UINT slot, Args...args)
+{
+    PendingState &pending = mPendingStates[slot];
+    ULONG epoch = mStateEpoch.load();
+    if(pending.mEpoch == epoch && mQueue.skip(pending.mHandle))
+        ++mSkippedStates;
+    pending.mHandle = mQueue.doSendSkippable<T,Args...>(args...);
+    pending.mEpoch = epoch;
+}
+
+// Set calls skip sending GL state that's already set, so the GL state has to
+// be brought in line with the defaults here. Caller is responsible for holding
+// the mQueue lock.
+void D3DGLDevice::resetStates(bool zenable)
+{
+    std::copy(DefaultRSValues.begin(), DefaultRSValues.end(), mRenderState.begin());
+    mRenderState[D3DRS_ZENABLE] = zenable ? D3DZB_TRUE : D3DZB_FALSE;
+    mRenderState[D3DRS_POINTSIZE_MAX] = float_to_dword(mAdapter.getLimits().pointsize_max);
+    for(UINT group = 0;group < RSGroupStates.size();++group)
+        mDirtyEntries[group] = (1u<<RSGroupStates[group].size()) - 1;
+    mDirtyEntries[StateGroup_Viewport] = ViewportEntry_Viewport | ViewportEntry_Scissor;
+
+    for(DWORD sampler = 0;sampler < mSamplerState.size();++sampler)
+    {
+        auto &ss = mSamplerState[sampler];
+        std::copy(DefaultSSValues.begin(), DefaultSSValues.end(), ss.begin());
+    }
+    mDirtySamplers = (1u<<mSamplerState.size()) - 1;
+    mDirtyGroups = (1u<<StateGroup_Count) - 1;
+
+    for(size_t i = 0;i < mTexStageState.size();++i)
+    {
+        auto &tss = mTexStageState[i];
+        std::copy(DefaultTSSValues.begin(), DefaultTSSValues.end(), tss.begin());
+        tss[D3DTSS_COLOROP] = i ? D3DTOP_DISABLE : D3DTOP_MODULATE;
+        tss[D3DTSS_ALPHAOP] = i ? D3DTOP_DISABLE : D3DTOP_SELECTARG1;
+        tss[D3DTSS_TEXCOORDINDEX] = i;
+    }
+
+    // The default material is all zeros, unlike GL's.
+    memset(&mMaterial, 0, sizeof(mMaterial));
+    sendState<MaterialSet>(StateSlot_Material, mMaterial);
+}
+
+bool D3DGLDevice::markRenderState(D3DRENDERSTATETYPE state)
+{
+    if(state >= RSGroupEntries.size() || !RSGroupEntries[state].mMask)
+        return false;
+    const RSGroupEntry &entry = RSGroupEntries[state];
+    mDirtyEntries[entry.mGroup] |= entry.mMask;
+    mDirtyGroups |= 1<<entry.mGroup;
+    return true;
+}
+
+// Returns true for sampler states that are part of the GL sampler.
+static bool IsGLSamplerState(D3DSAMPLERSTATETYPE type)
+{
+    switch(type)
+    {
+        case D3DSAMP_ADDRESSU:
+        case D3DSAMP_ADDRESSV:
+        case D3DSAMP_ADDRESSW:
+        case D3DSAMP_BORDERCOLOR:
+        case D3DSAMP_MAGFILTER:
+        case D3DSAMP_MINFILTER:
+        case D3DSAMP_MIPFILTER:
+        case D3DSAMP_MIPMAPLODBIAS:
+        case D3DSAMP_MAXMIPLEVEL:
+        case D3DSAMP_MAXANISOTROPY:
+        case D3DSAMP_SRGBTEXTURE:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+bool D3DGLDevice::markSamplerState(DWORD sampler, D3DSAMPLERSTATETYPE type)
+{
+    if(!IsGLSamplerState(type))
+        return false;
+    markSampler(sampler);
+    return true;
+}
+
+size_t SamplerKeyHash::operator()(const SamplerKey &key) const
+{
+    size_t hash = key.mShadow;
+    for(DWORD value : key.mStates)
+        hash = hash*31 + value;
+    return hash;
+}
+
+size_t VertexArrayKeyHash::operator()(const VertexArrayKey &key) const
+{
+    size_t hash = key.mNumAttribs;
+    for(GLuint i = 0;i < key.mNumAttribs;++i)
+    {
+        const GLVertexAttrib &attrib = key.mAttribs[i];
+        hash = hash*31 + attrib.mTarget;
+        hash = hash*31 + attrib.mBinding;
+        hash = hash*31 + attrib.mGLType;
+        hash = hash*31 + attrib.mGLCount;
+        hash = hash*31 + attrib.mNormalize;
+        hash = hash*31 + attrib.mOffset;
+    }
+    return hash;
+}
+
+UINT D3DGLDevice::getSamplerSlot(CommandPacket &packet, const SamplerKey &key)
+{
+    ULONG use = ++mSamplerUseCount;
+    auto iter = mSamplerCache.find(key);
+    if(iter != mSamplerCache.end())
+    {
+        mSamplerSlots[iter->second].mLastUse = use;
+        return iter->second;
+    }
+
+    UINT slot = mSamplerCache.size();
+    if(slot >= mSamplerSlots.size())
+    {
+        // There are more slots than stages, so one is always unbound.
+        ULONG age = 0;
+        for(UINT i = 0;i < mSamplerSlots.size();++i)
+        {
+            if(!mSamplerSlots[i].mStages && use-mSamplerSlots[i].mLastUse >= age)
+            {
+                age = use - mSamplerSlots[i].mLastUse;
+                slot = i;
+            }
+        }
+        mSamplerCache.erase(mSamplerSlots[slot].mKey);
+    }
+
+    mSamplerSlots[slot].mKey = key;
+    mSamplerSlots[slot].mLastUse = use;
+    mSamplerSlots[slot].mStages = 0;
+    mSamplerCache.insert(std::make_pair(key, slot));
+    packet.add<InitSamplerCmd>(make_ref(mGLState), slot, key);
+    return slot;
+}
+
+void D3DGLDevice::addSampler(CommandPacket &packet, DWORD sampler)
+{
+    SamplerKey key;
+    std::copy(mSamplerState[sampler].begin(), mSamplerState[sampler].end(), key.mStates.begin());
+    // Clear what doesn't affect the GL sampler, so equivalent states share it.
+    key.mStates[0] = 0;
+    key.mStates[D3DSAMP_ELEMENTINDEX] = 0;
+    key.mStates[D3DSAMP_DMAPOFFSET] = 0;
+    if(key.mStates[D3DSAMP_MINFILTER] != D3DTEXF_ANISOTROPIC &&
+       key.mStates[D3DSAMP_MAGFILTER] != D3DTEXF_ANISOTROPIC)
+        key.mStates[D3DSAMP_MAXANISOTROPY] = 1;
+    key.mShadow = (mShadowSamplers&(1<<sampler)) != 0;
+
+    UINT slot = getSamplerSlot(packet, key);
+    UINT oldslot = mStageSamplers[sampler];
+    if(slot == oldslot)
+        return;
+    if(oldslot < mSamplerSlots.size())
+        mSamplerSlots[oldslot].mStages &= ~(1<<sampler);
+    mSamplerSlots[slot].mStages |= 1<<sampler;
+    mStageSamplers[sampler] = slot;
+    packet.add<BindSamplerCmd>(make_ref(mGLState), sampler, slot);
+}
+
+void D3DGLDevice::addStates(CommandPacket &packet, const DWORD *entries, DWORD samplers)
+{
+    for(UINT group = 0;group < RSGroupStates.size();++group)
+    {
+        DWORD mask = entries[group];
+        for(UINT i = 0;mask;++i,mask >>= 1)
+        {
+            if((mask&1))
+                addRenderState(packet, RSGroupStates[group][i]);
+        }
+    }
+
+    DWORD mask = entries[StateGroup_Viewport];
+    if((mask&ViewportEntry_Viewport))
+        packet.add<ViewportSet>(mViewport.X, mViewport.Y,
+            std::min(mViewport.Width, 0x7ffffffful), std::min(mViewport.Height, 0x7ffffffful),
+            mViewport.MinZ, mViewport.MaxZ
+        );
+    if((mask&ViewportEntry_Scissor))
+        packet.add<ScissorRectSet>(make_ref(mGLState), mScissorRect);
+
+    for(DWORD sampler = 0;samplers;++sampler,samplers >>= 1)
+    {
+        if((samplers&1))
+            addSampler(packet, sampler);
+    }
+}
+
+void D3DGLDevice::nextRingSegment(StreamRing &ring)
+{
+    // An unmapped ring is orphaned instead when it wraps around, so it
+    // doesn't need fences.
+    if(ring.mData)
+        mQueue.doSend<FenceRingCmd>(make_ref(ring.mGLRing), make_ref(ring.mDone), ring.mSegment);
+    ++ring.mSegment;
+    ring.mPos = (ring.mSegment%RING_SEGMENTS) * (ring.mSize/RING_SEGMENTS);
+
+    // Wait for the GPU to finish with the last use of this segment.
+    if(ring.mData && ring.mSegment >= RING_SEGMENTS)
+    {
+        ULONG last = ring.mSegment - RING_SEGMENTS;
+        if(ring.mDone.load() <= last)
+        {
+            TRACE("Waiting for ring %p segment %lu\n", &ring, last);
+            mQueue.sendSync<WaitRingCmd>(make_ref(ring.mGLRing), make_ref(ring.mDone), last);
+        }
+    }
+}
+
+void D3DGLDevice::reserveVertexRing(UINT size)
+{
+    if(mVertexRing.mPos+size > mVertexRing.segmentEnd())
+        nextRingSegment(mVertexRing);
+}
+
+UINT D3DGLDevice::writeVertexRing(const void *data, UINT size, UINT align)
+{
+    UINT pos = (mVertexRing.mPos+align-1) / align * align;
+    if(mVertexRing.mData)
+        memcpy(mVertexRing.mData+pos, data, size);
+    else
+    {
+        // A segment can hold more than fits in one command, so it's sent in
+        // pieces. Only the first piece of a new pass orphans the storage.
+        GLsizeiptr orphan_size = (mVertexRing.mPos == 0) ? mVertexRing.mSize : 0;
+        const GLubyte *src = reinterpret_cast<const GLubyte*>(data);
+        for(UINT offset = 0;offset < size;)
+        {
+            UINT todo = std::min<UINT>(size-offset, CommandQueue::sMaxPayloadSize);
+            mQueue.doSendPayload<StreamRingDataCmd>(todo, mGLState.vertex_ring.buffer,
+                                                    orphan_size, pos+offset, src+offset, todo);
+            orphan_size = 0;
+            offset += todo;
+        }
+    }
+    mVertexRing.mPos = pos + size;
+    return pos;
+}
+
+bool D3DGLDevice::uploadUserData(D3DGLBufferObject *&buffer, D3DFORMAT idxformat, const void *data, UINT size)
+{
+    if(!buffer)
+    {
+        buffer = new D3DGLBufferObject(this);
+        bool ok = (idxformat == D3DFMT_UNKNOWN) ?
+                  buffer->init_vbo(size, D3DUSAGE_WRITEONLY, 0, D3DPOOL_DEFAULT) :
+                  buffer->init_ibo(size, D3DUSAGE_WRITEONLY, idxformat, D3DPOOL_DEFAULT);
+        if(!ok)
+        {
+            ERR("Failed to initialize user data storage\n");
+            delete buffer;
+            buffer = nullptr;
+            return false;
+        }
+    }
+    buffer->resetBufferData(reinterpret_cast<const GLubyte*>(data), size);
+    return true;
+}
+
+void D3DGLDevice::DrawBatch::flush()
+{
+    if(mNumDraws == 1)
+        mDevice->mQueue.doSend<DrawGLElementsCmd>(make_ref(mDevice->mGLState),
+            mMode, mCounts[0], mType, mPointers[0], 1/*num_instances*/, mBaseVertices[0]
+        );
+    else
+        mDevice->mQueue.doSendPayload<MultiDrawGLElementsCmd>(
+            MultiDrawGLElementsCmd::getPayloadSize(mNumDraws), make_ref(mDevice->mGLState),
+            mMode, mType, mNumDraws, mPointers.data(), mCounts.data(), mBaseVertices.data()
+        );
+    mNumDraws = 0;
+}
+
+void D3DGLDevice::batchDraw(GLenum mode, GLsizei count, GLenum type, GLubyte *pointer, GLint basevtx)
+{
+    // Anything sent since the last draw would have flushed the batch, so
+    // if it's still deferred, only the draw parameters can differ.
+    DeferredCommands *deferred = mQueue.takeDeferred();
+    if(deferred != &mDrawBatch || mDrawBatch.mMode != mode || mDrawBatch.mType != type ||
+       mDrawBatch.mNumDraws >= MAX_BATCHED_DRAWS)
+    {
+        if(deferred)
+            deferred->flush();
+        mDrawBatch.mMode = mode;
+        mDrawBatch.mType = type;
+    }
+    UINT idx = mDrawBatch.mNumDraws++;
+    mDrawBatch.mCounts[idx] = count;
+    mDrawBatch.mPointers[idx] = pointer;
+    mDrawBatch.mBaseVertices[idx] = basevtx;
+    mQueue.defer(&mDrawBatch);
+}
+
+void D3DGLDevice::nextConstantRingSegment()
+{
+    nextRingSegment(mConstantRing);
+
+    // Write all the constants to the new segment, so no draws after the
+    // fence read from the old one.
+    mVSDirtyConstantsF.add(0, mVSConstantsF.size());
+    mVSDirtyConstantsI.add(0, mVSConstantsI.size());
+    mVSDirtyConstantsB.add(0, 1);
+    mPSDirtyConstantsF.add(0, mPSConstantsF.size());
+    mPSDirtyConstantsI.add(0, mPSConstantsI.size());
+    mPSDirtyConstantsB.add(0, 1);
+}
+
+void D3DGLDevice::doSendDirtyConstants()
+{
+    // Each constant buffer, with registers being 16 bytes.
+    struct ConstantBuffer {
+        ConstantRange &mDirty;
+        const GLubyte *mData;
+        UINT mSize;
+        GLuint mBuffer;
+        GLuint mBinding;
+    };
+    const std::array<ConstantBuffer,6> buffers{{
+        { mVSDirtyConstantsF, (const GLubyte*)mVSConstantsF.data(), sizeof(mVSConstantsF),
+          mGLState.vs_uniform_bufferf, VSF_BINDING_IDX },
+        { mVSDirtyConstantsI, (const GLubyte*)mVSConstantsI.data(), sizeof(mVSConstantsI),
+          mGLState.vs_uniform_bufferi, VSI_BINDING_IDX },
+        { mVSDirtyConstantsB, (const GLubyte*)mVSConstantsB.data(), sizeof(mVSConstantsB),
+          mGLState.vs_uniform_bufferb, VSB_BINDING_IDX },
+        { mPSDirtyConstantsF, (const GLubyte*)mPSConstantsF.data(), sizeof(mPSConstantsF),
+          mGLState.ps_uniform_bufferf, PSF_BINDING_IDX },
+        { mPSDirtyConstantsI, (const GLubyte*)mPSConstantsI.data(), sizeof(mPSConstantsI),
+          mGLState.ps_uniform_bufferi, PSI_BINDING_IDX },
+        { mPSDirtyConstantsB, (const GLubyte*)mPSConstantsB.data(), sizeof(mPSConstantsB),
+          mGLState.ps_uniform_bufferb, PSB_BINDING_IDX },
+    }};
+
+    if(mConstantRing.mData)
+    {
+        UINT size = 0;
+        for(const ConstantBuffer &buffer : buffers)
+        {
+            if(!buffer.mDirty.empty())
+                size += (buffer.mSize+mConstantRingAlign-1) & ~(mConstantRingAlign-1);
+        }
+        if(mConstantRing.mPos+size > mConstantRing.segmentEnd())
+            nextConstantRingSegment();
+
+        for(const ConstantBuffer &buffer : buffers)
+        {
+            if(buffer.mDirty.empty())
+                continue;
+            memcpy(mConstantRing.mData+mConstantRing.mPos, buffer.mData, buffer.mSize);
+            mQueue.doSend<BindBufferRangeCmd>(buffer.mBinding, mGLState.constant_ring.buffer,
+                mConstantRing.mPos, buffer.mSize
+            );
+            mConstantRing.mPos += (buffer.mSize+mConstantRingAlign-1) & ~(mConstantRingAlign-1);
+            buffer.mDirty.clear();
+        }
+        return;
+    }
+
+    for(const ConstantBuffer &buffer : buffers)
+    {
+        if(buffer.mDirty.empty())
+            continue;
+        UINT start = buffer.mDirty.mBegin;
+        UINT count = buffer.mDirty.mEnd - start;
+        mQueue.doSendPayload<SetBufferValue4fv>(SetBufferValue4fv::getPayloadSize(count),
+            buffer.mBuffer, start*sizeof(Vector4f),
+            (const float*)(buffer.mData + start*sizeof(Vector4f)), count
+        );
+        buffer.mDirty.clear();
+    }
+}
+
+void D3DGLDevice::doSendDirtyStates()
+{
+    mStatePacket.clear();
+    addStates(mStatePacket, mDirtyEntries.data(), mDirtySamplers);
+    mDirtyEntries.fill(0);
+    mDirtySamplers = 0;
+    mDirtyGroups = 0;
+
+    if(!mStatePacket.empty())
+        mQueue.doSendPayload<ApplyStateCmd>(mStatePacket.size(), make_ref(mStatePacket));
+}
+
+void D3DGLDevice::captureStateBlock(D3DGLStateBlock *block)
+{
+    mQueue.lock();
+    for(UINT i = 0;i < mRenderState.size();++i)
+    {
+        if(block->mRenderStateMask[i])
+            block->mRenderState[i] = mRenderState[i];
+    }
+    for(DWORD sampler = 0;sampler < mSamplerState.size();++sampler)
+    {
+        DWORD mask = block->mSamplerStateMask[sampler];
+        for(UINT type = 0;mask;++type,mask >>= 1)
+        {
+            if((mask&1))
+                block->mSamplerState[sampler][type] = mSamplerState[sampler][type];
+        }
+    }
+    for(DWORD stage = 0;stage < mTexStageState.size();++stage)
+    {
+        DWORD mask = block->mTexStageStateMask[stage];
+        for(UINT type = 0;mask;++type,mask >>= 1)
+        {
+            if((mask&1))
+                block->mTexStageState[stage][type] = mTexStageState[stage][type];
+        }
+    }
+    if(block->mHasViewport)
+        block->mViewport = mViewport;
+    if(block->mHasScissorRect)
+        block->mScissorRect = mScissorRect;
+    if(block->mHasMaterial)
+        block->mMaterial = mMaterial;
+    for(UINT i = 0;i < mVSConstantsF.size();++i)
+    {
+        if(block->mVSConstantFMask[i])
+            block->mVSConstantsF[i] = mVSConstantsF[i];
+    }
+    for(UINT i = 0;i < mPSConstantsF.size();++i)
+    {
+        if(block->mPSConstantFMask[i])
+            block->mPSConstantsF[i] = mPSConstantsF[i];
+    }
+    for(UINT i = 0;i < mVSConstantsI.size();++i)
+    {
+        if((block->mVSConstantIMask&(1<<i)))
+            block->mVSConstantsI[i] = mVSConstantsI[i];
+        if((block->mPSConstantIMask&(1<<i)))
+            block->mPSConstantsI[i] = mPSConstantsI[i];
+    }
+    block->mVSConstantsB = mVSConstantsB[0] & block->mVSConstantBMask;
+    block->mPSConstantsB = mPSConstantsB[0] & block->mPSConstantBMask;
+    for(UINT i = 0;i < mStreams.size();++i)
+    {
+        if((block->mStreamFreqMask&(1<<i)))
+            block->mStreamFreqs[i] = mStreams[i].mFreq;
+    }
+    block->mPacketValid = false;
+    mQueue.unlock();
+}
+
+// Builds the GL state packet for a block's values, which must have just been
+// copied to the device. An entry goes in the packet only when every state it's
+// built from is held by the block. Caller is responsible for holding the
+// mQueue lock.
+void D3DGLDevice::buildStateBlockPacket(D3DGLStateBlock *block)
+{
+    std::array<DWORD,StateGroup_Samplers> held{{0}};
+    std::array<DWORD,StateGroup_Samplers> missing{{0}};
+    for(UINT i = 0;i < RSGroupEntries.size();++i)
+    {
+        const RSGroupEntry &entry = RSGroupEntries[i];
+        if(!entry.mMask)
+            continue;
+        if(block->mRenderStateMask[i])
+            held[entry.mGroup] |= entry.mMask;
+        else
+            missing[entry.mGroup] |= entry.mMask;
+    }
+    // The depth bias is scaled for the current depth-stencil buffer.
+    missing[StateGroup_DepthStencil] |= RSGroupEntries[D3DRS_DEPTHBIAS].mMask;
+    held[StateGroup_Viewport] = (block->mHasViewport ? ViewportEntry_Viewport : 0) |
+                                (block->mHasScissorRect ? ViewportEntry_Scissor : 0);
+    for(UINT group = 0;group < held.size();++group)
+    {
+        block->mPacketEntries[group] = held[group] & ~missing[group];
+        block->mMarkEntries[group] = held[group] & missing[group];
+    }
+
+    // Sampler bindings depend on the bound textures, so they're only marked.
+    block->mMarkSamplers = 0;
+    for(DWORD sampler = 0;sampler < mSamplerState.size();++sampler)
+    {
+        for(UINT type = 0;type < mSamplerState[sampler].size();++type)
+        {
+            if((block->mSamplerStateMask[sampler]&(1<<type)) &&
+               IsGLSamplerState((D3DSAMPLERSTATETYPE)type))
+                block->mMarkSamplers |= 1<<sampler;
+        }
+    }
+
+    block->mPacket.clear();
+    addStates(block->mPacket, block->mPacketEntries.data(), 0);
+    block->mPacketValid = true;
+}
+
+void D3DGLDevice::applyStateBlock(D3DGLStateBlock *block)
+{
+    mQueue.lock();
+    for(UINT i = 0;i < mRenderState.size();++i)
+    {
+        if(block->mRenderStateMask[i])
+            mRenderState[i] = block->mRenderState[i];
+    }
+    for(DWORD sampler = 0;sampler < mSamplerState.size();++sampler)
+    {
+        DWORD mask = block->mSamplerStateMask[sampler];
+        for(UINT type = 0;mask;++type,mask >>= 1)
+        {
+            if((mask&1))
+                mSamplerState[sampler][type] = block->mSamplerState[sampler][type];
+        }
+    }
+    for(DWORD stage = 0;stage < mTexStageState.size();++stage)
+    {
+        DWORD mask = block->mTexStageStateMask[stage];
+        for(UINT type = 0;mask;++type,mask >>= 1)
+        {
+            if((mask&1))
+                mTexStageState[stage][type] = block->mTexStageState[stage][type];
+        }
+    }
+    if(block->mHasViewport)
+    {
+        mViewport = block->mViewport;
+        resetProjectionFixup(mViewport.Width, mViewport.Height);
+    }
+    if(block->mHasScissorRect)
+        mScissorRect = block->mScissorRect;
+    if(block->mHasMaterial)
+    {
+        mMaterial = block->mMaterial;
+        sendState<MaterialSet>(StateSlot_Material, mMaterial);
+    }
+    for(UINT i = 0;i < mVSConstantsF.size();++i)
+    {
+        if(block->mVSConstantFMask[i])
+        {
+            mVSConstantsF[i] = block->mVSConstantsF[i];
+            mVSDirtyConstantsF.add(i, 1);
+        }
+    }
+    for(UINT i = 0;i < mPSConstantsF.size();++i)
+    {
+        if(block->mPSConstantFMask[i])
+        {
+            mPSConstantsF[i] = block->mPSConstantsF[i];
+            mPSDirtyConstantsF.add(i, 1);
+        }
+    }
+    for(UINT i = 0;i < mVSConstantsI.size();++i)
+    {
+        if((block->mVSConstantIMask&(1<<i)))
+        {
+            mVSConstantsI[i] = block->mVSConstantsI[i];
+            mVSDirtyConstantsI.add(i, 1);
+        }
+        if((block->mPSConstantIMask&(1<<i)))
+        {
+            mPSConstantsI[i] = block->mPSConstantsI[i];
+            mPSDirtyConstantsI.add(i, 1);
+        }
+    }
+    if(block->mVSConstantBMask)
+    {
+        mVSConstantsB[0] = (mVSConstantsB[0]&~block->mVSConstantBMask) | block->mVSConstantsB;
+        mVSDirtyConstantsB.add(0, 1);
+    }
+    if(block->mPSConstantBMask)
+    {
+        mPSConstantsB[0] = (mPSConstantsB[0]&~block->mPSConstantBMask) | block->mPSConstantsB;
+        mPSDirtyConstantsB.add(0, 1);
+    }
+    for(UINT i = 0;i < mStreams.size();++i)
+    {
+        if((block->mStreamFreqMask&(1<<i)))
+            mStreams[i].mFreq = block->mStreamFreqs[i];
+    }
 
-    glBindProgramPipeline(0);
-    glDeleteProgramPipelines(1, &mGLState.pipeline);
+    if(!block->mPacketValid)
+        buildStateBlockPacket(block);
 
-    for(size_t i = 0;i < mGLState.samplers.size();++i)
-        glBindSampler(i, 0);
-    glDeleteSamplers(mGLState.samplers.size(), mGLState.samplers.data());
+    // The packet sets its entries now, so they no longer need sending with
+    // the next draw. The rest are built from the device state as usual.
+    for(UINT group = 0;group < mDirtyEntries.size();++group)
+    {
+        mDirtyEntries[group] &= ~block->mPacketEntries[group];
+        if(block->mMarkEntries[group])
+        {
+            mDirtyEntries[group] |= block->mMarkEntries[group];
+            mDirtyGroups |= 1<<group;
+        }
+    }
+    if(block->mMarkSamplers)
+    {
+        mDirtySamplers |= block->mMarkSamplers;
+        mDirtyGroups |= 1<<StateGroup_Samplers;
+    }
 
-    wglMakeCurrent(nullptr, nullptr);
+    if(!block->mPacket.empty())
+        mQueue.doSendPayload<ApplyStateCmd>(block->mPacket.size(), make_ref(block->mPacket));
+    mQueue.unlock();
 }
-class DeinitGLDeviceCmd : public Command {
-    D3DGLDevice *mTarget;
 
-public:
-    DeinitGLDeviceCmd(D3DGLDevice *target) : mTarget(target) { }
-    virtual ULONG execute()
-    {
-        mTarget->deinitGL();
-        return sizeof(*this);
-    }
-};
+void D3DGLDevice::endFrame()
+{
+    mQueue.lock();
+    endStateEpoch();
+    if(mSkippedStates > 0)
+        TRACE("Skipped %lu superseded state commands this frame\n", mSkippedStates);
+    mSkippedStates = 0;
+    mQueue.unlock();
+}
 
 
 D3DGLDevice::D3DGLDevice(Direct3DGL *parent, const D3DAdapter &adapter, HWND window, DWORD flags)
@@ -1388,17 +3343,39 @@ D3DGLDevice::D3DGLDevice(Direct3DGL *parent, const D3DAdapter &adapter, HWND win
   , mInScene(false)
   , mVSConstantsF{0.0f}
   , mPSConstantsF{0.0f}
+  , mVSConstantsI{}
+  , mPSConstantsI{}
+  , mVSConstantsB{}
+  , mPSConstantsB{}
+  , mConstantRing(mGLState.constant_ring, CONSTANT_RING_SIZE)
+  , mConstantRingAlign(16)
+  , mVertexRing(mGLState.vertex_ring, VERTEX_RING_SIZE)
   , mVertexShader(nullptr)
   , mPixelShader(nullptr)
   , mVertexDecl(nullptr)
   , mIndexBuffer(nullptr)
   , mPrimitiveUserData(nullptr)
+  , mPrimitiveUserIndices(nullptr)
   , mDepthBits(0)
   , mShadowSamplers(0)
   , mNewPixelShader(false)
+  , mDrawBatch(this)
+  , mDirtyGroups(0)
+  , mDirtyEntries{{0}}
+  , mDirtySamplers(0)
+  , mSamplerUseCount(0)
+  , mCurVertexArray(MAX_VERTEX_ARRAYS)
+  , mVertexArrayUseCount(0)
+  , mStateEpoch(1)
+  , mSkippedStates(0)
+  , mRecording(nullptr)
 {
     for(auto &rt : mRenderTargets) rt = nullptr;
     for(auto &tex : mTextures) tex = nullptr;
+    mStageSamplers.fill(MAX_SAMPLER_OBJECTS);
+    for(auto &slot : mVertexArraySlots)
+        slot.mInUse = false;
+    mVertexBuffers.fill(GLVertexBuffer{0, 0, 0, 0});
     for(size_t i = 0;i < mTexStageState.size();++i)
     {
         auto &tss = mTexStageState[i];
@@ -1419,6 +3396,8 @@ D3DGLDevice::~D3DGLDevice()
 {
     delete mPrimitiveUserData;
     mPrimitiveUserData = nullptr;
+    delete mPrimitiveUserIndices;
+    mPrimitiveUserIndices = nullptr;
 
     for(auto &stream : mStreams)
     {
@@ -1491,7 +3470,17 @@ bool D3DGLDevice::init(D3DPRESENT_PARAMETERS *params)
         }
     }
 
-    if(!mQueue.init())
+    // Only single-threaded devices can execute commands directly, since the
+    // GL context stays current on the thread that created the device.
+    bool direct = false;
+    if(QueueDirect)
+    {
+        if((mFlags&D3DCREATE_MULTITHREADED))
+            WARN("Not using direct command execution with a multithreaded device\n");
+        else
+            direct = true;
+    }
+    if(!mQueue.init(direct))
         return false;
 
     std::vector<std::array<int,2>> glattrs;
@@ -1540,13 +3529,13 @@ bool D3DGLDevice::init(D3DPRESENT_PARAMETERS *params)
         return false;
     }
 
-    mQueue.sendSync<InitGLDeviceCmd>(this, mGLDeviceCtx, mGLContext);
+    mQueue.sendSync<InitGLDeviceCmd>(this, mGLDeviceCtx, mGLContext, make_ref(*params));
 
     return SUCCEEDED(Reset(params));
 }
 
 
-HRESULT D3DGLDevice::sendVtxData(INT startvtx, const StreamSource *sources, UINT num_sources)
+HRESULT D3DGLDevice::sendVtxData(const StreamSource *sources, UINT num_sources)
 {
     D3DGLVertexShader *vshader = mVertexShader;
     if(!vshader)
@@ -1558,8 +3547,8 @@ HRESULT D3DGLDevice::sendVtxData(INT startvtx, const StreamSource *sources, UINT
     /* Wait for the vertex shader to finish building if it's in the process of
      * doing so. We need its UsageMap to set the proper vertex attributes.
      */
-    while(vshader->checkShadowSamplers(mShadowSamplers),vshader->getPendingUpdates() > 0)
-        mQueue.wakeAndSleep();
+    vshader->checkShadowSamplers(mShadowSamplers);
+    mQueue.waitFor(vshader->getCompileSeq());
 
     if(D3DGLPixelShader *pshader = mPixelShader)
         pshader->setProgram(mGLState.pipeline, mShadowSamplers, mNewPixelShader.exchange(false));
@@ -1571,13 +3560,14 @@ HRESULT D3DGLDevice::sendVtxData(INT startvtx, const StreamSource *sources, UINT
         return D3DERR_INVALIDCALL;
     }
 
-    std::array<GLStreamData,16> streams;
+    VertexArrayKey key;
+    auto &attribs = key.mAttribs;
     GLuint cur = 0;
+    UINT streams = 0;
 
-    UINT attribs = 0;
     for(const D3DGLVERTEXELEMENT &elem : vtxdecl->getVtxElements())
     {
-        if(cur >= streams.size())
+        if(cur >= attribs.size())
         {
             ERR("Too many vertex elements!\n");
             return D3DERR_INVALIDCALL;
@@ -1589,37 +3579,116 @@ HRESULT D3DGLDevice::sendVtxData(INT startvtx, const StreamSource *sources, UINT
             return D3DERR_INVALIDCALL;
         }
 
-        const StreamSource &source = sources[elem.Stream];
-        D3DGLBufferObject *buffer = source.mBuffer;
-
-        GLint offset = elem.Offset + source.mOffset + source.mStride*startvtx;
-        streams[cur].mBufferId = buffer->getBufferId();
-        streams[cur].mPointer = ((GLubyte*)0) + offset;
-        streams[cur].mGLCount = elem.mGLCount;
-        streams[cur].mGLType = elem.mGLType;
-        streams[cur].mNormalize = elem.mNormalize;
-        streams[cur].mStride = source.mStride;
-        streams[cur].mDivisor = 0;
-        if((source.mFreq&D3DSTREAMSOURCE_INSTANCEDATA))
-            streams[cur].mDivisor = (source.mFreq&0x3fffffff);
-
-        streams[cur].mTarget = vshader->getLocation(elem.Usage, elem.UsageIndex);
-        if(streams[cur].mTarget == -1)
+        attribs[cur].mTarget = vshader->getLocation(elem.Usage, elem.UsageIndex);
+        if(attribs[cur].mTarget == -1)
         {
             TRACE("Skipping element (usage 0x%02x, index %u, vshader %p)\n",
                   elem.Usage, elem.UsageIndex, vshader);
             continue;
         }
-        attribs |= 1<<streams[cur].mTarget;
+        attribs[cur].mBinding = elem.Stream;
+        attribs[cur].mGLType = elem.mGLType;
+        attribs[cur].mGLCount = elem.mGLCount;
+        attribs[cur].mNormalize = elem.mNormalize;
+        attribs[cur].mOffset = elem.Offset;
+        streams |= 1<<elem.Stream;
         ++cur;
     }
+    key.mNumAttribs = cur;
+
+    // Send the buffers for the streams that are read, if they changed since
+    // they were last sent.
+    UINT first = MAX_STREAMS, last = 0;
+    for(UINT i = 0;streams;++i,streams >>= 1)
+    {
+        if(!(streams&1))
+            continue;
+
+        const StreamSource &source = sources[i];
+        GLVertexBuffer buffer;
+        buffer.mBufferId = source.mBuffer ? source.mBuffer->getBufferId() : source.mBufferId;
+        buffer.mOffset = source.mOffset;
+        buffer.mStride = source.mStride;
+        buffer.mDivisor = 0;
+        if((source.mFreq&D3DSTREAMSOURCE_INSTANCEDATA))
+            buffer.mDivisor = (source.mFreq&0x3fffffff);
+        if(mVertexBuffers[i] != buffer)
+        {
+            mVertexBuffers[i] = buffer;
+            first = std::min(first, i);
+            last = i;
+        }
+    }
+    bool newbuffers = (first <= last);
+    if(newbuffers)
+        mQueue.doSendPayload<SetVertexBuffersCmd>(SetVertexBuffersCmd::getPayloadSize(last-first+1),
+            make_ref(mGLState), first, last-first+1, &mVertexBuffers[first]
+        );
+
+    ULONG use = ++mVertexArrayUseCount;
+    if(mCurVertexArray < mVertexArraySlots.size() && mVertexArraySlots[mCurVertexArray].mKey == key)
+    {
+        mVertexArraySlots[mCurVertexArray].mLastUse = use;
+        if(newbuffers)
+            mQueue.doSend<BindVertexArrayCmd>(make_ref(mGLState), mCurVertexArray);
+        return D3D_OK;
+    }
+
+    auto iter = mVertexArrayCache.find(key);
+    if(iter != mVertexArrayCache.end())
+    {
+        mCurVertexArray = iter->second;
+        mVertexArraySlots[mCurVertexArray].mLastUse = use;
+        mQueue.doSend<BindVertexArrayCmd>(make_ref(mGLState), mCurVertexArray);
+        return D3D_OK;
+    }
+
+    // Take a free slot, or else replace the least recently used one.
+    UINT slot = 0;
+    ULONG age = 0;
+    for(UINT i = 0;i < mVertexArraySlots.size();++i)
+    {
+        if(!mVertexArraySlots[i].mInUse)
+        {
+            slot = i;
+            break;
+        }
+        if(use-mVertexArraySlots[i].mLastUse >= age)
+        {
+            age = use - mVertexArraySlots[i].mLastUse;
+            slot = i;
+        }
+    }
+    if(mVertexArraySlots[slot].mInUse)
+        mVertexArrayCache.erase(mVertexArraySlots[slot].mKey);
 
-    mQueue.doSend<SetVertexAttribArrayCmd>(make_ref(mGLState), attribs);
-    mQueue.doSend<SetVtxDataCmd>(streams.data(), cur);
+    mVertexArraySlots[slot].mKey = key;
+    mVertexArraySlots[slot].mLastUse = use;
+    mVertexArraySlots[slot].mInUse = true;
+    mVertexArrayCache.insert(std::make_pair(key, slot));
+    mCurVertexArray = slot;
+    mQueue.doSend<InitVertexArrayCmd>(make_ref(mGLState), slot, key);
 
     return D3D_OK;
 }
 
+void D3DGLDevice::releaseFBAttachment(bool renderbuffer, GLuint id)
+{
+    mQueue.send<ReleaseFBAttachmentCmd>(make_ref(mGLState), renderbuffer, id);
+}
+
+void D3DGLDevice::releaseBuffer(GLuint bufferid)
+{
+    mQueue.lock();
+    for(GLVertexBuffer &buffer : mVertexBuffers)
+    {
+        if(buffer.mBufferId == bufferid)
+            buffer.mBufferId = 0;
+    }
+    mQueue.doSend<ReleaseBufferCmd>(make_ref(mGLState), bufferid);
+    mQueue.unlock();
+}
+
 void D3DGLDevice::resetProjectionFixup(UINT width, UINT height)
 {
     // OpenGL places pixel coords at the pixel's bottom-left, while D3D places
@@ -1631,7 +3700,9 @@ void D3DGLDevice::resetProjectionFixup(UINT width, UINT height)
     // shader is also responsible for flipping Y and fixing Z depth.
     float trans[4] = { 0.99f/width, 0.99f/height, 0.0f, 0.0f };
 
-    mQueue.doSend<SetBufferValue4f>(mGLState.pos_fixup_uniform_buffer, 0, trans);
+    mQueue.doSendPayload<SetBufferValue4fv>(SetBufferValue4fv::getPayloadSize(1),
+        mGLState.pos_fixup_uniform_buffer, 0, trans, 1
+    );
 }
 
 
@@ -1978,9 +4049,8 @@ HRESULT D3DGLDevice::Reset(D3DPRESENT_PARAMETERS *params)
     mViewport.MinZ = 0.0f;
     mViewport.MaxZ = 1.0f;
     resetProjectionFixup(mViewport.Width, mViewport.Height);
-
     mScissorRect = RECT{0, 0, (LONG)params->BackBufferWidth, (LONG)params->BackBufferHeight};
-    mQueue.doSend<ScissorRectSet>(mScissorRect);
+    resetStates(params->EnableAutoDepthStencil);
 
     if(mAutoDepthStencil)
         mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState),
@@ -2404,14 +4474,14 @@ HRESULT D3DGLDevice::GetRenderTargetData(IDirect3DSurface9 *rtsurface, IDirect3D
     D3DGLPlainSurface *plainsurface;
     if(SUCCEEDED(dstsurface->QueryInterface(IID_D3DGLPlainSurface, (void**)&plainsurface)))
     {
-        std::atomic<ULONG> &pendingupdates = plainsurface->getPendingUpdates();
         std::shared_ptr<GLubyte> data = plainsurface->getBufData();
         GLFormatInfo format = plainsurface->getFormat();
         RECT rect{ 0, 0, (LONG)srcdesc.Width, (LONG)srcdesc.Height };
 
-        ++pendingupdates;
-        mQueue.send<ReadFramebufferCmd>(this, src_target, src_binding, src_level, rect,
-            format.format, format.type, data, make_ref(pendingupdates)
+        plainsurface->setUpdateSeq(
+            mQueue.send<ReadFramebufferCmd>(this, src_target, src_binding, src_level, rect,
+                format.format, format.type, data
+            )
         );
 
         plainsurface->Release();
@@ -2731,10 +4801,7 @@ HRESULT D3DGLDevice::SetDepthStencilSurface(IDirect3DSurface9 *depthstencil)
         mQueue.lock();
         depthstencil = mDepthStencil.exchange(depthstencil);
         mDepthBits = 0;
-        mQueue.doSend<DepthBiasSet>(
-            dword_to_float(mRenderState[D3DRS_SLOPESCALEDEPTHBIAS]),
-            dword_to_float(mRenderState[D3DRS_DEPTHBIAS]) * (float)((1u<<mDepthBits) - 1u)
-        );
+        markRenderState(D3DRS_DEPTHBIAS);
         mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_DEPTH_STENCIL_ATTACHMENT,
                                           GL_RENDERBUFFER, 0, 0);
         mQueue.unlock();
@@ -2772,10 +4839,7 @@ HRESULT D3DGLDevice::SetDepthStencilSurface(IDirect3DSurface9 *depthstencil)
             // units that are "the smallest value that is guaranteed to produce
             // a resolvable offset").
             mDepthBits = depthbits;
-            mQueue.doSend<DepthBiasSet>(
-                dword_to_float(mRenderState[D3DRS_SLOPESCALEDEPTHBIAS]),
-                dword_to_float(mRenderState[D3DRS_DEPTHBIAS]) * (float)((1u<<mDepthBits) - 1u)
-            );
+            markRenderState(D3DRS_DEPTHBIAS);
         }
         if(attachment == GL_DEPTH_ATTACHMENT)
         {
@@ -2807,10 +4871,7 @@ HRESULT D3DGLDevice::SetDepthStencilSurface(IDirect3DSurface9 *depthstencil)
         if(depthbits != mDepthBits)
         {
             mDepthBits = depthbits;
-            mQueue.doSend<DepthBiasSet>(
-                dword_to_float(mRenderState[D3DRS_SLOPESCALEDEPTHBIAS]),
-                dword_to_float(mRenderState[D3DRS_DEPTHBIAS]) * (float)((1u<<mDepthBits) - 1u)
-            );
+            markRenderState(D3DRS_DEPTHBIAS);
         }
         if(attachment == GL_DEPTH_ATTACHMENT)
             mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_STENCIL_ATTACHMENT,
@@ -2838,10 +4899,7 @@ HRESULT D3DGLDevice::SetDepthStencilSurface(IDirect3DSurface9 *depthstencil)
         if(depthbits != mDepthBits)
         {
             mDepthBits = depthbits;
-            mQueue.doSend<DepthBiasSet>(
-                dword_to_float(mRenderState[D3DRS_SLOPESCALEDEPTHBIAS]),
-                dword_to_float(mRenderState[D3DRS_DEPTHBIAS]) * (float)((1u<<mDepthBits) - 1u)
-            );
+            markRenderState(D3DRS_DEPTHBIAS);
         }
         if(attachment == GL_DEPTH_ATTACHMENT)
             mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_STENCIL_ATTACHMENT,
@@ -2905,6 +4963,12 @@ HRESULT D3DGLDevice::Clear(DWORD count, const D3DRECT *rects, DWORD flags, D3DCO
 {
     TRACE("iface %p, count %lu, rects %p, flags 0x%lx, color 0x%08lx, depth %f, stencil 0x%lx\n", this, count, rects, flags, color, depth, stencil);
 
+    if(count && !rects)
+    {
+        WARN("Rects is NULL with count %lu, ignoring clear\n", count);
+        return D3D_OK;
+    }
+
     mQueue.lock();
     GLbitfield mask = 0;
     if((flags&D3DCLEAR_TARGET))
@@ -2932,19 +4996,72 @@ HRESULT D3DGLDevice::Clear(DWORD count, const D3DRECT *rects, DWORD flags, D3DCO
         mask |= GL_STENCIL_BUFFER_BIT;
     }
 
-    if(count == 0)
+    // Clears stay within the viewport, and the scissor rect if it's on.
+    RECT bounds;
+    bounds.left = mViewport.X;
+    bounds.top = mViewport.Y;
+    bounds.right = bounds.left + mViewport.Width;
+    bounds.bottom = bounds.top + mViewport.Height;
+    if(mRenderState[D3DRS_SCISSORTESTENABLE])
     {
-        RECT main_rect;
-        main_rect.left = mViewport.X;
-        main_rect.top = mViewport.Y;
-        main_rect.right = main_rect.left + mViewport.Width;
-        main_rect.bottom = main_rect.top + mViewport.Height;
-        mQueue.doSend<ClearCmd>(make_ref(mGLState), mask, color, depth, stencil, main_rect);
+        bounds.left = std::max(bounds.left, mScissorRect.left);
+        bounds.top = std::max(bounds.top, mScissorRect.top);
+        bounds.right = std::min(bounds.right, mScissorRect.right);
+        bounds.bottom = std::min(bounds.bottom, mScissorRect.bottom);
     }
+
+    // A clear that covers all of the cleared buffers doesn't need rects.
+    bool full = (count == 0 && bounds.left <= 0 && bounds.top <= 0);
+    D3DSURFACE_DESC desc;
+    IDirect3DSurface9 *rtarget = mRenderTargets[0];
+    if(full && (mask&GL_COLOR_BUFFER_BIT) && rtarget && SUCCEEDED(rtarget->GetDesc(&desc)))
+        full = bounds.right >= (LONG)desc.Width && bounds.bottom >= (LONG)desc.Height;
+    IDirect3DSurface9 *depthstencil = mDepthStencil;
+    if(full && (mask&(GL_DEPTH_BUFFER_BIT|GL_STENCIL_BUFFER_BIT)) && SUCCEEDED(depthstencil->GetDesc(&desc)))
+        full = bounds.right >= (LONG)desc.Width && bounds.bottom >= (LONG)desc.Height;
+
+    sendDirtyStates();
+    if(full)
+        mQueue.doSendPayload<ClearCmd>(0, make_ref(mGLState), mask, color, depth, stencil,
+                                       0, (const RECT*)nullptr);
     else
     {
-        FIXME("Rectangles not yet handled\n");
+        D3DRECT main_rect{ bounds.left, bounds.top, bounds.right, bounds.bottom };
+        if(count == 0)
+        {
+            count = 1;
+            rects = &main_rect;
+        }
+
+        // Send the rects that are left after clipping in as few commands as
+        // possible.
+        std::array<RECT,MAX_CLEAR_RECTS> cliprects;
+        GLsizei numrects = 0;
+        for(DWORD i = 0;i < count;++i)
+        {
+            RECT &rect = cliprects[numrects];
+            rect.left = std::max(rects[i].x1, bounds.left);
+            rect.top = std::max(rects[i].y1, bounds.top);
+            rect.right = std::min(rects[i].x2, bounds.right);
+            rect.bottom = std::min(rects[i].y2, bounds.bottom);
+            if(rect.left >= rect.right || rect.top >= rect.bottom)
+                continue;
+            if(++numrects == MAX_CLEAR_RECTS)
+            {
+                mQueue.doSendPayload<ClearCmd>(ClearCmd::getPayloadSize(numrects),
+                    make_ref(mGLState), mask, color, depth, stencil, numrects,
+                    (const RECT*)cliprects.data()
+                );
+                numrects = 0;
+            }
+        }
+        if(numrects > 0)
+            mQueue.doSendPayload<ClearCmd>(ClearCmd::getPayloadSize(numrects),
+                make_ref(mGLState), mask, color, depth, stencil, numrects,
+                (const RECT*)cliprects.data()
+            );
     }
+    endStateEpoch();
     mQueue.unlock();
 
     return D3D_OK;
@@ -2980,12 +5097,17 @@ HRESULT D3DGLDevice::SetViewport(const D3DVIEWPORT9 *viewport)
     }
 
     mQueue.lock();
-    mViewport = *viewport;
-    resetProjectionFixup(mViewport.Width, mViewport.Height);
-    mQueue.doSend<ViewportSet>(mViewport.X, mViewport.Y,
-        std::min(mViewport.Width, 0x7ffffffful), std::min(mViewport.Height, 0x7ffffffful),
-        mViewport.MinZ, mViewport.MaxZ
-    );
+    if(mRecording)
+    {
+        mRecording->mHasViewport = true;
+        mRecording->mViewport = *viewport;
+    }
+    else if(memcmp(&mViewport, viewport, sizeof(mViewport)) != 0)
+    {
+        mViewport = *viewport;
+        resetProjectionFixup(mViewport.Width, mViewport.Height);
+        markViewportState(ViewportEntry_Viewport);
+    }
     mQueue.unlock();
 
     return D3D_OK;
@@ -3004,8 +5126,16 @@ HRESULT D3DGLDevice::SetMaterial(const D3DMATERIAL9 *material)
 {
     TRACE("iface %p, material %p\n", this, material);
     mQueue.lock();
-    mMaterial = *material;
-    mQueue.doSend<MaterialSet>(mMaterial);
+    if(mRecording)
+    {
+        mRecording->mHasMaterial = true;
+        mRecording->mMaterial = *material;
+    }
+    else if(memcmp(&mMaterial, material, sizeof(mMaterial)) != 0)
+    {
+        mMaterial = *material;
+        sendState<MaterialSet>(StateSlot_Material, mMaterial);
+    }
     mQueue.unlock();
     return D3D_OK;
 }
@@ -3058,8 +5188,9 @@ HRESULT D3DGLDevice::SetClipPlane(DWORD index, const float *plane)
     memcpy(mClipPlane[index].ptr(), plane, sizeof(mClipPlane[index]));
     // FIXME: Clip plane needs to be set using the view matrix when no vertex
     // shader is set.
-    mQueue.doSend<SetBufferValue4f>(mGLState.vtx_state_uniform_buffer,
-        offsetof(GLVertexState, ClipPlane[index]), mClipPlane[index].ptr()
+    mQueue.doSendPayload<SetBufferValue4fv>(SetBufferValue4fv::getPayloadSize(1),
+        mGLState.vtx_state_uniform_buffer, offsetof(GLVertexState, ClipPlane[index]),
+        mClipPlane[index].ptr(), 1
     );
     mQueue.unlock();
 
@@ -3088,19 +5219,52 @@ HRESULT D3DGLDevice::SetRenderState(D3DRENDERSTATETYPE state, DWORD value)
 {
     TRACE("iface %p, state %s, value 0x%lx\n", this, d3drs_to_str(state), value);
 
+    if(state == D3DRS_ZENABLE && value == D3DZB_USEW)
+    {
+        FIXME("W-buffer not handled\n");
+        return D3DERR_INVALIDCALL;
+    }
+
     mQueue.lock();
-    auto glstate = RSStateEnableMap.find(state);
-    if(glstate != RSStateEnableMap.end())
+    if(mRecording)
     {
-        if(state == D3DRS_ZENABLE && value == D3DZB_USEW)
+        if(state < mRenderState.size())
         {
-            FIXME("W-buffer not handled\n");
-            return D3DERR_INVALIDCALL;
+            mRecording->mRenderStateMask.set(state);
+            mRecording->mRenderState[state] = value;
+        }
+        mQueue.unlock();
+        return D3D_OK;
+    }
+    if(state < mRenderState.size())
+    {
+        // Don't send anything if the state isn't changing.
+        if(mRenderState[state] == value)
+        {
+            mQueue.unlock();
+            return D3D_OK;
         }
         mRenderState[state] = value;
-        mQueue.doSend<StateEnable>(glstate->second, value!=0);
     }
-    else switch(state)
+    if(!markRenderState(state))
+        FIXME("Unhandled state %s, value 0x%lx\n", d3drs_to_str(state), value);
+    mQueue.unlock();
+
+    return D3D_OK;
+}
+
+void D3DGLDevice::addRenderState(CommandPacket &packet, D3DRENDERSTATETYPE state)
+{
+    DWORD value = mRenderState[state];
+
+    auto glstate = RSStateEnableMap.find(state);
+    if(glstate != RSStateEnableMap.end())
+    {
+        packet.add<StateEnable>(glstate->second, value!=0);
+        return;
+    }
+
+    switch(state)
     {
         case D3DRS_FILLMODE:
         {
@@ -3112,8 +5276,7 @@ HRESULT D3DGLDevice::SetRenderState(D3DRENDERSTATETYPE state, DWORD value)
             else if(value != D3DFILL_SOLID)
                 WARN("Invalid fill mode: 0x%lx\n", value);
 
-            mRenderState[state] = value;
-            mQueue.doSend<PolygonModeSet>(mode);
+            packet.add<PolygonModeSet>(mode);
             break;
         }
 
@@ -3127,141 +5290,109 @@ HRESULT D3DGLDevice::SetRenderState(D3DRENDERSTATETYPE state, DWORD value)
             else if(value != D3DCULL_NONE)
                 WARN("Unhandled cull mode: 0x%lx\n", value);
 
-            mRenderState[state] = value;
-            mQueue.doSend<CullFaceSet>(face);
+            packet.add<CullFaceSet>(face);
             break;
         }
 
+        // The scissor test is tracked for clears, so isn't in RSStateEnableMap.
+        case D3DRS_SCISSORTESTENABLE:
+            packet.add<ScissorTestSet>(make_ref(mGLState), value!=0);
+            break;
+
         case D3DRS_COLORWRITEENABLE:
+            packet.add<ColorMaskSet>(make_ref(mGLState), 0, value);
+            break;
         case D3DRS_COLORWRITEENABLE1:
         case D3DRS_COLORWRITEENABLE2:
         case D3DRS_COLORWRITEENABLE3:
-            mRenderState[state] = value;
-            mQueue.doSend<ColorMaskSet>(state-D3DRS_COLORWRITEENABLE, value);
+            packet.add<ColorMaskSet>(make_ref(mGLState), state-D3DRS_COLORWRITEENABLE1+1, value);
             break;
 
         case D3DRS_ZWRITEENABLE:
-            mRenderState[state] = value;
-            mQueue.doSend<DepthMaskSet>(value);
+            packet.add<DepthMaskSet>(make_ref(mGLState), value);
             break;
 
         case D3DRS_ZFUNC:
-            mRenderState[state] = value;
-            mQueue.doSend<DepthFuncSet>(GetGLCompFunc(value));
+            packet.add<DepthFuncSet>(GetGLCompFunc(value));
             break;
 
-        case D3DRS_SLOPESCALEDEPTHBIAS:
         case D3DRS_DEPTHBIAS:
-            mRenderState[state] = value;
-            mQueue.doSend<DepthBiasSet>(
+            packet.add<DepthBiasSet>(
                 dword_to_float(mRenderState[D3DRS_SLOPESCALEDEPTHBIAS]),
-                dword_to_float(mRenderState[D3DRS_DEPTHBIAS]) * (float)((1u<<mDepthBits) - 1u)
+                dword_to_float(value) * (float)((1u<<mDepthBits) - 1u)
             );
             break;
 
         case D3DRS_ALPHAFUNC:
-        case D3DRS_ALPHAREF:
-            mRenderState[state] = value;
-            mQueue.doSend<AlphaFuncSet>(GetGLCompFunc(mRenderState[D3DRS_ALPHAFUNC]),
-                                        mRenderState[D3DRS_ALPHAREF] / 255.0f);
+            packet.add<AlphaFuncSet>(GetGLCompFunc(mRenderState[D3DRS_ALPHAFUNC]),
+                                 mRenderState[D3DRS_ALPHAREF] / 255.0f);
             break;
 
         // FIXME: Handle D3DRS_SEPARATEALPHABLENDENABLE
         case D3DRS_SRCBLEND:
-        case D3DRS_DESTBLEND:
-            mRenderState[state] = value;
-            mQueue.doSend<BlendFuncSet>(GetGLBlendFunc(mRenderState[D3DRS_SRCBLEND]),
-                                        GetGLBlendFunc(mRenderState[D3DRS_DESTBLEND]));
+            packet.add<BlendFuncSet>(GetGLBlendFunc(mRenderState[D3DRS_SRCBLEND]),
+                                 GetGLBlendFunc(mRenderState[D3DRS_DESTBLEND]));
             break;
         case D3DRS_BLENDOP:
-            mRenderState[state] = value;
-            mQueue.doSend<BlendOpSet>(GetGLBlendOp(value));
+            packet.add<BlendOpSet>(GetGLBlendOp(value));
             break;
 
         case D3DRS_CLIPPLANEENABLE:
-            mRenderState[state] = value;
-            mQueue.doSend<ClipPlaneEnableCmd>(make_ref(mGLState), value);
+            packet.add<ClipPlaneEnableCmd>(make_ref(mGLState), value);
             break;
 
         case D3DRS_STENCILWRITEMASK:
-            mRenderState[state] = value;
-            mQueue.doSend<StencilMaskSet>(value);
+            packet.add<StencilMaskSet>(make_ref(mGLState), value);
             break;
 
+        // Without two-sided stencil the CW state applies to both faces, and
+        // the CCW state is unused.
         case D3DRS_STENCILFUNC:
-        case D3DRS_STENCILREF:
-        case D3DRS_STENCILMASK:
-            {
-                GLenum face = mRenderState[D3DRS_TWOSIDEDSTENCILMODE] ? GL_FRONT : GL_FRONT_AND_BACK;
-                mRenderState[state] = value;
-                mQueue.doSend<StencilFuncSet>(face,
-                    GetGLCompFunc(mRenderState[D3DRS_STENCILFUNC]),
-                    mRenderState[D3DRS_STENCILREF].load(),
-                    mRenderState[D3DRS_STENCILMASK].load()
-                );
-            }
+            packet.add<StencilFuncSet>(
+                mRenderState[D3DRS_TWOSIDEDSTENCILMODE] ? GL_FRONT : GL_FRONT_AND_BACK,
+                GetGLCompFunc(mRenderState[D3DRS_STENCILFUNC]),
+                mRenderState[D3DRS_STENCILREF].load(),
+                mRenderState[D3DRS_STENCILMASK].load()
+            );
             break;
 
         case D3DRS_STENCILFAIL:
-        case D3DRS_STENCILZFAIL:
-        case D3DRS_STENCILPASS:
-            {
-                GLenum face = mRenderState[D3DRS_TWOSIDEDSTENCILMODE] ? GL_FRONT : GL_FRONT_AND_BACK;
-                mRenderState[state] = value;
-                mQueue.doSend<StencilOpSet>(face,
-                    GetGLStencilOp(mRenderState[D3DRS_STENCILFAIL]),
-                    GetGLStencilOp(mRenderState[D3DRS_STENCILZFAIL]),
-                    GetGLStencilOp(mRenderState[D3DRS_STENCILPASS])
-                );
-            }
+            packet.add<StencilOpSet>(
+                mRenderState[D3DRS_TWOSIDEDSTENCILMODE] ? GL_FRONT : GL_FRONT_AND_BACK,
+                GetGLStencilOp(mRenderState[D3DRS_STENCILFAIL]),
+                GetGLStencilOp(mRenderState[D3DRS_STENCILZFAIL]),
+                GetGLStencilOp(mRenderState[D3DRS_STENCILPASS])
+            );
             break;
 
-        // FIXME: These probably shouldn't set OpenGL state while
-        // D3DRS_TWOSIDEDSTENCILMODE is false.
         case D3DRS_CCW_STENCILFUNC:
-            mRenderState[state] = value;
-            mQueue.doSend<StencilFuncSet>(GL_BACK,
-                GetGLCompFunc(mRenderState[D3DRS_CCW_STENCILFUNC]),
-                mRenderState[D3DRS_STENCILREF].load(),
-                mRenderState[D3DRS_STENCILMASK].load()
-            );
+            if(mRenderState[D3DRS_TWOSIDEDSTENCILMODE])
+                packet.add<StencilFuncSet>(GL_BACK,
+                    GetGLCompFunc(mRenderState[D3DRS_CCW_STENCILFUNC]),
+                    mRenderState[D3DRS_STENCILREF].load(),
+                    mRenderState[D3DRS_STENCILMASK].load()
+                );
             break;
 
         case D3DRS_CCW_STENCILFAIL:
-        case D3DRS_CCW_STENCILZFAIL:
-        case D3DRS_CCW_STENCILPASS:
-            mRenderState[state] = value;
-            mQueue.doSend<StencilOpSet>(GL_BACK,
-                GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILFAIL]),
-                GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILZFAIL]),
-                GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILPASS])
-            );
-            break;
-
-        // FIXME: This should probably set the GL_BACK stencil func/ops from
-        // CCW state when enabled, or set GL_FRONT_AND_BACK from CW state when
-        // disabled.
-        case D3DRS_TWOSIDEDSTENCILMODE:
-            mRenderState[state] = value;
+            if(mRenderState[D3DRS_TWOSIDEDSTENCILMODE])
+                packet.add<StencilOpSet>(GL_BACK,
+                    GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILFAIL]),
+                    GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILZFAIL]),
+                    GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILPASS])
+                );
             break;
 
         case D3DRS_FOGCOLOR:
-            mRenderState[state] = value;
-            mQueue.doSend<FogValuefSet>(GL_FOG_COLOR,
+            packet.add<FogValuefSet>(GL_FOG_COLOR,
                 D3DCOLOR_R(value)/255.0f, D3DCOLOR_G(value)/255.0f,
                 D3DCOLOR_B(value)/255.0f, D3DCOLOR_A(value)/255.0f
             );
             break;
 
         default:
-            FIXME("Unhandled state %s, value 0x%lx\n", d3drs_to_str(state), value);
-            if(state < mRenderState.size())
-                mRenderState[state] = value;
             break;
     }
-    mQueue.unlock();
-
-    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetRenderState(D3DRENDERSTATETYPE state, DWORD *value)
@@ -3280,20 +5411,57 @@ HRESULT D3DGLDevice::GetRenderState(D3DRENDERSTATETYPE state, DWORD *value)
 
 HRESULT D3DGLDevice::CreateStateBlock(D3DSTATEBLOCKTYPE type, IDirect3DStateBlock9 **stateblock)
 {
-    FIXME("iface %p, type 0x%x, stateblock %p : stub!\n", this, type, stateblock);
-    return E_NOTIMPL;
+    TRACE("iface %p, type 0x%x, stateblock %p\n", this, type, stateblock);
+
+    if(type != D3DSBT_ALL && type != D3DSBT_PIXELSTATE && type != D3DSBT_VERTEXSTATE)
+    {
+        WARN("Invalid state block type: 0x%x\n", type);
+        return D3DERR_INVALIDCALL;
+    }
+
+    D3DGLStateBlock *block = new D3DGLStateBlock(this);
+    block->init(type);
+    block->Capture();
+
+    *stateblock = block;
+    (*stateblock)->AddRef();
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::BeginStateBlock()
 {
-    FIXME("iface %p : stub!\n", this);
-    return E_NOTIMPL;
+    TRACE("iface %p\n", this);
+
+    mQueue.lock();
+    if(mRecording)
+    {
+        mQueue.unlock();
+        WARN("Already recording a state block\n");
+        return D3DERR_INVALIDCALL;
+    }
+    mRecording = new D3DGLStateBlock(this);
+    mRecording->AddRef();
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::EndStateBlock(IDirect3DStateBlock9 **stateblock)
 {
-    FIXME("iface %p, stateblock %p : stub!\n", this, stateblock);
-    return E_NOTIMPL;
+    TRACE("iface %p, stateblock %p\n", this, stateblock);
+
+    mQueue.lock();
+    D3DGLStateBlock *block = mRecording;
+    mRecording = nullptr;
+    mQueue.unlock();
+    if(!block)
+    {
+        WARN("Not recording a state block\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    *stateblock = block;
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetClipStatus(const D3DCLIPSTATUS9 *status)
@@ -3339,11 +5507,22 @@ HRESULT D3DGLDevice::SetTexture(DWORD stage, IDirect3DBaseTexture9 *texture)
         return D3DERR_INVALIDCALL;
     }
 
+    mQueue.lock();
+    if(mRecording)
+    {
+        mRecording->mTextureMask |= 1<<stage;
+        D3DGLStateBlock::setObject(mRecording->mTextures[stage], texture);
+        mQueue.unlock();
+        return D3D_OK;
+    }
+    mQueue.unlock();
+
     if(!texture)
     {
         mQueue.lock();
         texture = mTextures[stage].exchange(texture);
-        mQueue.doSend<SetTextureCmd>(make_ref(mGLState), stage, GL_TEXTURE_2D, 0);
+        if(texture)
+            sendState<SetTextureCmd>(StateSlot_Textures+stage, make_ref(mGLState), stage, GL_TEXTURE_2D, 0);
         mQueue.unlock();
         if(texture) texture->Release();
         return D3D_OK;
@@ -3376,29 +5555,24 @@ HRESULT D3DGLDevice::SetTexture(DWORD stage, IDirect3DBaseTexture9 *texture)
     }
 
     mQueue.lock();
-    // Texture being set already has an added reference
-    texture = mTextures[stage].exchange(texture);
-    if(!(texflags&GLFormatInfo::ShadowTexture))
+    // Texture being set already has an added reference, which is dropped
+    // below if it was already set.
+    IDirect3DBaseTexture9 *oldtexture = mTextures[stage].exchange(texture);
+    if(oldtexture == texture)
     {
-        if((mShadowSamplers&(1<<stage)))
-        {
-            mShadowSamplers &= ~(1<<stage);
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[stage],
-                GL_TEXTURE_COMPARE_MODE, GL_NONE
-            );
-        }
+        mQueue.unlock();
+        texture->Release();
+        return D3D_OK;
     }
-    else
+    texture = oldtexture;
+    // Shadow textures need a sampler with depth comparison.
+    UINT shadow = (texflags&GLFormatInfo::ShadowTexture) ? (1<<stage) : 0;
+    if((mShadowSamplers&(1<<stage)) != shadow)
     {
-        if(!(mShadowSamplers&(1<<stage)))
-        {
-            mShadowSamplers |= (1<<stage);
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[stage],
-                GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE
-            );
-        }
+        mShadowSamplers ^= 1<<stage;
+        markSampler(stage);
     }
-    mQueue.doSend<SetTextureCmd>(make_ref(mGLState), stage, type, binding);
+    sendState<SetTextureCmd>(StateSlot_Textures+stage, make_ref(mGLState), stage, type, binding);
     mQueue.unlock();
     if(texture) texture->Release();
 
@@ -3435,7 +5609,17 @@ HRESULT D3DGLDevice::SetTextureStageState(DWORD stage, D3DTEXTURESTAGESTATETYPE
     }
 
     if(type < mTexStageState[stage].size())
-        mTexStageState[stage][type] = value;
+    {
+        mQueue.lock();
+        if(mRecording)
+        {
+            mRecording->mTexStageStateMask[stage] |= 1<<type;
+            mRecording->mTexStageState[stage][type] = value;
+        }
+        else
+            mTexStageState[stage][type] = value;
+        mQueue.unlock();
+    }
     return D3D_OK;
 }
 
@@ -3467,95 +5651,29 @@ HRESULT D3DGLDevice::SetSamplerState(DWORD sampler, D3DSAMPLERSTATETYPE type, DW
 
     if(sampler >= D3DVERTEXTEXTURESAMPLER0 && sampler <= D3DVERTEXTEXTURESAMPLER3)
         sampler = sampler - D3DVERTEXTEXTURESAMPLER0 + MAX_FRAGMENT_SAMPLERS;
-
-    if(sampler >= mSamplerState.size())
-    {
-        WARN("Sampler index out of range (%lu >= %u)\n", sampler, mSamplerState.size());
-        return D3DERR_INVALIDCALL;
-    }
-    if(type >= mSamplerState[sampler].size())
-    {
-        WARN("Sampler type out of range (%u >= %u)\n", type, mSamplerState[sampler].size());
-        return D3DERR_INVALIDCALL;
-    }
-
-    mQueue.lock();
-    DWORD oldvalue = mSamplerState[sampler][type].exchange(value);
-    switch(type)
-    {
-        case D3DSAMP_ADDRESSU:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_WRAP_S, GetGLWrapMode(value)
-            );
-            break;
-        case D3DSAMP_ADDRESSV:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_WRAP_T, GetGLWrapMode(value)
-            );
-            break;
-        case D3DSAMP_ADDRESSW:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_WRAP_R, GetGLWrapMode(value)
-            );
-            break;
-        case D3DSAMP_BORDERCOLOR:
-            mQueue.doSend<SetSamplerParameter4f>(mGLState.samplers[sampler],
-                GL_TEXTURE_BORDER_COLOR, D3DCOLOR_R(value)/255.0f, D3DCOLOR_G(value)/255.0f,
-                D3DCOLOR_B(value)/255.0f, D3DCOLOR_A(value)/255.0f
-            );
-            break;
-        case D3DSAMP_MAGFILTER:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_MAG_FILTER, GetGLFilterMode(value, D3DTEXF_NONE)
-            );
-            break;
-        case D3DSAMP_MINFILTER:
-            if((oldvalue == D3DTEXF_ANISOTROPIC) != (value == D3DTEXF_ANISOTROPIC))
-                mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                    GL_TEXTURE_MAX_ANISOTROPY_EXT, (value == D3DTEXF_ANISOTROPIC) ?
-                                                   mSamplerState[sampler][D3DSAMP_MAXANISOTROPY].load() :
-                                                   1ul
-                );
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_MIN_FILTER, GetGLFilterMode(value,
-                    mSamplerState[sampler][D3DSAMP_MIPFILTER]
-                )
-            );
-            break;
-        case D3DSAMP_MIPFILTER:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_MIN_FILTER, GetGLFilterMode(
-                    mSamplerState[sampler][D3DSAMP_MINFILTER], value
-                )
-            );
-            break;
-        case D3DSAMP_MIPMAPLODBIAS:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_LOD_BIAS, value
-            );
-            break;
-        case D3DSAMP_MAXMIPLEVEL:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_MAX_LOD, value
-            );
-            break;
-        case D3DSAMP_MAXANISOTROPY:
-            if(mSamplerState[sampler][D3DSAMP_MIPFILTER] == D3DTEXF_ANISOTROPIC)
-                mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                    GL_TEXTURE_MAX_ANISOTROPY_EXT, value
-                );
-            break;
-        case D3DSAMP_SRGBTEXTURE:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_SRGB_DECODE_EXT, value ? GL_DECODE_EXT : GL_SKIP_DECODE_EXT
-            );
-            break;
-        case D3DSAMP_ELEMENTINDEX:
-        case D3DSAMP_DMAPOFFSET:
-        default:
-            FIXME("Unhandled sampler state: %s\n", d3dsamp_to_str(type));
-            break;
+
+    if(sampler >= mSamplerState.size())
+    {
+        WARN("Sampler index out of range (%lu >= %u)\n", sampler, mSamplerState.size());
+        return D3DERR_INVALIDCALL;
+    }
+    if(type >= mSamplerState[sampler].size())
+    {
+        WARN("Sampler type out of range (%u >= %u)\n", type, mSamplerState[sampler].size());
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    if(mRecording)
+    {
+        mRecording->mSamplerStateMask[sampler] |= 1<<type;
+        mRecording->mSamplerState[sampler][type] = value;
+        mQueue.unlock();
+        return D3D_OK;
     }
+    DWORD oldvalue = mSamplerState[sampler][type].exchange(value);
+    if(value != oldvalue && !markSamplerState(sampler, type))
+        FIXME("Unhandled sampler state: %s\n", d3dsamp_to_str(type));
     mQueue.unlock();
 
     return D3D_OK;
@@ -3602,8 +5720,16 @@ HRESULT D3DGLDevice::SetScissorRect(const RECT *rect)
     }
 
     mQueue.lock();
-    mScissorRect = *rect;
-    mQueue.doSend<ScissorRectSet>(*rect);
+    if(mRecording)
+    {
+        mRecording->mHasScissorRect = true;
+        mRecording->mScissorRect = *rect;
+    }
+    else if(memcmp(&mScissorRect, rect, sizeof(mScissorRect)) != 0)
+    {
+        mScissorRect = *rect;
+        markViewportState(ViewportEntry_Scissor);
+    }
     mQueue.unlock();
 
     return D3D_OK;
@@ -3649,11 +5775,14 @@ HRESULT D3DGLDevice::DrawPrimitive(D3DPRIMITIVETYPE type, UINT startvtx, UINT co
     TRACE("iface %p, type 0x%x, startVtx %u, count %u\n", this, type, startvtx, count);
 
     mQueue.lock();
-    HRESULT hr = sendVtxData(startvtx, mStreams.data(), mStreams.size());
+    HRESULT hr = sendVtxData(mStreams.data(), mStreams.size());
     if(SUCCEEDED(hr))
     {
         GLenum mode = GetGLDrawMode(type, count);
-        mQueue.doSend<DrawGLArraysCmd>(make_ref(mGLState), mode, count, 1/*num_instances*/);
+        sendDirtyStates();
+        sendDirtyConstants();
+        mQueue.doSend<DrawGLArraysCmd>(make_ref(mGLState), mode, startvtx, count, 1/*num_instances*/);
+        endStateEpoch();
     }
     mQueue.unlock();
 
@@ -3673,7 +5802,7 @@ HRESULT D3DGLDevice::DrawIndexedPrimitive(D3DPRIMITIVETYPE type, INT startvtx, U
     D3DGLBufferObject *idxbuffer;
 
     mQueue.lock();
-    HRESULT hr = sendVtxData(startvtx, mStreams.data(), mStreams.size());
+    HRESULT hr = sendVtxData(mStreams.data(), mStreams.size());
     if(SUCCEEDED(hr))
     {
         if(!(idxbuffer=mIndexBuffer))
@@ -3690,9 +5819,15 @@ HRESULT D3DGLDevice::DrawIndexedPrimitive(D3DPRIMITIVETYPE type, INT startvtx, U
             GLenum mode = GetGLDrawMode(type, count);
             GLenum type = GetGLIndexType(idxbuffer->getFormat(), startidx);
             GLubyte *pointer = ((GLubyte*)nullptr) + startidx;
-            mQueue.doSend<DrawGLElementsCmd>(make_ref(mGLState),
-                mode, count, type, pointer, num_instances, minvtx
-            );
+            sendDirtyStates();
+            sendDirtyConstants();
+            if(num_instances == 1)
+                batchDraw(mode, count, type, pointer, startvtx);
+            else
+                mQueue.doSend<DrawGLElementsCmd>(make_ref(mGLState),
+                    mode, count, type, pointer, num_instances, startvtx
+                );
+            endStateEpoch();
         }
     }
     mQueue.unlock();
@@ -3703,47 +5838,146 @@ HRESULT D3DGLDevice::DrawPrimitiveUP(D3DPRIMITIVETYPE type, UINT count, const vo
 {
     TRACE("iface %p, type 0x%x, count %u, vtxData %p, vtxStride %u\n", this, type, count, vtxData, vtxStride);
 
-    GLenum mode = GetGLDrawMode(type, count);
-
-    if(!mPrimitiveUserData)
+    if(!vtxStride)
     {
-        mPrimitiveUserData = new D3DGLBufferObject(this);
-        if(!mPrimitiveUserData->init_vbo(vtxStride*count, D3DUSAGE_WRITEONLY, 0, D3DPOOL_DEFAULT))
-        {
-            ERR("Failed to initialize vertex data storage\n");
-            return D3DERR_INVALIDCALL;
-        }
+        WARN("Invalid zero vertex stride\n");
+        return D3DERR_INVALIDCALL;
     }
-    mPrimitiveUserData->resetBufferData(reinterpret_cast<const GLubyte*>(vtxData),
-                                        vtxStride*count);
+
+    GLenum mode = GetGLDrawMode(type, count);
+    UINT vtxsize = vtxStride * count;
+
+    // Data too large for the vertex ring goes through a buffer object.
+    bool use_ring = (vtxsize + vtxStride-1 <= VERTEX_RING_SIZE/RING_SEGMENTS);
+    if(!use_ring && !uploadUserData(mPrimitiveUserData, D3DFMT_UNKNOWN, vtxData, vtxsize))
+        return D3DERR_INVALIDCALL;
 
     mQueue.lock();
     StreamSource stream;
-    stream.mBuffer = mPrimitiveUserData;
-    stream.mOffset = 0;
     stream.mStride = vtxStride;
     stream.mFreq = mStreams[0].mFreq;
 
-    HRESULT hr = sendVtxData(0, &stream, 1);
+    // Vertices go in the ring at a multiple of the stride, so the stream
+    // binding stays the same between draws and only the first vertex moves.
+    UINT first = 0;
+    if(use_ring)
+    {
+        reserveVertexRing(vtxsize + vtxStride-1);
+        stream.mBufferId = mGLState.vertex_ring.buffer;
+        first = writeVertexRing(vtxData, vtxsize, vtxStride) / vtxStride;
+    }
+    else
+        stream.mBuffer = mPrimitiveUserData;
+
+    // Buffers are released after unlocking, since destroying one sends
+    // commands under the lock.
+    D3DGLBufferObject *oldstream = nullptr;
+    HRESULT hr = sendVtxData(&stream, 1);
     if(SUCCEEDED(hr))
     {
-        if(mStreams[0].mBuffer)
-            mStreams[0].mBuffer->releaseIface();
+        oldstream = mStreams[0].mBuffer;
         mStreams[0].mBuffer = nullptr;
         mStreams[0].mOffset = 0;
         mStreams[0].mStride = 0;
 
-        mQueue.doSend<DrawGLArraysCmd>(make_ref(mGLState), mode, count, 1/*num_instances*/);
+        sendDirtyStates();
+        sendDirtyConstants();
+        mQueue.doSend<DrawGLArraysCmd>(make_ref(mGLState), mode, first, count, 1/*num_instances*/);
+        endStateEpoch();
     }
     mQueue.unlock();
+    if(oldstream) oldstream->releaseIface();
 
     return hr;
 }
 
 HRESULT D3DGLDevice::DrawIndexedPrimitiveUP(D3DPRIMITIVETYPE type, UINT minvtx, UINT numvtx, UINT count, const void *idxdata, D3DFORMAT idxformat, const void *vtxdata, UINT vtxstride)
 {
-    FIXME("iface %p, type 0x%x, minvtx %u, numvtx %u, count %u, idexdata %p, idxformat %s, vtxdata %p, vtxstride %u : stub!\n", this, type, minvtx, numvtx, count, idxdata, d3dfmt_to_str(idxformat), vtxdata, vtxstride);
-    return E_NOTIMPL;
+    TRACE("iface %p, type 0x%x, minvtx %u, numvtx %u, count %u, idexdata %p, idxformat %s, vtxdata %p, vtxstride %u\n", this, type, minvtx, numvtx, count, idxdata, d3dfmt_to_str(idxformat), vtxdata, vtxstride);
+
+    if(type == D3DPT_POINTLIST)
+    {
+        WARN("Pointlist not allowed for indexed rendering\n");
+        return D3DERR_INVALIDCALL;
+    }
+    if(idxformat != D3DFMT_INDEX16 && idxformat != D3DFMT_INDEX32)
+    {
+        WARN("Invalid index format: %s\n", d3dfmt_to_str(idxformat));
+        return D3DERR_INVALIDCALL;
+    }
+    if(!vtxstride)
+    {
+        WARN("Invalid zero vertex stride\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    GLenum mode = GetGLDrawMode(type, count);
+    UINT idxsize = count;
+    GLenum idxtype = GetGLIndexType(idxformat, idxsize);
+    UINT vtxsize = numvtx * vtxstride;
+    const GLubyte *vtxrange = reinterpret_cast<const GLubyte*>(vtxdata) + minvtx*vtxstride;
+    UINT ringsize = vtxsize + vtxstride-1 + idxsize + 3;
+
+    // Data too large for the vertex ring goes through buffer objects.
+    bool use_ring = (ringsize <= VERTEX_RING_SIZE/RING_SEGMENTS);
+    if(!use_ring && (!uploadUserData(mPrimitiveUserData, D3DFMT_UNKNOWN, vtxrange, vtxsize) ||
+                     !uploadUserData(mPrimitiveUserIndices, idxformat, idxdata, idxsize)))
+        return D3DERR_INVALIDCALL;
+
+    mQueue.lock();
+    StreamSource stream;
+    stream.mStride = vtxstride;
+    stream.mFreq = mStreams[0].mFreq;
+
+    // Only the referenced vertex range is copied, with the base vertex
+    // offsetting the indices to it. The indices follow the vertices in the
+    // same ring segment, so they're fenced together.
+    GLuint idxbuffer = 0;
+    GLubyte *pointer = nullptr;
+    GLint basevtx = -(GLint)minvtx;
+    if(use_ring)
+    {
+        reserveVertexRing(ringsize);
+        stream.mBufferId = mGLState.vertex_ring.buffer;
+        basevtx += writeVertexRing(vtxrange, vtxsize, vtxstride) / vtxstride;
+        idxbuffer = mGLState.vertex_ring.buffer;
+        pointer += writeVertexRing(idxdata, idxsize, (idxtype == GL_UNSIGNED_INT) ? 4 : 2);
+    }
+    else
+    {
+        stream.mBuffer = mPrimitiveUserData;
+        idxbuffer = mPrimitiveUserIndices->getBufferId();
+    }
+
+    // Buffers are released after unlocking, since destroying one sends
+    // commands under the lock.
+    D3DGLBufferObject *oldstream = nullptr;
+    D3DGLBufferObject *oldindices = nullptr;
+    HRESULT hr = sendVtxData(&stream, 1);
+    if(SUCCEEDED(hr))
+    {
+        oldstream = mStreams[0].mBuffer;
+        mStreams[0].mBuffer = nullptr;
+        mStreams[0].mOffset = 0;
+        mStreams[0].mStride = 0;
+
+        // The index buffer is unset afterward, so another indexed draw has
+        // to set a new one before it uses the element array binding.
+        oldindices = mIndexBuffer.exchange(nullptr);
+        mQueue.doSend<ElementArraySet>(make_ref(mGLState), idxbuffer);
+
+        sendDirtyStates();
+        sendDirtyConstants();
+        mQueue.doSend<DrawGLElementsCmd>(make_ref(mGLState),
+            mode, count, idxtype, pointer, 1/*num_instances*/, basevtx
+        );
+        endStateEpoch();
+    }
+    mQueue.unlock();
+    if(oldstream) oldstream->releaseIface();
+    if(oldindices) oldindices->releaseIface();
+
+    return hr;
 }
 
 HRESULT D3DGLDevice::ProcessVertices(UINT startidx, UINT dstidx, UINT vtxcount, IDirect3DVertexBuffer9 *dstbuffer, IDirect3DVertexDeclaration9 *vtxdecl, DWORD flags)
@@ -3784,6 +6018,14 @@ HRESULT D3DGLDevice::SetVertexDeclaration(IDirect3DVertexDeclaration9 *decl)
     }
 
     mQueue.lock();
+    if(mRecording)
+    {
+        mRecording->mHasVertexDecl = true;
+        D3DGLStateBlock::setObject(mRecording->mVertexDecl, decl);
+        mQueue.unlock();
+        if(vtxdecl) vtxdecl->releaseIface();
+        return D3D_OK;
+    }
     if(vtxdecl)
         vtxdecl = mVertexDecl.exchange(vtxdecl);
     else
@@ -3834,6 +6076,13 @@ HRESULT D3DGLDevice::SetFVF(DWORD fvf)
         }
         mVtxDeclMap.insert(std::make_pair(fvf, vtxdecl));
     }
+    if(mRecording)
+    {
+        mRecording->mHasVertexDecl = true;
+        D3DGLStateBlock::setObject<IDirect3DVertexDeclaration9>(mRecording->mVertexDecl, vtxdecl);
+        mQueue.unlock();
+        return D3D_OK;
+    }
     vtxdecl->addIface();
     vtxdecl = mVertexDecl.exchange(vtxdecl);
     mQueue.unlock();
@@ -3884,9 +6133,17 @@ HRESULT D3DGLDevice::SetVertexShader(IDirect3DVertexShader9 *shader)
     }
 
     mQueue.lock();
+    if(mRecording)
+    {
+        mRecording->mHasVertexShader = true;
+        D3DGLStateBlock::setObject(mRecording->mVertexShader, shader);
+        mQueue.unlock();
+        if(vshader) vshader->Release();
+        return D3D_OK;
+    }
     // Wait for pending updates to finish, in case we need to rebuild with new parameters.
-    while(vshader && vshader->getPendingUpdates() > 0)
-        mQueue.wakeAndSleep();
+    if(vshader)
+        mQueue.waitFor(vshader->getCompileSeq());
     D3DGLVertexShader *oldshader = mVertexShader.exchange(vshader);
     if(vshader)
     {
@@ -3898,8 +6155,9 @@ HRESULT D3DGLDevice::SetVertexShader(IDirect3DVertexShader9 *shader)
             mQueue.doSend<SetVShaderCmd>(mGLState.pipeline, program);
         else
         {
-            vshader->addPendingUpdate();
-            mQueue.doSend<CompileAndSetVShaderCmd>(vshader, mGLState.pipeline);
+            vshader->setCompileSeq(
+                mQueue.doSend<CompileAndSetVShaderCmd>(vshader, mGLState.pipeline)
+            );
         }
     }
     else if(oldshader)
@@ -3932,40 +6190,16 @@ HRESULT D3DGLDevice::SetVertexShaderConstantF(UINT start, const float *values, U
     }
 
     mQueue.lock();
-    memcpy(mVSConstantsF[start].ptr(), values, count*sizeof(Vector4f));
+    if(mRecording)
     {
-    set_more:
-        if(count == 1)
-            mQueue.doSend<SetBufferValue4f>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values
-            );
-        else if(count <= 4)
-            mQueue.doSend<SetBufferValue4fv<4>>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 32)
-            mQueue.doSend<SetBufferValue4fv<32>>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 64)
-            mQueue.doSend<SetBufferValue4fv<64>>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 128)
-            mQueue.doSend<SetBufferValue4fv<128>>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else
-        {
-            mQueue.doSend<SetBufferValue4fv<128>>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values
-            );
-            values += 128*4;
-            start += 128;
-            count -= 128;
-            goto set_more;
-        }
+        for(UINT i = 0;i < count;++i)
+            mRecording->mVSConstantFMask.set(start+i);
+        memcpy(mRecording->mVSConstantsF[start].ptr(), values, count*sizeof(Vector4f));
+        mQueue.unlock();
+        return D3D_OK;
     }
+    memcpy(mVSConstantsF[start].ptr(), values, count*sizeof(Vector4f));
+    mVSDirtyConstantsF.add(start, count);
     mQueue.unlock();
 
     return D3D_OK;
@@ -3990,26 +6224,106 @@ HRESULT D3DGLDevice::GetVertexShaderConstantF(UINT start, float *values, UINT co
 
 HRESULT D3DGLDevice::SetVertexShaderConstantI(UINT start, const int *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= mVSConstantsI.size() || count > mVSConstantsI.size()-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, mVSConstantsI.size());
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    if(mRecording)
+    {
+        mRecording->mVSConstantIMask |= ((1u<<count) - 1) << start;
+        memcpy(mRecording->mVSConstantsI[start].data(), values, count*sizeof(mVSConstantsI[0]));
+        mQueue.unlock();
+        return D3D_OK;
+    }
+    memcpy(mVSConstantsI[start].data(), values, count*sizeof(mVSConstantsI[0]));
+    mVSDirtyConstantsI.add(start, count);
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetVertexShaderConstantI(UINT start, int *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= mVSConstantsI.size() || count > mVSConstantsI.size()-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, mVSConstantsI.size());
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    memcpy(values, mVSConstantsI[start].data(), count*sizeof(mVSConstantsI[0]));
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetVertexShaderConstantB(UINT start, const WINBOOL *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= 16 || count > 16-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, 16);
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    if(mRecording)
+    {
+        DWORD mask = ((1u<<count) - 1) << start;
+        DWORD bits = 0;
+        for(UINT i = 0;i < count;++i)
+        {
+            if(values[i])
+                bits |= 1u<<(start+i);
+        }
+        mRecording->mVSConstantBMask |= mask;
+        mRecording->mVSConstantsB = (mRecording->mVSConstantsB&~mask) | bits;
+        mQueue.unlock();
+        return D3D_OK;
+    }
+    GLuint bits = mVSConstantsB[0];
+    for(UINT i = 0;i < count;++i)
+    {
+        if(values[i])
+            bits |= 1u<<(start+i);
+        else
+            bits &= ~(1u<<(start+i));
+    }
+    if(bits != mVSConstantsB[0])
+    {
+        mVSConstantsB[0] = bits;
+        mVSDirtyConstantsB.add(0, 1);
+    }
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetVertexShaderConstantB(UINT start, WINBOOL *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= 16 || count > 16-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, 16);
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    GLuint bits = mVSConstantsB[0];
+    mQueue.unlock();
+    for(UINT i = 0;i < count;++i)
+        values[i] = (bits>>(start+i))&1;
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetStreamSource(UINT index, IDirect3DVertexBuffer9 *stream, UINT offset, UINT stride)
@@ -4022,6 +6336,18 @@ HRESULT D3DGLDevice::SetStreamSource(UINT index, IDirect3DVertexBuffer9 *stream,
         return D3DERR_INVALIDCALL;
     }
 
+    mQueue.lock();
+    if(mRecording)
+    {
+        mRecording->mStreamMask |= 1<<index;
+        D3DGLStateBlock::setObject(mRecording->mStreams[index], stream);
+        mRecording->mStreamOffsets[index] = offset;
+        mRecording->mStreamStrides[index] = stride;
+        mQueue.unlock();
+        return D3D_OK;
+    }
+    mQueue.unlock();
+
     if(!stream)
     {
         if(mStreams[index].mBuffer)
@@ -4088,7 +6414,15 @@ HRESULT D3DGLDevice::SetStreamSourceFreq(UINT index, UINT divisor)
     if(!(divisor&(D3DSTREAMSOURCE_INDEXEDDATA|D3DSTREAMSOURCE_INSTANCEDATA)) && divisor != 1)
         FIXME("Unexpected divisor value: 0x%x\n", divisor);
 
-    mStreams[index].mFreq = divisor;
+    mQueue.lock();
+    if(mRecording)
+    {
+        mRecording->mStreamFreqMask |= 1<<index;
+        mRecording->mStreamFreqs[index] = divisor;
+    }
+    else
+        mStreams[index].mFreq = divisor;
+    mQueue.unlock();
     return D3D_OK;
 }
 
@@ -4121,8 +6455,16 @@ HRESULT D3DGLDevice::SetIndices(IDirect3DIndexBuffer9 *index)
     }
 
     mQueue.lock();
+    if(mRecording)
+    {
+        mRecording->mHasIndices = true;
+        D3DGLStateBlock::setObject(mRecording->mIndices, index);
+        mQueue.unlock();
+        if(buffer) buffer->releaseIface();
+        return D3D_OK;
+    }
     D3DGLBufferObject *oldbuffer = mIndexBuffer.exchange(buffer);
-    mQueue.doSend<ElementArraySet>(buffer ? buffer->getBufferId() : 0);
+    mQueue.doSend<ElementArraySet>(make_ref(mGLState), buffer ? buffer->getBufferId() : 0);
     mQueue.unlock();
     if(oldbuffer) oldbuffer->releaseIface();
 
@@ -4168,9 +6510,17 @@ HRESULT D3DGLDevice::SetPixelShader(IDirect3DPixelShader9 *shader)
     }
 
     mQueue.lock();
+    if(mRecording)
+    {
+        mRecording->mHasPixelShader = true;
+        D3DGLStateBlock::setObject(mRecording->mPixelShader, shader);
+        mQueue.unlock();
+        if(pshader) pshader->Release();
+        return D3D_OK;
+    }
     // Wait for pending updates to finish, in case we need to rebuild with new parameters.
-    while(pshader && pshader->getPendingUpdates() > 0)
-        mQueue.wakeAndSleep();
+    if(pshader)
+        mQueue.waitFor(pshader->getCompileSeq());
     D3DGLPixelShader *oldshader = mPixelShader.exchange(pshader);
     if(pshader)
     {
@@ -4213,40 +6563,16 @@ HRESULT D3DGLDevice::SetPixelShaderConstantF(UINT start, const float *values, UI
     }
 
     mQueue.lock();
-    memcpy(mPSConstantsF[start].ptr(), values, count*sizeof(Vector4f));
+    if(mRecording)
     {
-    set_more:
-        if(count == 1)
-            mQueue.doSend<SetBufferValue4f>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values
-            );
-        else if(count <= 4)
-            mQueue.doSend<SetBufferValue4fv<4>>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 32)
-            mQueue.doSend<SetBufferValue4fv<32>>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 64)
-            mQueue.doSend<SetBufferValue4fv<64>>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 128)
-            mQueue.doSend<SetBufferValue4fv<128>>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else
-        {
-            mQueue.doSend<SetBufferValue4fv<128>>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values
-            );
-            values += 128*4;
-            start += 128;
-            count -= 128;
-            goto set_more;
-        }
+        for(UINT i = 0;i < count;++i)
+            mRecording->mPSConstantFMask.set(start+i);
+        memcpy(mRecording->mPSConstantsF[start].ptr(), values, count*sizeof(Vector4f));
+        mQueue.unlock();
+        return D3D_OK;
     }
+    memcpy(mPSConstantsF[start].ptr(), values, count*sizeof(Vector4f));
+    mPSDirtyConstantsF.add(start, count);
     mQueue.unlock();
 
     return D3D_OK;
@@ -4271,26 +6597,106 @@ HRESULT D3DGLDevice::GetPixelShaderConstantF(UINT start, float *values, UINT cou
 
 HRESULT D3DGLDevice::SetPixelShaderConstantI(UINT start, const int *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= mPSConstantsI.size() || count > mPSConstantsI.size()-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, mPSConstantsI.size());
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    if(mRecording)
+    {
+        mRecording->mPSConstantIMask |= ((1u<<count) - 1) << start;
+        memcpy(mRecording->mPSConstantsI[start].data(), values, count*sizeof(mPSConstantsI[0]));
+        mQueue.unlock();
+        return D3D_OK;
+    }
+    memcpy(mPSConstantsI[start].data(), values, count*sizeof(mPSConstantsI[0]));
+    mPSDirtyConstantsI.add(start, count);
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetPixelShaderConstantI(UINT start, int *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= mPSConstantsI.size() || count > mPSConstantsI.size()-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, mPSConstantsI.size());
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    memcpy(values, mPSConstantsI[start].data(), count*sizeof(mPSConstantsI[0]));
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetPixelShaderConstantB(UINT start, const WINBOOL *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= 16 || count > 16-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, 16);
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    if(mRecording)
+    {
+        DWORD mask = ((1u<<count) - 1) << start;
+        DWORD bits = 0;
+        for(UINT i = 0;i < count;++i)
+        {
+            if(values[i])
+                bits |= 1u<<(start+i);
+        }
+        mRecording->mPSConstantBMask |= mask;
+        mRecording->mPSConstantsB = (mRecording->mPSConstantsB&~mask) | bits;
+        mQueue.unlock();
+        return D3D_OK;
+    }
+    GLuint bits = mPSConstantsB[0];
+    for(UINT i = 0;i < count;++i)
+    {
+        if(values[i])
+            bits |= 1u<<(start+i);
+        else
+            bits &= ~(1u<<(start+i));
+    }
+    if(bits != mPSConstantsB[0])
+    {
+        mPSConstantsB[0] = bits;
+        mPSDirtyConstantsB.add(0, 1);
+    }
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetPixelShaderConstantB(UINT start, WINBOOL *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= 16 || count > 16-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, 16);
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    GLuint bits = mPSConstantsB[0];
+    mQueue.unlock();
+    for(UINT i = 0;i < count;++i)
+        values[i] = (bits>>(start+i))&1;
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::DrawRectPatch(UINT handle, const float *numsegs, const D3DRECTPATCH_INFO *pinfo)
@@ -5,6 +5,8 @@
 
 #include "mojoshader/mojoshader.h"
 #include "device.hpp"
+#include "capture.hpp"
+#include "capturereplay.hpp"
 #include "trace.hpp"
 #include "private_iids.hpp"
 
@@ -76,6 +78,12 @@ GLuint D3DGLPixelShader::compileShaderGL(UINT shadowmask)
         GLuint v4f_idx = glGetUniformBlockIndex(program, "ps_vec4");
         if(v4f_idx != GL_INVALID_INDEX)
             glUniformBlockBinding(program, v4f_idx, PSF_BINDING_IDX);
+        GLuint v4i_idx = glGetUniformBlockIndex(program, "ps_ivec4");
+        if(v4i_idx != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, v4i_idx, PSI_BINDING_IDX);
+        GLuint b_idx = glGetUniformBlockIndex(program, "ps_bool");
+        if(b_idx != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, b_idx, PSB_BINDING_IDX);
     }
 
     for(int i = 0;i < shader->sampler_count;++i)
@@ -91,7 +99,6 @@ GLuint D3DGLPixelShader::compileShaderGL(UINT shadowmask)
 done:
     MOJOSHADER_freeParseData(shader);
 
-    --mPendingUpdates;
     return program;
 }
 
@@ -102,18 +109,79 @@ class DeinitPShaderCmd : public Command {
 public:
     DeinitPShaderCmd(GLuint program) : mProgram(program) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glDeleteProgram(mProgram);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Program, mProgram);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.releaseObject(reader.read<ULONG>());
     }
 };
+DEFINE_COMMAND(DeinitPShaderCmd)
+DEFINE_COMMAND_EXECUTOR(CompileAndSetPShaderCmd)
+DEFINE_COMMAND_CAPTURE(CompileAndSetPShaderCmd)
+DEFINE_COMMAND_EXECUTOR(SetPShaderCmd)
+DEFINE_COMMAND_CAPTURE(SetPShaderCmd)
+
+// Each program the shader compiles is replayed with a shader of its own.
+void CompileAndSetPShaderCmd::capture(CommandCapture &capture) const
+{
+    const std::vector<DWORD> &code = mTarget->getCode();
+    capture.writeNewObject(mTarget);
+    capture.write(mShadowSamplers);
+    capture.writeData(code.data(), code.size()*sizeof(DWORD));
+}
+
+void CompileAndSetPShaderCmd::captured(CommandCapture &capture) const
+{
+    capture.addName(CaptureName_Program, mTarget->getProgram(mShadowSamplers), mTarget);
+}
+
+void CompileAndSetPShaderCmd::replay(CaptureReader &reader, CaptureReplay &replay)
+{
+    ULONG id = reader.read<ULONG>();
+    UINT shadowsamplers = reader.read<UINT>();
+    size_t size;
+    const DWORD *code = reinterpret_cast<const DWORD*>(reader.readData(size));
+    if(!code) return;
+
+    IDirect3DPixelShader9 *iface;
+    HRESULT hr = replay.getDevice()->CreatePixelShader(code, &iface);
+    if(FAILED(hr))
+    {
+        ERR("Failed to create pixel shader %lu: 0x%lx\n", id, hr);
+        return;
+    }
+    D3DGLPixelShader *shader = static_cast<D3DGLPixelShader*>(iface);
+    replay.getQueue().lock();
+    shader->setProgram(replay.getPipeline(), shadowsamplers, true);
+    replay.getQueue().unlock();
+    // The program name is needed to replay the commands using it.
+    replay.getQueue().waitFor(shader->getCompileSeq());
+    replay.addObject(id, iface, shader, shader->getProgram(shadowsamplers));
+}
+
+void SetPShaderCmd::capture(CommandCapture &capture) const
+{
+    capture.writeName(CaptureName_Program, mProgram);
+}
+
+void SetPShaderCmd::replay(CaptureReader &reader, CaptureReplay &replay)
+{
+    replay.send<SetPShaderCmd>(replay.getPipeline(), replay.getName(reader.read<ULONG>()));
+}
 
 
 D3DGLPixelShader::D3DGLPixelShader(D3DGLDevice *parent)
   : mRefCount(0)
   , mParent(parent)
-  , mPendingUpdates(0)
+  , mCompileSeq(0)
   , mSamplerMask(0)
 {
     mParent->AddRef();
@@ -121,8 +189,7 @@ D3DGLPixelShader::D3DGLPixelShader(D3DGLDevice *parent)
 
 D3DGLPixelShader::~D3DGLPixelShader()
 {
-    if(mPendingUpdates > 0)
-        mParent->getQueue().wakeAndSleep();
+    mParent->getQueue().waitFor(mCompileSeq);
     for(auto &program : mPrograms)
         mParent->getQueue().send<DeinitPShaderCmd>(program.second);
     mParent->Release();
@@ -168,8 +235,7 @@ bool D3DGLPixelShader::init(const DWORD *data)
 void D3DGLPixelShader::setProgram(GLuint pipeline, UINT shadowmask, bool force)
 {
     CommandQueue &queue = mParent->getQueue();
-    while(mPendingUpdates > 0)
-        queue.wakeAndSleep();
+    queue.waitFor(mCompileSeq);
 
     shadowmask &= mSamplerMask;
     auto iter = mPrograms.find(shadowmask);
@@ -186,8 +252,7 @@ void D3DGLPixelShader::setProgram(GLuint pipeline, UINT shadowmask, bool force)
         TRACE("Building program for shadow sampler mask 0x%x\n", shadowmask);
 
         mShadowSamplers = shadowmask;
-        ++mPendingUpdates;
-        queue.doSend<CompileAndSetPShaderCmd>(this, pipeline, shadowmask);
+        CommandQueue::raiseSeq(mCompileSeq, queue.doSend<CompileAndSetPShaderCmd>(this, pipeline, shadowmask));
     }
 }
 
@@ -11,15 +11,14 @@
 D3DGLPlainSurface::D3DGLPlainSurface(D3DGLDevice *parent)
   : mRefCount(0)
   , mParent(parent)
-  , mPendingUpdates(0)
+  , mUpdateSeq(0)
   , mLock(LT_Unlocked)
 {
 }
 
 D3DGLPlainSurface::~D3DGLPlainSurface()
 {
-    while(mPendingUpdates > 0)
-        mParent->getQueue().wakeAndSleep();
+    mParent->getQueue().waitFor(mUpdateSeq);
 }
 
 bool D3DGLPlainSurface::init(const D3DSURFACE_DESC *desc)
@@ -190,8 +189,7 @@ HRESULT D3DGLPlainSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect
         }
     }
 
-    while(mPendingUpdates > 0)
-        mParent->getQueue().wakeAndSleep();
+    mParent->getQueue().waitFor(mUpdateSeq);
 
     GLubyte *memPtr = mBufData.get();
     mLockRegion = *rect;
@@ -2,6 +2,8 @@
 #include "query.hpp"
 
 #include "device.hpp"
+#include "capture.hpp"
+#include "capturereplay.hpp"
 #include "private_iids.hpp"
 
 
@@ -16,12 +18,36 @@ class QueryInitCmd : public Command {
 public:
     QueryInitCmd(D3DGLQuery *target) : mTarget(target) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->initGL();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeNewObject(mTarget);
+        capture.write(mTarget->GetType());
+    }
+    void captured(CommandCapture &capture) const
+    {
+        capture.addName(CaptureName_Query, mTarget->getQueryId(), mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        ULONG id = reader.read<ULONG>();
+        D3DQUERYTYPE type = reader.read<D3DQUERYTYPE>();
+        IDirect3DQuery9 *query;
+        HRESULT hr = replay.getDevice()->CreateQuery(type, &query);
+        if(FAILED(hr))
+        {
+            ERR("Failed to create query %lu: 0x%lx\n", id, hr);
+            return;
+        }
+        D3DGLQuery *target = static_cast<D3DGLQuery*>(query);
+        replay.addObject(id, query, target, target->getQueryId());
     }
 };
+DEFINE_COMMAND(QueryInitCmd)
 
 class QueryDeinitCmd : public Command {
     GLuint mQueryId;
@@ -29,13 +55,22 @@ class QueryDeinitCmd : public Command {
 public:
     QueryDeinitCmd(GLuint queryid) : mQueryId(queryid) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glDeleteQueries(1, &mQueryId);
         checkGLError();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Query, mQueryId);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.releaseObject(reader.read<ULONG>());
     }
 };
+DEFINE_COMMAND(QueryDeinitCmd)
 
 void D3DGLQuery::beginQueryGL()
 {
@@ -48,12 +83,22 @@ class BeginQueryCmd : public Command {
 public:
     BeginQueryCmd(D3DGLQuery *target) : mTarget(target) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->beginQueryGL();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        if(D3DGLQuery *target = replay.getObject<D3DGLQuery>(reader.read<ULONG>()))
+            replay.send<BeginQueryCmd>(target);
     }
 };
+DEFINE_COMMAND(BeginQueryCmd)
 
 void D3DGLQuery::endQueryGL()
 {
@@ -66,12 +111,22 @@ class EndQueryCmd : public Command {
 public:
     EndQueryCmd(D3DGLQuery *target) : mTarget(target) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->endQueryGL();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        if(D3DGLQuery *target = replay.getObject<D3DGLQuery>(reader.read<ULONG>()))
+            replay.send<EndQueryCmd>(target);
     }
 };
+DEFINE_COMMAND(EndQueryCmd)
 
 void D3DGLQuery::queryDataGL()
 {
@@ -82,7 +137,6 @@ void D3DGLQuery::queryDataGL()
         glGetQueryObjectuiv(mQueryId, GL_QUERY_RESULT, &mQueryResult);
         mState = Signaled;
     }
-    --mPendingQueries;
     checkGLError();
 }
 class QueryDataCmd : public Command {
@@ -91,12 +145,22 @@ class QueryDataCmd : public Command {
 public:
     QueryDataCmd(D3DGLQuery *target) : mTarget(target) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->queryDataGL();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        if(D3DGLQuery *target = replay.getObject<D3DGLQuery>(reader.read<ULONG>()))
+            replay.send<QueryDataCmd>(target);
     }
 };
+DEFINE_COMMAND(QueryDataCmd)
 
 
 D3DGLQuery::D3DGLQuery(D3DGLDevice *parent)
@@ -104,7 +168,7 @@ D3DGLQuery::D3DGLQuery(D3DGLDevice *parent)
   , mParent(parent)
   , mQueryType(GL_NONE)
   , mQueryId(0)
-  , mPendingQueries(0)
+  , mDataSeq(0)
   , mState(Signaled)
 {
     mParent->AddRef();
@@ -115,8 +179,7 @@ D3DGLQuery::~D3DGLQuery()
     if(mQueryId)
     {
         mParent->getQueue().send<QueryDeinitCmd>(mQueryId);
-        while(mPendingQueries)
-            mParent->getQueue().wakeAndSleep();
+        mParent->getQueue().waitFor(mDataSeq);
         mQueryId = 0;
     }
 
@@ -214,8 +277,7 @@ HRESULT D3DGLQuery::Issue(DWORD flags)
     if((flags&D3DISSUE_BEGIN))
     {
         // Need to wait for any data queries to finish first
-        while(mPendingQueries)
-            mParent->getQueue().wakeAndSleep();
+        mParent->getQueue().waitFor(mDataSeq);
         mState = Building;
         mParent->getQueue().send<BeginQueryCmd>(this);
     }
@@ -229,9 +291,9 @@ HRESULT D3DGLQuery::GetData(void *data, DWORD size, DWORD flags)
 
     if(mState == Issued)
     {
-        ULONG zero = 0;
-        if(mPendingQueries.compare_exchange_strong(zero, 1))
-            mParent->getQueue().send<QueryDataCmd>(this);
+        // Only check for the result once the last check is done.
+        if(mParent->getQueue().isExecuted(mDataSeq))
+            mDataSeq = mParent->getQueue().send<QueryDataCmd>(this);
         if((flags&D3DGETDATA_FLUSH))
             mParent->getQueue().flush();
         return S_FALSE;
@@ -4,6 +4,8 @@
 #include "trace.hpp"
 #include "glformat.hpp"
 #include "device.hpp"
+#include "capture.hpp"
+#include "capturereplay.hpp"
 #include "private_iids.hpp"
 
 
@@ -13,13 +15,22 @@ class DeleteRenderbuffer : public Command {
 public:
     DeleteRenderbuffer(GLuint id) : mId(id) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glDeleteRenderbuffers(1, &mId);
         checkGLError();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Renderbuffer, mId);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.releaseObject(reader.read<ULONG>());
     }
 };
+DEFINE_COMMAND(DeleteRenderbuffer)
 
 
 void D3DGLRenderTarget::initGL()
@@ -43,12 +54,46 @@ class InitRenderTargetCmd : public Command {
 public:
     InitRenderTargetCmd(D3DGLRenderTarget *target) : mTarget(target) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->initGL();
-        return sizeof(*this);
+    }
+
+    // Render targets the device makes for itself, like the backbuffers, are
+    // replayed as ordinary ones.
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeNewObject(mTarget);
+        capture.write(mTarget->getDesc());
+    }
+    void captured(CommandCapture &capture) const
+    {
+        capture.addName(CaptureName_Renderbuffer, mTarget->getId(), mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        ULONG id = reader.read<ULONG>();
+        D3DSURFACE_DESC desc = reader.read<D3DSURFACE_DESC>();
+        IDirect3DSurface9 *surface;
+        HRESULT hr;
+        if((desc.Usage&D3DUSAGE_DEPTHSTENCIL))
+            hr = replay.getDevice()->CreateDepthStencilSurface(desc.Width, desc.Height, desc.Format,
+                desc.MultiSampleType, desc.MultiSampleQuality, FALSE, &surface, nullptr
+            );
+        else
+            hr = replay.getDevice()->CreateRenderTarget(desc.Width, desc.Height, desc.Format,
+                desc.MultiSampleType, desc.MultiSampleQuality, FALSE, &surface, nullptr
+            );
+        if(FAILED(hr))
+        {
+            ERR("Failed to create render target %lu: 0x%lx\n", id, hr);
+            return;
+        }
+        D3DGLRenderTarget *target = static_cast<D3DGLRenderTarget*>(surface);
+        replay.addObject(id, surface, target, target->getId());
     }
 };
+DEFINE_COMMAND(InitRenderTargetCmd)
 
 D3DGLRenderTarget::D3DGLRenderTarget(D3DGLDevice *parent)
   : mRefCount(0)
@@ -62,7 +107,10 @@ D3DGLRenderTarget::D3DGLRenderTarget(D3DGLDevice *parent)
 D3DGLRenderTarget::~D3DGLRenderTarget()
 {
     if(mId != 0)
+    {
+        mParent->releaseFBAttachment(true, mId);
         mParent->getQueue().send<DeleteRenderbuffer>(mId);
+    }
 }
 
 bool D3DGLRenderTarget::init(const D3DSURFACE_DESC *desc, bool isauto)
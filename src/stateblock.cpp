@@ -0,0 +1,280 @@
+
+#include "stateblock.hpp"
+
+#include "trace.hpp"
+#include "private_iids.hpp"
+
+
+// The render, sampler and texture stage states saved by D3DSBT_PIXELSTATE
+// and D3DSBT_VERTEXSTATE blocks.
+static const D3DRENDERSTATETYPE PixelRenderStates[] = {
+    D3DRS_ZENABLE, D3DRS_FILLMODE, D3DRS_SHADEMODE, D3DRS_ZWRITEENABLE,
+    D3DRS_ALPHATESTENABLE, D3DRS_LASTPIXEL, D3DRS_SRCBLEND, D3DRS_DESTBLEND,
+    D3DRS_ZFUNC, D3DRS_ALPHAREF, D3DRS_ALPHAFUNC, D3DRS_DITHERENABLE,
+    D3DRS_FOGSTART, D3DRS_FOGEND, D3DRS_FOGDENSITY, D3DRS_ALPHABLENDENABLE,
+    D3DRS_DEPTHBIAS, D3DRS_STENCILENABLE, D3DRS_STENCILFAIL, D3DRS_STENCILZFAIL,
+    D3DRS_STENCILPASS, D3DRS_STENCILFUNC, D3DRS_STENCILREF, D3DRS_STENCILMASK,
+    D3DRS_STENCILWRITEMASK, D3DRS_TEXTUREFACTOR, D3DRS_WRAP0, D3DRS_WRAP1,
+    D3DRS_WRAP2, D3DRS_WRAP3, D3DRS_WRAP4, D3DRS_WRAP5, D3DRS_WRAP6, D3DRS_WRAP7,
+    D3DRS_WRAP8, D3DRS_WRAP9, D3DRS_WRAP10, D3DRS_WRAP11, D3DRS_WRAP12,
+    D3DRS_WRAP13, D3DRS_WRAP14, D3DRS_WRAP15, D3DRS_COLORWRITEENABLE,
+    D3DRS_BLENDOP, D3DRS_SCISSORTESTENABLE, D3DRS_SLOPESCALEDEPTHBIAS,
+    D3DRS_ANTIALIASEDLINEENABLE, D3DRS_TWOSIDEDSTENCILMODE, D3DRS_CCW_STENCILFAIL,
+    D3DRS_CCW_STENCILZFAIL, D3DRS_CCW_STENCILPASS, D3DRS_CCW_STENCILFUNC,
+    D3DRS_COLORWRITEENABLE1, D3DRS_COLORWRITEENABLE2, D3DRS_COLORWRITEENABLE3,
+    D3DRS_BLENDFACTOR, D3DRS_SRGBWRITEENABLE, D3DRS_SEPARATEALPHABLENDENABLE,
+    D3DRS_SRCBLENDALPHA, D3DRS_DESTBLENDALPHA, D3DRS_BLENDOPALPHA
+};
+static const D3DRENDERSTATETYPE VertexRenderStates[] = {
+    D3DRS_CULLMODE, D3DRS_FOGENABLE, D3DRS_FOGCOLOR, D3DRS_FOGTABLEMODE,
+    D3DRS_FOGSTART, D3DRS_FOGEND, D3DRS_FOGDENSITY, D3DRS_RANGEFOGENABLE,
+    D3DRS_AMBIENT, D3DRS_COLORVERTEX, D3DRS_FOGVERTEXMODE, D3DRS_CLIPPING,
+    D3DRS_LIGHTING, D3DRS_NORMALIZENORMALS, D3DRS_LOCALVIEWER,
+    D3DRS_EMISSIVEMATERIALSOURCE, D3DRS_AMBIENTMATERIALSOURCE,
+    D3DRS_DIFFUSEMATERIALSOURCE, D3DRS_SPECULARMATERIALSOURCE, D3DRS_VERTEXBLEND,
+    D3DRS_CLIPPLANEENABLE, D3DRS_POINTSIZE, D3DRS_POINTSIZE_MIN,
+    D3DRS_POINTSPRITEENABLE, D3DRS_POINTSCALEENABLE, D3DRS_POINTSCALE_A,
+    D3DRS_POINTSCALE_B, D3DRS_POINTSCALE_C, D3DRS_MULTISAMPLEANTIALIAS,
+    D3DRS_MULTISAMPLEMASK, D3DRS_PATCHEDGESTYLE, D3DRS_POINTSIZE_MAX,
+    D3DRS_INDEXEDVERTEXBLENDENABLE, D3DRS_TWEENFACTOR, D3DRS_POSITIONDEGREE,
+    D3DRS_NORMALDEGREE, D3DRS_MINTESSELLATIONLEVEL, D3DRS_MAXTESSELLATIONLEVEL,
+    D3DRS_ADAPTIVETESS_X, D3DRS_ADAPTIVETESS_Y, D3DRS_ADAPTIVETESS_Z,
+    D3DRS_ADAPTIVETESS_W, D3DRS_ENABLEADAPTIVETESSELLATION, D3DRS_SPECULARENABLE,
+    D3DRS_SHADEMODE
+};
+static const DWORD VertexSamplerStates = 1<<D3DSAMP_DMAPOFFSET;
+static const DWORD VertexTexStageStates = (1<<D3DTSS_TEXCOORDINDEX) |
+                                          (1<<D3DTSS_TEXTURETRANSFORMFLAGS);
+
+// Converts a texture index to the stage used by Get/SetTexture.
+static DWORD GetTextureStage(DWORD index)
+{
+    if(index >= MAX_FRAGMENT_SAMPLERS)
+        return index - MAX_FRAGMENT_SAMPLERS + D3DVERTEXTEXTURESAMPLER0;
+    return index;
+}
+
+
+D3DGLStateBlock::D3DGLStateBlock(D3DGLDevice *parent)
+  : mRefCount(0)
+  , mParent(parent)
+  , mSamplerStateMask{{0}}
+  , mTexStageStateMask{{0}}
+  , mHasViewport(false)
+  , mHasScissorRect(false)
+  , mHasMaterial(false)
+  , mVSConstantIMask(0)
+  , mPSConstantIMask(0)
+  , mVSConstantBMask(0)
+  , mVSConstantsB(0)
+  , mPSConstantBMask(0)
+  , mPSConstantsB(0)
+  , mStreamFreqMask(0)
+  , mTextureMask(0)
+  , mTextures{{nullptr}}
+  , mHasVertexShader(false)
+  , mVertexShader(nullptr)
+  , mHasPixelShader(false)
+  , mPixelShader(nullptr)
+  , mHasVertexDecl(false)
+  , mVertexDecl(nullptr)
+  , mStreamMask(0)
+  , mStreams{{nullptr}}
+  , mHasIndices(false)
+  , mIndices(nullptr)
+  , mPacketValid(false)
+{
+    mParent->AddRef();
+}
+
+D3DGLStateBlock::~D3DGLStateBlock()
+{
+    for(auto texture : mTextures)
+    {
+        if(texture)
+            texture->Release();
+    }
+    if(mVertexShader) mVertexShader->Release();
+    if(mPixelShader) mPixelShader->Release();
+    if(mVertexDecl) mVertexDecl->Release();
+    for(auto stream : mStreams)
+    {
+        if(stream)
+            stream->Release();
+    }
+    if(mIndices) mIndices->Release();
+
+    mParent->Release();
+}
+
+void D3DGLStateBlock::init(D3DSTATEBLOCKTYPE type)
+{
+    if(type == D3DSBT_ALL)
+    {
+        mRenderStateMask.set();
+        mSamplerStateMask.fill((1u<<mSamplerState[0].size()) - 1);
+        mTexStageStateMask.fill((1u<<mTexStageState[0].size()) - 1);
+        mHasViewport = true;
+        mHasScissorRect = true;
+        mHasMaterial = true;
+        mVSConstantFMask.set();
+        mPSConstantFMask.set();
+        mVSConstantIMask = (1u<<mVSConstantsI.size()) - 1;
+        mPSConstantIMask = (1u<<mPSConstantsI.size()) - 1;
+        mVSConstantBMask = 0xffff;
+        mPSConstantBMask = 0xffff;
+        mStreamFreqMask = (1u<<mStreamFreqs.size()) - 1;
+        mTextureMask = (1u<<mTextures.size()) - 1;
+        mHasVertexShader = true;
+        mHasPixelShader = true;
+        mHasVertexDecl = true;
+        mStreamMask = (1u<<mStreams.size()) - 1;
+        mHasIndices = true;
+    }
+    else if(type == D3DSBT_PIXELSTATE)
+    {
+        for(D3DRENDERSTATETYPE state : PixelRenderStates)
+            mRenderStateMask.set(state);
+        mSamplerStateMask.fill(((1u<<mSamplerState[0].size()) - 1) & ~VertexSamplerStates);
+        mTexStageStateMask.fill(((1u<<mTexStageState[0].size()) - 1) & ~VertexTexStageStates);
+        mPSConstantFMask.set();
+        mPSConstantIMask = (1u<<mPSConstantsI.size()) - 1;
+        mPSConstantBMask = 0xffff;
+        mHasPixelShader = true;
+    }
+    else if(type == D3DSBT_VERTEXSTATE)
+    {
+        for(D3DRENDERSTATETYPE state : VertexRenderStates)
+            mRenderStateMask.set(state);
+        mSamplerStateMask.fill(VertexSamplerStates);
+        mTexStageStateMask.fill(VertexTexStageStates);
+        mVSConstantFMask.set();
+        mVSConstantIMask = (1u<<mVSConstantsI.size()) - 1;
+        mVSConstantBMask = 0xffff;
+        mStreamFreqMask = (1u<<mStreamFreqs.size()) - 1;
+        mHasVertexShader = true;
+        mHasVertexDecl = true;
+    }
+}
+
+
+HRESULT D3DGLStateBlock::QueryInterface(REFIID riid, void **obj)
+{
+    TRACE("iface %p, riid %s, obj %p\n", this, debugstr_guid(riid), obj);
+
+    *obj = NULL;
+    RETURN_IF_IID_TYPE(obj, riid, D3DGLStateBlock);
+    RETURN_IF_IID_TYPE(obj, riid, IDirect3DStateBlock9);
+    RETURN_IF_IID_TYPE(obj, riid, IUnknown);
+
+    FIXME("Unsupported interface %s\n", debugstr_guid(riid));
+    return E_NOINTERFACE;
+}
+
+ULONG D3DGLStateBlock::AddRef()
+{
+    ULONG ret = ++mRefCount;
+    TRACE("%p New refcount: %lu\n", this, ret);
+    return ret;
+}
+
+ULONG D3DGLStateBlock::Release()
+{
+    ULONG ret = --mRefCount;
+    TRACE("%p New refcount: %lu\n", this, ret);
+    if(ret == 0) delete this;
+    return ret;
+}
+
+
+HRESULT D3DGLStateBlock::GetDevice(IDirect3DDevice9 **device)
+{
+    TRACE("iface %p, device %p\n", this, device);
+    *device = mParent;
+    (*device)->AddRef();
+    return D3D_OK;
+}
+
+HRESULT D3DGLStateBlock::Capture()
+{
+    TRACE("iface %p\n", this);
+
+    mParent->captureStateBlock(this);
+
+    for(DWORD i = 0;i < mTextures.size();++i)
+    {
+        if(!(mTextureMask&(1<<i)))
+            continue;
+        IDirect3DBaseTexture9 *texture = nullptr;
+        mParent->GetTexture(GetTextureStage(i), &texture);
+        if(mTextures[i]) mTextures[i]->Release();
+        mTextures[i] = texture;
+    }
+    if(mHasVertexShader)
+    {
+        IDirect3DVertexShader9 *shader = nullptr;
+        mParent->GetVertexShader(&shader);
+        if(mVertexShader) mVertexShader->Release();
+        mVertexShader = shader;
+    }
+    if(mHasPixelShader)
+    {
+        IDirect3DPixelShader9 *shader = nullptr;
+        mParent->GetPixelShader(&shader);
+        if(mPixelShader) mPixelShader->Release();
+        mPixelShader = shader;
+    }
+    if(mHasVertexDecl)
+    {
+        IDirect3DVertexDeclaration9 *decl = nullptr;
+        mParent->GetVertexDeclaration(&decl);
+        if(mVertexDecl) mVertexDecl->Release();
+        mVertexDecl = decl;
+    }
+    for(DWORD i = 0;i < mStreams.size();++i)
+    {
+        if(!(mStreamMask&(1<<i)))
+            continue;
+        IDirect3DVertexBuffer9 *stream = nullptr;
+        mParent->GetStreamSource(i, &stream, &mStreamOffsets[i], &mStreamStrides[i]);
+        if(mStreams[i]) mStreams[i]->Release();
+        mStreams[i] = stream;
+    }
+    if(mHasIndices)
+    {
+        IDirect3DIndexBuffer9 *indices = nullptr;
+        mParent->GetIndices(&indices);
+        if(mIndices) mIndices->Release();
+        mIndices = indices;
+    }
+
+    return D3D_OK;
+}
+
+HRESULT D3DGLStateBlock::Apply()
+{
+    TRACE("iface %p\n", this);
+
+    mParent->applyStateBlock(this);
+
+    for(DWORD i = 0;i < mTextures.size();++i)
+    {
+        if((mTextureMask&(1<<i)))
+            mParent->SetTexture(GetTextureStage(i), mTextures[i]);
+    }
+    if(mHasVertexDecl)
+        mParent->SetVertexDeclaration(mVertexDecl);
+    if(mHasVertexShader)
+        mParent->SetVertexShader(mVertexShader);
+    if(mHasPixelShader)
+        mParent->SetPixelShader(mPixelShader);
+    for(DWORD i = 0;i < mStreams.size();++i)
+    {
+        if((mStreamMask&(1<<i)))
+            mParent->SetStreamSource(i, mStreams[i], mStreamOffsets[i], mStreamStrides[i]);
+    }
+    if(mHasIndices)
+        mParent->SetIndices(mIndices);
+
+    return D3D_OK;
+}
@@ -6,15 +6,18 @@
 #include "trace.hpp"
 #include "device.hpp"
 #include "rendertarget.hpp"
+#include "capture.hpp"
+#include "capturereplay.hpp"
 #include "private_iids.hpp"
 
 
-void D3DGLSwapChain::swapBuffersGL(size_t backbuffer)
+void D3DGLSwapChain::swapBuffersGL(D3DGLRenderTarget *backbuffer)
 {
     // Flip the destination since we rendered upside down.
-    RECT src_rect = { 0, 0, (INT)mParams.BackBufferWidth, (INT)mParams.BackBufferHeight };
+    const D3DSURFACE_DESC &desc = backbuffer->getDesc();
+    RECT src_rect = { 0, 0, (INT)desc.Width, (INT)desc.Height };
     RECT dst_rect = { 0, (INT)mParams.BackBufferHeight-1, (INT)mParams.BackBufferWidth, 0-1 };
-    mParent->blitFramebufferGL(GL_RENDERBUFFER, mBackbuffers[backbuffer]->getId(), 0, src_rect,
+    mParent->blitFramebufferGL(GL_RENDERBUFFER, backbuffer->getId(), 0, src_rect,
                                GL_NONE, 0, 0, dst_rect, GL_NEAREST);
 
     if(!SwapBuffers(mDevCtx))
@@ -26,17 +29,31 @@ void D3DGLSwapChain::swapBuffersGL(size_t backbuffer)
 }
 class SwapchainSwapBuffers : public Command {
     D3DGLSwapChain *mTarget;
-    size_t mBackbuffer;
+    D3DGLRenderTarget *mBackbuffer;
 
 public:
-    SwapchainSwapBuffers(D3DGLSwapChain *target, size_t backbuffer) : mTarget(target), mBackbuffer(backbuffer) { }
+    SwapchainSwapBuffers(D3DGLSwapChain *target, D3DGLRenderTarget *backbuffer)
+      : mTarget(target), mBackbuffer(backbuffer)
+    { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->swapBuffersGL(mBackbuffer);
-        return sizeof(*this);
+    }
+
+    // The replay presents to its own window, so only the backbuffer is
+    // needed.
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mBackbuffer);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        if(D3DGLRenderTarget *backbuffer = replay.getObject<D3DGLRenderTarget>(reader.read<ULONG>()))
+            replay.present(backbuffer);
     }
 };
+DEFINE_COMMAND(SwapchainSwapBuffers)
 
 class SetSwapIntervalCmd : public Command {
     int mInterval;
@@ -44,16 +61,24 @@ class SetSwapIntervalCmd : public Command {
 public:
     SetSwapIntervalCmd(int interval) : mInterval(interval) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         if(WGLEW_EXT_swap_control)
         {
             if(!wglSwapIntervalEXT(mInterval))
                 ERR("Failed to set swap interval %d, error 0x%lx\n", mInterval, GetLastError());
         }
-        return sizeof(*this);
     }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.write(mInterval);
+    }
+    // The replay presents as fast as it can, ignoring the captured interval.
+    static void replay(CaptureReader&, CaptureReplay&)
+    { }
 };
+DEFINE_COMMAND(SetSwapIntervalCmd)
 
 
 D3DGLSwapChain::D3DGLSwapChain(D3DGLDevice *parent)
@@ -239,6 +264,12 @@ HRESULT D3DGLSwapChain::Present(const RECT *srcRect, const RECT *dstRect, HWND d
     if(flags)
         FIXME("Ignoring flags 0x%lx\n", flags);
 
+    present(mBackbuffers[0]);
+    return D3D_OK;
+}
+
+ULONG D3DGLSwapChain::present(D3DGLRenderTarget *backbuffer)
+{
     // Wait for the last swap to complete before doing the next one
     CommandQueue &cmdqueue = mParent->getQueue();
     cmdqueue.beginWait();
@@ -251,12 +282,14 @@ HRESULT D3DGLSwapChain::Present(const RECT *srcRect, const RECT *dstRect, HWND d
     // occuring in between the buffer check and the SleepConditionVariableCS
     // call.
     ++mPendingSwaps;
-    cmdqueue.send<SwapchainSwapBuffers>(this, 0);
+    ULONG seq = cmdqueue.send<SwapchainSwapBuffers>(this, backbuffer);
     cmdqueue.endWait();
 
     cmdqueue.wake();
+    mParent->endFrame();
+    cmdqueue.dumpStats();
 
-    return D3D_OK;
+    return seq;
 }
 
 HRESULT D3DGLSwapChain::GetFrontBufferData(IDirect3DSurface9 *dstSurface)
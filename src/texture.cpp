@@ -8,6 +8,8 @@
 #include "d3dgl.hpp"
 #include "device.hpp"
 #include "adapter.hpp"
+#include "capture.hpp"
+#include "capturereplay.hpp"
 #include "private_iids.hpp"
 
 
@@ -58,8 +60,6 @@ void D3DGLTexture::initGL()
 
     if(mDesc.Pool != D3DPOOL_DEFAULT)
         mSysMem.assign(total_size, 0);
-
-    mUpdateInProgress = 0;
 }
 class TextureInitCmd : public Command {
     D3DGLTexture *mTarget;
@@ -67,12 +67,39 @@ class TextureInitCmd : public Command {
 public:
     TextureInitCmd(D3DGLTexture *target) : mTarget(target) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->initGL();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeNewObject(mTarget);
+        capture.write(mTarget->getDesc());
+        capture.write<DWORD>(mTarget->GetLevelCount());
+    }
+    void captured(CommandCapture &capture) const
+    {
+        capture.addName(CaptureName_Texture, mTarget->getTextureId(), mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        ULONG id = reader.read<ULONG>();
+        D3DSURFACE_DESC desc = reader.read<D3DSURFACE_DESC>();
+        DWORD levels = reader.read<DWORD>();
+        IDirect3DTexture9 *tex;
+        HRESULT hr = replay.getDevice()->CreateTexture(desc.Width, desc.Height, levels, desc.Usage,
+                                                       desc.Format, desc.Pool, &tex, nullptr);
+        if(FAILED(hr))
+        {
+            ERR("Failed to create texture %lu: 0x%lx\n", id, hr);
+            return;
+        }
+        D3DGLTexture *target = static_cast<D3DGLTexture*>(tex);
+        replay.addObject(id, tex, target, target->getTextureId());
     }
 };
+DEFINE_COMMAND(TextureInitCmd)
 
 class TextureDeinitCmd : public Command {
     GLuint mTexId;
@@ -80,13 +107,22 @@ class TextureDeinitCmd : public Command {
 public:
     TextureDeinitCmd(GLuint texid) : mTexId(texid) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glDeleteTextures(1, &mTexId);
         checkGLError();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Texture, mTexId);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.releaseObject(reader.read<ULONG>());
     }
 };
+DEFINE_COMMAND(TextureDeinitCmd)
 
 
 void D3DGLTexture::genMipmapGL()
@@ -100,12 +136,22 @@ class TextureGenMipCmd : public Command {
 public:
     TextureGenMipCmd(D3DGLTexture *target) : mTarget(target) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->genMipmapGL();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        if(D3DGLTexture *target = replay.getObject<D3DGLTexture>(reader.read<ULONG>()))
+            replay.send<TextureGenMipCmd>(target);
     }
 };
+DEFINE_COMMAND(TextureGenMipCmd)
 
 
 void D3DGLTexture::loadTexLevelGL(DWORD level, const RECT &rect, const GLubyte *dataPtr)
@@ -147,8 +193,6 @@ void D3DGLTexture::loadTexLevelGL(DWORD level, const RECT &rect, const GLubyte *
     if(level == 0 && (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mSurfaces.size() > 1)
         glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_2D);
     checkGLError();
-
-    --mUpdateInProgress;
 }
 class TextureLoadLevelCmd : public Command {
     D3DGLTexture *mTarget;
@@ -161,12 +205,31 @@ public:
       : mTarget(target), mLevel(level), mRect(rect), mDataPtr(dataPtr)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->loadTexLevelGL(mLevel, mRect, mDataPtr);
-        return sizeof(*this);
+    }
+
+    // The data points to the start of the level.
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mTarget);
+        capture.write(mLevel);
+        capture.write(mRect);
+        capture.writeData(mDataPtr, mTarget->getSurface(mLevel)->getDataLength());
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        D3DGLTexture *target = replay.getObject<D3DGLTexture>(reader.read<ULONG>());
+        DWORD level = reader.read<DWORD>();
+        RECT rect = reader.read<RECT>();
+        size_t length;
+        const GLubyte *data = reinterpret_cast<const GLubyte*>(reader.readData(length));
+        if(target && data)
+            target->updateTexture(level, rect, data);
     }
 };
+DEFINE_COMMAND(TextureLoadLevelCmd)
 
 
 D3DGLTexture::D3DGLTexture(D3DGLDevice *parent)
@@ -177,7 +240,7 @@ D3DGLTexture::D3DGLTexture(D3DGLDevice *parent)
   , mTexId(0)
   , mDirtyRect({std::numeric_limits<LONG>::max(), std::numeric_limits<LONG>::max(),
                 std::numeric_limits<LONG>::min(), std::numeric_limits<LONG>::min()})
-  , mUpdateInProgress(0)
+  , mUpdateSeq(0)
   , mLodLevel(0)
 {
 }
@@ -186,9 +249,10 @@ D3DGLTexture::~D3DGLTexture()
 {
     if(mTexId)
     {
+        if((mDesc.Usage&(D3DUSAGE_RENDERTARGET|D3DUSAGE_DEPTHSTENCIL)))
+            mParent->releaseFBAttachment(false, mTexId);
         mParent->getQueue().send<TextureDeinitCmd>(mTexId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
+        mParent->getQueue().waitFor(mUpdateSeq);
         mTexId = 0;
     }
 
@@ -273,10 +337,7 @@ bool D3DGLTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
         mSurfaces.push_back(new D3DGLTextureSurface(this, i));
 
     if(mDesc.Format != D3DFMT_NULL)
-    {
-        mUpdateInProgress = 1;
         mParent->getQueue().sendSync<TextureInitCmd>(this);
-    }
 
     return true;
 }
@@ -285,8 +346,7 @@ void D3DGLTexture::updateTexture(DWORD level, const RECT &rect, const GLubyte *d
 {
     CommandQueue &queue = mParent->getQueue();
     queue.lock();
-    ++mUpdateInProgress;
-    queue.doSend<TextureLoadLevelCmd>(this, level, rect, dataPtr);
+    CommandQueue::raiseSeq(mUpdateSeq, queue.doSend<TextureLoadLevelCmd>(this, level, rect, dataPtr));
     queue.unlock();
 }
 
@@ -671,10 +731,7 @@ HRESULT D3DGLTextureSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *re
 
     // No need to wait if we're not writing over previous data.
     if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
-    {
-        while(mParent->mUpdateInProgress)
-            mParent->mParent->getQueue().wakeAndSleep();
-    }
+        mParent->mParent->getQueue().waitFor(mParent->mUpdateSeq);
 
     GLubyte *memPtr = &mParent->mSysMem[mDataOffset];
     mLockRegion = *rect;
@@ -8,6 +8,8 @@
 #include "d3dgl.hpp"
 #include "device.hpp"
 #include "adapter.hpp"
+#include "capture.hpp"
+#include "capturereplay.hpp"
 #include "private_iids.hpp"
 
 
@@ -61,8 +63,6 @@ void D3DGLTexture3D::initGL()
 
     if(mDesc.Pool != D3DPOOL_DEFAULT)
         mSysMem.assign(total_size, 0);
-
-    mUpdateInProgress = 0;
 }
 class Texture3DInitCmd : public Command {
     D3DGLTexture3D *mTarget;
@@ -70,12 +70,40 @@ class Texture3DInitCmd : public Command {
 public:
     Texture3DInitCmd(D3DGLTexture3D *target) : mTarget(target) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->initGL();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeNewObject(mTarget);
+        capture.write(mTarget->getDesc());
+        capture.write<DWORD>(mTarget->GetLevelCount());
+    }
+    void captured(CommandCapture &capture) const
+    {
+        capture.addName(CaptureName_Texture, mTarget->getTextureId(), mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        ULONG id = reader.read<ULONG>();
+        D3DVOLUME_DESC desc = reader.read<D3DVOLUME_DESC>();
+        DWORD levels = reader.read<DWORD>();
+        IDirect3DVolumeTexture9 *tex;
+        HRESULT hr = replay.getDevice()->CreateVolumeTexture(desc.Width, desc.Height, desc.Depth, levels,
+                                                             desc.Usage, desc.Format, desc.Pool, &tex,
+                                                             nullptr);
+        if(FAILED(hr))
+        {
+            ERR("Failed to create volume texture %lu: 0x%lx\n", id, hr);
+            return;
+        }
+        D3DGLTexture3D *target = static_cast<D3DGLTexture3D*>(tex);
+        replay.addObject(id, tex, target, target->getTextureId());
     }
 };
+DEFINE_COMMAND(Texture3DInitCmd)
 
 class Texture3DDeinitCmd : public Command {
     GLuint mTexId;
@@ -83,13 +111,22 @@ class Texture3DDeinitCmd : public Command {
 public:
     Texture3DDeinitCmd(GLuint texid) : mTexId(texid) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glDeleteTextures(1, &mTexId);
         checkGLError();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Texture, mTexId);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.releaseObject(reader.read<ULONG>());
     }
 };
+DEFINE_COMMAND(Texture3DDeinitCmd)
 
 
 void D3DGLTexture3D::genMipmapGL()
@@ -103,12 +140,22 @@ class Texture3DGenMipCmd : public Command {
 public:
     Texture3DGenMipCmd(D3DGLTexture3D *target) : mTarget(target) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->genMipmapGL();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        if(D3DGLTexture3D *target = replay.getObject<D3DGLTexture3D>(reader.read<ULONG>()))
+            replay.send<Texture3DGenMipCmd>(target);
     }
 };
+DEFINE_COMMAND(Texture3DGenMipCmd)
 
 
 void D3DGLTexture3D::loadTexLevelGL(DWORD level, const D3DBOX &box, const GLubyte *dataPtr)
@@ -155,8 +202,6 @@ void D3DGLTexture3D::loadTexLevelGL(DWORD level, const D3DBOX &box, const GLubyt
     if(level == 0 && (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mVolumes.size() > 1)
         glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_3D);
     checkGLError();
-
-    --mUpdateInProgress;
 }
 class Texture3DLoadLevelCmd : public Command {
     D3DGLTexture3D *mTarget;
@@ -169,12 +214,31 @@ public:
       : mTarget(target), mLevel(level), mBox(box), mDataPtr(dataPtr)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->loadTexLevelGL(mLevel, mBox, mDataPtr);
-        return sizeof(*this);
+    }
+
+    // The data points to the start of the level.
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mTarget);
+        capture.write(mLevel);
+        capture.write(mBox);
+        capture.writeData(mDataPtr, mTarget->getVolume(mLevel)->getDataLength());
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        D3DGLTexture3D *target = replay.getObject<D3DGLTexture3D>(reader.read<ULONG>());
+        DWORD level = reader.read<DWORD>();
+        D3DBOX box = reader.read<D3DBOX>();
+        size_t length;
+        const GLubyte *data = reinterpret_cast<const GLubyte*>(reader.readData(length));
+        if(target && data)
+            target->updateTexture(level, box, data);
     }
 };
+DEFINE_COMMAND(Texture3DLoadLevelCmd)
 
 
 D3DGLTexture3D::D3DGLTexture3D(D3DGLDevice *parent)
@@ -186,7 +250,7 @@ D3DGLTexture3D::D3DGLTexture3D(D3DGLDevice *parent)
   , mDirtyBox({std::numeric_limits<UINT>::max(), std::numeric_limits<UINT>::max(),
                std::numeric_limits<UINT>::min(), std::numeric_limits<UINT>::min(),
                std::numeric_limits<UINT>::min(), std::numeric_limits<UINT>::max()})
-  , mUpdateInProgress(0)
+  , mUpdateSeq(0)
   , mLodLevel(0)
 {
 }
@@ -196,8 +260,7 @@ D3DGLTexture3D::~D3DGLTexture3D()
     if(mTexId)
     {
         mParent->getQueue().send<Texture3DDeinitCmd>(mTexId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
+        mParent->getQueue().waitFor(mUpdateSeq);
         mTexId = 0;
     }
 
@@ -282,10 +345,7 @@ bool D3DGLTexture3D::init(const D3DVOLUME_DESC *desc, UINT levels)
         mVolumes.push_back(new D3DGLTextureVolume(this, i));
 
     if(mDesc.Format != D3DFMT_NULL)
-    {
-        mUpdateInProgress = 1;
         mParent->getQueue().sendSync<Texture3DInitCmd>(this);
-    }
 
     return true;
 }
@@ -294,8 +354,7 @@ void D3DGLTexture3D::updateTexture(DWORD level, const D3DBOX &box, const GLubyte
 {
     CommandQueue &queue = mParent->getQueue();
     queue.lock();
-    ++mUpdateInProgress;
-    queue.doSend<Texture3DLoadLevelCmd>(this, level, box, dataPtr);
+    CommandQueue::raiseSeq(mUpdateSeq, queue.doSend<Texture3DLoadLevelCmd>(this, level, box, dataPtr));
     queue.unlock();
 }
 
@@ -657,10 +716,7 @@ HRESULT D3DGLTextureVolume::LockBox(D3DLOCKED_BOX *lockedbox, const D3DBOX *box,
 
     // No need to wait if we're not writing over previous data.
     if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
-    {
-        while(mParent->mUpdateInProgress)
-            mParent->mParent->getQueue().wakeAndSleep();
-    }
+        mParent->mParent->getQueue().waitFor(mParent->mUpdateSeq);
 
     GLubyte *memPtr = &mParent->mSysMem[mDataOffset];
     mLockRegion = *box;
@@ -9,6 +9,8 @@
 #include "d3dgl.hpp"
 #include "device.hpp"
 #include "adapter.hpp"
+#include "capture.hpp"
+#include "capturereplay.hpp"
 #include "private_iids.hpp"
 
 
@@ -72,8 +74,6 @@ void D3DGLCubeTexture::initGL()
 
     if(mDesc.Pool != D3DPOOL_DEFAULT)
         mSysMem.assign(total_size, 0);
-
-    mUpdateInProgress = 0;
 }
 class CubeTextureInitCmd : public Command {
     D3DGLCubeTexture *mTarget;
@@ -81,12 +81,39 @@ class CubeTextureInitCmd : public Command {
 public:
     CubeTextureInitCmd(D3DGLCubeTexture *target) : mTarget(target) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->initGL();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeNewObject(mTarget);
+        capture.write(mTarget->getDesc());
+        capture.write<DWORD>(mTarget->GetLevelCount());
+    }
+    void captured(CommandCapture &capture) const
+    {
+        capture.addName(CaptureName_Texture, mTarget->getTextureId(), mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        ULONG id = reader.read<ULONG>();
+        D3DSURFACE_DESC desc = reader.read<D3DSURFACE_DESC>();
+        DWORD levels = reader.read<DWORD>();
+        IDirect3DCubeTexture9 *tex;
+        HRESULT hr = replay.getDevice()->CreateCubeTexture(desc.Width, levels, desc.Usage, desc.Format,
+                                                           desc.Pool, &tex, nullptr);
+        if(FAILED(hr))
+        {
+            ERR("Failed to create cube texture %lu: 0x%lx\n", id, hr);
+            return;
+        }
+        D3DGLCubeTexture *target = static_cast<D3DGLCubeTexture*>(tex);
+        replay.addObject(id, tex, target, target->getTextureId());
     }
 };
+DEFINE_COMMAND(CubeTextureInitCmd)
 
 
 class CubeTextureDeinitCmd : public Command {
@@ -95,13 +122,22 @@ class CubeTextureDeinitCmd : public Command {
 public:
     CubeTextureDeinitCmd(GLuint texid) : mTexId(texid) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glDeleteTextures(1, &mTexId);
         checkGLError();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Texture, mTexId);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.releaseObject(reader.read<ULONG>());
     }
 };
+DEFINE_COMMAND(CubeTextureDeinitCmd)
 
 
 void D3DGLCubeTexture::genMipmapGL()
@@ -115,12 +151,22 @@ class CubeTextureGenMipCmd : public Command {
 public:
     CubeTextureGenMipCmd(D3DGLCubeTexture *target) : mTarget(target) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->genMipmapGL();
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mTarget);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        if(D3DGLCubeTexture *target = replay.getObject<D3DGLCubeTexture>(reader.read<ULONG>()))
+            replay.send<CubeTextureGenMipCmd>(target);
     }
 };
+DEFINE_COMMAND(CubeTextureGenMipCmd)
 
 
 void D3DGLCubeTexture::loadTexLevelGL(DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr)
@@ -162,8 +208,6 @@ void D3DGLCubeTexture::loadTexLevelGL(DWORD level, GLint facenum, const RECT &re
     if(level == 0 && (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mSurfaces.size() > 1)
         glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_CUBE_MAP);
     checkGLError();
-
-    --mUpdateInProgress;
 }
 class CubeTextureLoadLevelCmd : public Command {
     D3DGLCubeTexture *mTarget;
@@ -177,12 +221,33 @@ public:
       : mTarget(target), mLevel(level), mFaceNum(facenum), mRect(rect), mDataPtr(dataPtr)
     { }
 
-    virtual ULONG execute()
+    void execute()
     {
         mTarget->loadTexLevelGL(mLevel, mFaceNum, mRect, mDataPtr);
-        return sizeof(*this);
+    }
+
+    // The data points to the start of the level.
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeObject(mTarget);
+        capture.write(mLevel);
+        capture.write(mFaceNum);
+        capture.write(mRect);
+        capture.writeData(mDataPtr, mTarget->getSurface(mLevel, mFaceNum)->getDataLength());
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        D3DGLCubeTexture *target = replay.getObject<D3DGLCubeTexture>(reader.read<ULONG>());
+        DWORD level = reader.read<DWORD>();
+        GLint facenum = reader.read<GLint>();
+        RECT rect = reader.read<RECT>();
+        size_t length;
+        const GLubyte *data = reinterpret_cast<const GLubyte*>(reader.readData(length));
+        if(target && data)
+            target->updateTexture(level, facenum, rect, data);
     }
 };
+DEFINE_COMMAND(CubeTextureLoadLevelCmd)
 
 
 D3DGLCubeTexture::D3DGLCubeTexture(D3DGLDevice *parent)
@@ -191,7 +256,7 @@ D3DGLCubeTexture::D3DGLCubeTexture(D3DGLDevice *parent)
   , mParent(parent)
   , mGLFormat(nullptr)
   , mTexId(0)
-  , mUpdateInProgress(0)
+  , mUpdateSeq(0)
   , mLodLevel(0)
 {
     for(RECT &rect : mDirtyRect)
@@ -203,9 +268,10 @@ D3DGLCubeTexture::~D3DGLCubeTexture()
 {
     if(mTexId)
     {
+        if((mDesc.Usage&(D3DUSAGE_RENDERTARGET|D3DUSAGE_DEPTHSTENCIL)))
+            mParent->releaseFBAttachment(false, mTexId);
         mParent->getQueue().send<CubeTextureDeinitCmd>(mTexId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
+        mParent->getQueue().waitFor(mUpdateSeq);
         mTexId = 0;
     }
 
@@ -297,10 +363,7 @@ bool D3DGLCubeTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
         WARN("Pre-mulitplied alpha textures not supported; loading anyway.");
 
     if(mDesc.Format != D3DFMT_NULL)
-    {
-        mUpdateInProgress = 1;
         mParent->getQueue().sendSync<CubeTextureInitCmd>(this);
-    }
 
     return true;
 }
@@ -309,8 +372,7 @@ void D3DGLCubeTexture::updateTexture(DWORD level, GLint facenum, const RECT &rec
 {
     CommandQueue &queue = mParent->getQueue();
     queue.lock();
-    ++mUpdateInProgress;
-    queue.doSend<CubeTextureLoadLevelCmd>(this, level, facenum, rect, dataPtr);
+    CommandQueue::raiseSeq(mUpdateSeq, queue.doSend<CubeTextureLoadLevelCmd>(this, level, facenum, rect, dataPtr));
     queue.unlock();
 }
 
@@ -708,10 +770,7 @@ HRESULT D3DGLCubeSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect,
 
     // No need to wait if we're not writing over previous data.
     if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
-    {
-        while(mParent->mUpdateInProgress)
-            mParent->mParent->getQueue().wakeAndSleep();
-    }
+        mParent->mParent->getQueue().waitFor(mParent->mUpdateSeq);
 
     GLubyte *memPtr = &mParent->mSysMem[mDataOffset];
     mLockRegion = *rect;
@@ -5,6 +5,8 @@
 
 #include "mojoshader/mojoshader.h"
 #include "device.hpp"
+#include "capture.hpp"
+#include "capturereplay.hpp"
 #include "trace.hpp"
 #include "private_iids.hpp"
 
@@ -82,6 +84,12 @@ GLuint D3DGLVertexShader::compileShaderGL(UINT shadowsamplers)
         GLuint v4f_idx = glGetUniformBlockIndex(program, "vs_vec4");
         if(v4f_idx != GL_INVALID_INDEX)
             glUniformBlockBinding(program, v4f_idx, VSF_BINDING_IDX);
+        GLuint v4i_idx = glGetUniformBlockIndex(program, "vs_ivec4");
+        if(v4i_idx != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, v4i_idx, VSI_BINDING_IDX);
+        GLuint b_idx = glGetUniformBlockIndex(program, "vs_bool");
+        if(b_idx != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, b_idx, VSB_BINDING_IDX);
         GLuint vtx_state_idx = glGetUniformBlockIndex(program, "vertex_state");
         if(vtx_state_idx != GL_INVALID_INDEX)
             glUniformBlockBinding(program, vtx_state_idx, VTXSTATE_BINDING_IDX);
@@ -109,7 +117,6 @@ GLuint D3DGLVertexShader::compileShaderGL(UINT shadowsamplers)
 done:
     MOJOSHADER_freeParseData(shader);
 
-    --mPendingUpdates;
     return program;
 }
 
@@ -119,18 +126,83 @@ class DeinitVShaderCmd : public Command {
 public:
     DeinitVShaderCmd(GLuint program) : mProgram(program) { }
 
-    virtual ULONG execute()
+    void execute()
     {
         glDeleteProgram(mProgram);
-        return sizeof(*this);
+    }
+
+    void capture(CommandCapture &capture) const
+    {
+        capture.writeName(CaptureName_Program, mProgram);
+    }
+    static void replay(CaptureReader &reader, CaptureReplay &replay)
+    {
+        replay.releaseObject(reader.read<ULONG>());
     }
 };
+DEFINE_COMMAND(DeinitVShaderCmd)
+DEFINE_COMMAND_EXECUTOR(CompileAndSetVShaderCmd)
+DEFINE_COMMAND_CAPTURE(CompileAndSetVShaderCmd)
+DEFINE_COMMAND_EXECUTOR(SetVShaderCmd)
+DEFINE_COMMAND_CAPTURE(SetVShaderCmd)
+
+// Each compile is replayed with a new shader, replacing the one for the
+// program the compile deletes.
+void CompileAndSetVShaderCmd::capture(CommandCapture &capture) const
+{
+    const std::vector<DWORD> &code = mTarget->getCode();
+    capture.writeName(CaptureName_Program, mTarget->getProgram());
+    capture.writeNewObject(mTarget);
+    capture.write(mShadowSamplers);
+    capture.writeData(code.data(), code.size()*sizeof(DWORD));
+}
+
+void CompileAndSetVShaderCmd::captured(CommandCapture &capture) const
+{
+    capture.addName(CaptureName_Program, mTarget->getProgram(), mTarget);
+}
+
+void CompileAndSetVShaderCmd::replay(CaptureReader &reader, CaptureReplay &replay)
+{
+    ULONG old_id = reader.read<ULONG>();
+    ULONG id = reader.read<ULONG>();
+    UINT shadowsamplers = reader.read<UINT>();
+    size_t size;
+    const DWORD *code = reinterpret_cast<const DWORD*>(reader.readData(size));
+    if(!code) return;
+
+    IDirect3DVertexShader9 *iface;
+    HRESULT hr = replay.getDevice()->CreateVertexShader(code, &iface);
+    if(FAILED(hr))
+    {
+        ERR("Failed to create vertex shader %lu: 0x%lx\n", id, hr);
+        return;
+    }
+    D3DGLVertexShader *shader = static_cast<D3DGLVertexShader*>(iface);
+    shader->setCompileSeq(
+        replay.send<CompileAndSetVShaderCmd>(shader, replay.getPipeline(), shadowsamplers)
+    );
+    // The program name is needed to replay the commands using it.
+    replay.getQueue().waitFor(shader->getCompileSeq());
+    replay.addObject(id, iface, shader, shader->getProgram());
+    replay.releaseObject(old_id);
+}
+
+void SetVShaderCmd::capture(CommandCapture &capture) const
+{
+    capture.writeName(CaptureName_Program, mProgram);
+}
+
+void SetVShaderCmd::replay(CaptureReader &reader, CaptureReplay &replay)
+{
+    replay.send<SetVShaderCmd>(replay.getPipeline(), replay.getName(reader.read<ULONG>()));
+}
 
 
 D3DGLVertexShader::D3DGLVertexShader(D3DGLDevice *parent)
   : mRefCount(0)
   , mParent(parent)
-  , mPendingUpdates(0)
+  , mCompileSeq(0)
   , mProgram(0)
   , mSamplerMask(0)
   , mShadowSamplers(0)
@@ -143,8 +215,7 @@ D3DGLVertexShader::~D3DGLVertexShader()
     if(GLuint program = mProgram.exchange(0))
     {
         mParent->getQueue().send<DeinitVShaderCmd>(program);
-        if(mPendingUpdates > 0)
-            mParent->getQueue().wakeAndSleep();
+        mParent->getQueue().waitFor(mCompileSeq);
     }
     mParent->Release();
 }
@@ -188,7 +259,7 @@ bool D3DGLVertexShader::init(const DWORD *data)
 
 void D3DGLVertexShader::checkShadowSamplers(UINT mask)
 {
-    if(mPendingUpdates > 0 || mProgram)
+    if(!mParent->getQueue().isExecuted(mCompileSeq) || mProgram)
     {
         if(mShadowSamplers == (mask&mSamplerMask))
             return;
@@ -198,8 +269,9 @@ void D3DGLVertexShader::checkShadowSamplers(UINT mask)
     }
 
     mShadowSamplers = (mask&mSamplerMask);
-    ++mPendingUpdates;
-    mParent->getQueue().doSend<CompileAndSetVShaderCmd>(this, mParent->getShaderPipeline(), mShadowSamplers);
+    CommandQueue::raiseSeq(mCompileSeq,
+        mParent->getQueue().doSend<CompileAndSetVShaderCmd>(this, mParent->getShaderPipeline(), mShadowSamplers)
+    );
 }
 
 